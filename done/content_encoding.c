@@ -0,0 +1,144 @@
+/**
+ * @file content_encoding.c
+ * @brief gzip and deflate compression of HTTP bodies (zlib).
+ */
+
+#include "content_encoding.h"
+#include "error.h"
+
+#include <limits.h> // for UINT_MAX
+#include <stdlib.h> // for malloc
+
+// zlib window bits: 15 for the zlib format ("deflate" in HTTP), + 16 for the gzip format
+#define WINDOW_BITS 15
+#define GZIP_WINDOW_BITS (WINDOW_BITS + 16)
+#define MEM_LEVEL 8
+
+const char* content_encoding_name(enum http_encoding encoding)
+{
+    switch (encoding) {
+    case HTTP_ENCODING_GZIP:    return "gzip";
+    case HTTP_ENCODING_DEFLATE: return "deflate";
+    default:                    return NULL;
+    }
+}
+
+static int deflate_init(z_stream* z, enum http_encoding encoding)
+{
+    if (encoding != HTTP_ENCODING_GZIP && encoding != HTTP_ENCODING_DEFLATE) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    z->zalloc = Z_NULL;
+    z->zfree = Z_NULL;
+    z->opaque = Z_NULL;
+    const int ret = deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                 encoding == HTTP_ENCODING_GZIP ? GZIP_WINDOW_BITS : WINDOW_BITS,
+                                 MEM_LEVEL, Z_DEFAULT_STRATEGY);
+    return ret == Z_OK ? ERR_NONE : (ret == Z_MEM_ERROR ? ERR_OUT_OF_MEMORY : ERR_RUNTIME);
+}
+
+int content_encode(enum http_encoding encoding, const char* in, size_t len,
+                   char** out, size_t* out_len)
+{
+    M_REQUIRE_NON_NULL(in);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_len);
+    if (len > UINT_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    z_stream z;
+    int ret = deflate_init(&z, encoding);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+
+    // the bound is for the zlib format: add room for the larger gzip header and trailer
+    const uLong bound = deflateBound(&z, (uLong) len) + 32;
+    *out = malloc(bound);
+    if (*out == NULL) {
+        deflateEnd(&z);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    z.next_in = (Bytef*) in;
+#pragma GCC diagnostic pop
+    z.avail_in = (uInt) len;
+    z.next_out = (Bytef*) *out;
+    z.avail_out = (uInt) bound;
+    ret = deflate(&z, Z_FINISH);
+    *out_len = (size_t) z.total_out;
+    deflateEnd(&z);
+
+    if (ret != Z_STREAM_END) {
+        free(*out);
+        *out = NULL;
+        return ERR_RUNTIME;
+    }
+    return ERR_NONE;
+}
+
+int encoding_stream_init(struct encoding_stream* stream, enum http_encoding encoding,
+                         JsonSink sink, void* arg)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(sink);
+
+    stream->sink = sink;
+    stream->arg = arg;
+    return deflate_init(&stream->z, encoding);
+}
+
+// runs deflate with flush, giving every full output buffer to the sink
+static int encoding_stream_run(struct encoding_stream* stream, int flush)
+{
+    int ret = Z_OK;
+    do {
+        stream->z.next_out = (Bytef*) stream->out;
+        stream->z.avail_out = ENCODING_OUT_SIZE;
+        ret = deflate(&stream->z, flush);
+        if (ret == Z_STREAM_ERROR) {
+            return ERR_RUNTIME;
+        }
+        const size_t produced = ENCODING_OUT_SIZE - stream->z.avail_out;
+        if (produced > 0) {
+            const int err = stream->sink(stream->arg, stream->out, produced);
+            if (err != ERR_NONE) {
+                return err;
+            }
+        }
+    } while (stream->z.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    return ERR_NONE;
+}
+
+int encoding_stream_sink(void* arg, const char* data, size_t len)
+{
+    M_REQUIRE_NON_NULL(arg);
+    M_REQUIRE_NON_NULL(data);
+    if (len > UINT_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct encoding_stream* stream = arg;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    stream->z.next_in = (Bytef*) data;
+#pragma GCC diagnostic pop
+    stream->z.avail_in = (uInt) len;
+    return encoding_stream_run(stream, Z_NO_FLUSH);
+}
+
+int encoding_stream_finish(struct encoding_stream* stream, int error)
+{
+    M_REQUIRE_NON_NULL(stream);
+
+    if (error == ERR_NONE) {
+        stream->z.next_in = Z_NULL;
+        stream->z.avail_in = 0;
+        error = encoding_stream_run(stream, Z_FINISH);
+    }
+    deflateEnd(&stream->z);
+    return error;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file content_encoding.h
+ * @brief gzip and deflate compression of HTTP bodies (zlib).
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <zlib.h>
+
+#include "http_prot.h"   // for enum http_encoding
+#include "json_writer.h" // for JsonSink
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// smaller bodies are not worth it: the gzip header alone is 18 bytes
+#define MIN_COMPRESS_SIZE 256
+
+#define ENCODING_OUT_SIZE 16384
+
+/**
+ * @brief Value of the Content-Encoding header for encoding, NULL for identity.
+ */
+const char* content_encoding_name(enum http_encoding encoding);
+
+/**
+ * @brief Compresses the len bytes of in; *out is allocated, to be freed by the caller.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int content_encode(enum http_encoding encoding, const char* in, size_t len,
+                   char** out, size_t* out_len);
+
+/**
+ * @brief Compression of a body produced piece by piece: it is a JsonSink
+ *        (encoding_stream_sink) whose compressed output goes to another sink.
+ */
+struct encoding_stream {
+    z_stream z;
+    JsonSink sink;
+    void* arg;
+    char out[ENCODING_OUT_SIZE];
+};
+
+int encoding_stream_init(struct encoding_stream* stream, enum http_encoding encoding,
+                         JsonSink sink, void* arg);
+
+/**
+ * @brief JsonSink compressing data into the encoding_stream arg.
+ */
+int encoding_stream_sink(void* arg, const char* data, size_t len);
+
+/**
+ * @brief Sends the end of the compressed data and frees the stream.
+ *        To be called once after a successful init, even after an error.
+ */
+int encoding_stream_finish(struct encoding_stream* stream, int error);
+
+#ifdef __cplusplus
+}
+#endif
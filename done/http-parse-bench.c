@@ -0,0 +1,144 @@
+/*
+ * @file http-parse-bench.c
+ * @brief Standalone benchmark and fuzz target for the HTTP request parser
+ *
+ * Benchmark: ./http-parse-bench [-n <rounds>] [-chunk <bytes>] <request file>...
+ *   Each file holds one raw captured request (e.g. the .http files of data/requests).
+ *   With -chunk, requests are fed to the parser <bytes> at a time, as they
+ *   would arrive from successive tcp_read().
+ *
+ * Fuzzing: make http-parse-fuzz && ./http-parse-fuzz data/requests/
+ *   Checks that parsing in two parts gives the same result as in one go.
+ */
+
+#include "error.h"
+#include "http_prot.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/********************************************************************/
+static int parse_in_chunks(const char* request, size_t len, size_t chunk,
+                           struct http_parser* parser, struct http_message* msg)
+{
+    http_parser_init(parser);
+    int ret = 0;
+    size_t available = 0;
+    do {
+        available = available + chunk < len ? available + chunk : len;
+        ret = http_parser_execute(parser, request, available, msg);
+    } while (ret == 0 && available < len);
+    return ret;
+}
+
+#ifdef FUZZING
+/********************************************************************/
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    const char* request = (const char*) data;
+    struct http_parser whole, split;
+    struct http_message msg_whole, msg_split;
+
+    const int ret_whole = parse_in_chunks(request, size, size > 0 ? size : 1, &whole, &msg_whole);
+    const size_t chunk = size > 0 ? (size_t) data[0] % size + 1 : 1;
+    const int ret_split = parse_in_chunks(request, size, chunk, &split, &msg_split);
+
+    if ((ret_whole < 0) != (ret_split < 0)) abort();
+    if (ret_whole == 1) {
+        if (ret_split != 1 || whole.header_len != split.header_len
+            || whole.num_headers != split.num_headers
+            || msg_whole.body.len != msg_split.body.len) abort();
+    }
+    return 0;
+}
+
+#else
+/********************************************************************/
+static char* read_file(const char* filename, size_t* len)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    const long pos = ftell(file);
+    rewind(file);
+    char* buffer = pos >= 0 ? malloc((size_t) pos + 1) : NULL;
+    if (buffer != NULL && fread(buffer, 1, (size_t) pos, file) != (size_t) pos) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    *len = pos >= 0 ? (size_t) pos : 0;
+    return buffer;
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    unsigned long rounds = 100000;
+    size_t chunk = 0;
+    int first = 1;
+    for (; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+        if (!strcmp(argv[first], "-n")) {
+            rounds = strtoul(argv[first + 1], NULL, 10);
+        } else if (!strcmp(argv[first], "-chunk")) {
+            chunk = strtoul(argv[first + 1], NULL, 10);
+        } else {
+            break;
+        }
+    }
+    if (first >= argc || rounds == 0) {
+        fprintf(stderr, "Usage: %s [-n <rounds>] [-chunk <bytes>] <request file>...\n", argv[0]);
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const int nb_requests = argc - first;
+    char** requests = calloc((size_t) nb_requests, sizeof(char*));
+    size_t* lengths = calloc((size_t) nb_requests, sizeof(size_t));
+    if (requests == NULL || lengths == NULL) {
+        free(requests);
+        free(lengths);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    size_t total_bytes = 0;
+    for (int i = 0; i < nb_requests; ++i) {
+        requests[i] = read_file(argv[first + i], &lengths[i]);
+        if (requests[i] == NULL) {
+            fprintf(stderr, "Cannot read \"%s\"\n", argv[first + i]);
+            return ERR_IO;
+        }
+        total_bytes += lengths[i];
+    }
+
+    struct http_parser parser;
+    struct http_message msg;
+    unsigned long complete = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long r = 0; r < rounds; ++r) {
+        for (int i = 0; i < nb_requests; ++i) {
+            const size_t step = chunk > 0 ? chunk : lengths[i];
+            if (parse_in_chunks(requests[i], lengths[i], step > 0 ? step : 1, &parser, &msg) == 1) {
+                ++complete;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) * 1e-9;
+    const double nb_parsed = (double) rounds * nb_requests;
+    printf("%d request(s) x %lu rounds, %lu complete\n", nb_requests, rounds, complete);
+    printf("%.0f requests/s, %.1f MB/s\n", nb_parsed / seconds,
+           (double) total_bytes * (double) rounds / seconds / 1e6);
+
+    for (int i = 0; i < nb_requests; ++i) {
+        free(requests[i]);
+    }
+    free(requests);
+    free(lengths);
+    return ERR_NONE;
+}
+#endif
@@ -10,18 +10,65 @@
 #include <sys/socket.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>   // PRIx64
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <signal.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
+#include "content_encoding.h"
+#include "metrics.h"
+#include "trace.h"
 #include "error.h"
 
-static int passive_socket = -1;
+// how long a reply may wait for room in the socket send buffer
+#define SEND_WAIT_MS 10000
+
+// what is read of a refused request before its connection is closed
+#define LINGER_MS        1000
+#define LINGER_MAX_BYTES (1 << 20)
+
+// how much of a streamed body is received at once
+#define STREAM_CHUNK_SIZE 65536
+
+// a chunked body (its length known only at its end) may take that much with its framing
+#define MAX_CHUNKED_REQUEST_SIZE (2 * MAX_REQUEST_SIZE)
+
+// the TCP ones, then the Unix domain one if any; -1 once closed. Whoever swaps a socket
+// out of its slot (an acceptor giving up or close_passive_sockets()) is the one closing it
+static int passive_sockets[MAX_ACCEPTORS + 1];
+static unsigned nb_passive_sockets;
+static char* unix_path;     // removed by http_close()
 static EventCallback cb;
+static StreamCallback stream_cb;
+static size_t stream_max_length;
+
+// admission limits (max_* of the options) and current load, updated atomically by all the threads
+static struct http_options limits;
+static unsigned open_connections;
+static unsigned in_flight;
+static size_t buffered;
+static uint64_t rejected_connections;
+static uint64_t rejected_requests;
+static uint64_t timed_out_idle;
+static uint64_t timed_out_header;
+static uint64_t timed_out_body;
+
+// set by http_drain(); drain_fd then becomes readable, which wakes up the idle connections
+static int draining;
+static int drain_fd = -1;
+// written by http_wake(), from a signal handler: http_receive() then returns
+static int wake_fd = -1;
 
 #define MK_OUR_ERR(X) \
 static int our_ ## X = X
@@ -31,6 +78,285 @@ MK_OUR_ERR(ERR_INVALID_ARGUMENT);
 MK_OUR_ERR(ERR_OUT_OF_MEMORY);
 MK_OUR_ERR(ERR_IO);
 
+/*******************************************************************
+ * Admission control: takes one of the max units of counter (0: unlimited)
+ */
+static int admit(unsigned* counter, unsigned max)
+{
+    const unsigned now = __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    if (max > 0 && now > max) {
+        __atomic_sub_fetch(counter, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static void release(unsigned* counter)
+{
+    __atomic_sub_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+void http_get_stats(struct http_stats* stats)
+{
+    if (stats == NULL) return;
+    stats->open_connections = __atomic_load_n(&open_connections, __ATOMIC_RELAXED);
+    stats->in_flight = __atomic_load_n(&in_flight, __ATOMIC_RELAXED);
+    stats->buffered = __atomic_load_n(&buffered, __ATOMIC_RELAXED);
+    stats->rejected_connections = __atomic_load_n(&rejected_connections, __ATOMIC_RELAXED);
+    stats->rejected_requests = __atomic_load_n(&rejected_requests, __ATOMIC_RELAXED);
+    stats->timed_out_idle = __atomic_load_n(&timed_out_idle, __ATOMIC_RELAXED);
+    stats->timed_out_header = __atomic_load_n(&timed_out_header, __ATOMIC_RELAXED);
+    stats->timed_out_body = __atomic_load_n(&timed_out_body, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************
+ * Turns a request away; the client should retry after RETRY_AFTER_SECONDS.
+ * With closing set, the connection is closed after it (body left unread).
+ */
+static void reply_unavailable(int connection, int closing)
+{
+    static const char body[] = "Error: Server overloaded, retry later\n";
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Retry-After: %d\r\n%s", RETRY_AFTER_SECONDS,
+             closing ? "Connection: close\r\n" : "");
+    __atomic_add_fetch(&rejected_requests, 1, __ATOMIC_RELAXED);
+    http_reply(connection, HTTP_SERVICE_UNAVAILABLE, headers, body, sizeof(body) - 1);
+}
+
+/*******************************************************************
+ * A request the server will not take whole: the reply says so, then the
+ * connection is closed with the body left unread. What the client already
+ * sent is read (for a while) first, so that the reply is not lost in a reset.
+ */
+static void reply_and_close(int connection, const char* status, const char* body)
+{
+    http_reply(connection, status, "Connection: close\r\n", body, strlen(body));
+    shutdown(connection, SHUT_WR);
+
+    char discard[4096];
+    size_t left = LINGER_MAX_BYTES;
+    struct pollfd pfd = { .fd = connection, .events = POLLIN, .revents = 0 };
+    while (left > 0 && poll(&pfd, 1, LINGER_MS) > 0) {
+        const ssize_t read_ = recv(connection, discard, sizeof(discard), MSG_DONTWAIT);
+        if (read_ <= 0) {
+            break;
+        }
+        left = (size_t) read_ < left ? left - (size_t) read_ : 0;
+    }
+}
+
+static void reply_too_large(int connection)
+{
+    reply_and_close(connection, HTTP_PAYLOAD_TOO_LARGE, "Error: Request too large\n");
+}
+
+/*******************************************************************
+ * Deadlines: reads of a connection wait at most timeout_ms for data to come
+ * (0: forever, negative: not at all, the deadline is passed).
+ * Returns 1 if readable, 0 on timeout (counted in counter), <0 on error.
+ * An idle connection (between two requests) also stops waiting, with 0
+ * but not counted, once the server drains.
+ */
+static int64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int wait_readable(int connection, int timeout_ms, uint64_t* counter, int idle)
+{
+    struct pollfd pfd[2] = {
+        { .fd = connection, .events = POLLIN, .revents = 0 },
+        { .fd = drain_fd,   .events = POLLIN, .revents = 0 }
+    };
+    const nfds_t nfds = idle && drain_fd >= 0 ? 2 : 1;
+    int ret = 0;
+    do {
+        ret = poll(pfd, nfds, timeout_ms == 0 ? -1 : (timeout_ms < 0 ? 0 : timeout_ms));
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0 && !(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+        return 0;   // draining
+    }
+    if (ret == 0) {
+        __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    }
+    return ret < 0 ? ERR_IO : ret;
+}
+
+static int is_draining(void)
+{
+    return __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+}
+
+// a request whose headers or body do not come in time
+static void reply_timeout(int connection)
+{
+    static const char body[] = "Error: Request timeout\n";
+    http_reply(connection, HTTP_REQUEST_TIMEOUT, "Connection: close\r\n", body, sizeof(body) - 1);
+}
+
+/*******************************************************************
+ * Receive buffer of a connection, reused for all its (keep-alive) requests.
+ * Bytes beyond the current request (pipelined requests) are kept.
+ * The bytes of all the buffers are accounted in buffered.
+ */
+struct conn_buffer {
+    char* data;
+    size_t size;    // allocated bytes
+    size_t len;     // received bytes not consumed yet
+};
+
+// makes room for at least needed bytes; growing beyond the headers is subject to max_buffered
+static int conn_buffer_reserve(struct conn_buffer* buf, size_t needed)
+{
+    if (needed <= buf->size) {
+        return ERR_NONE;
+    }
+    const size_t growth = needed - buf->size;
+    const size_t total = __atomic_add_fetch(&buffered, growth, __ATOMIC_RELAXED);
+    char* data = NULL;
+    if (limits.max_buffered == 0 || needed <= MAX_HEADER_SIZE || total <= limits.max_buffered) {
+        data = realloc(buf->data, needed);
+    }
+    if (data == NULL) {
+        __atomic_sub_fetch(&buffered, growth, __ATOMIC_RELAXED);
+        return ERR_OUT_OF_MEMORY;
+    }
+    buf->data = data;
+    buf->size = needed;
+    return ERR_NONE;
+}
+
+// drops the first consumed bytes (a processed request) and moves the rest to the front
+static void conn_buffer_consume(struct conn_buffer* buf, size_t consumed)
+{
+    buf->len -= consumed;
+    if (buf->len > 0) {
+        memmove(buf->data, buf->data + consumed, buf->len);
+    }
+
+    // do not keep a large upload buffer for an idle keep-alive connection
+    if (buf->size > MAX_HEADER_SIZE && buf->len <= MAX_HEADER_SIZE) {
+        char* data = realloc(buf->data, MAX_HEADER_SIZE);
+        if (data != NULL) {
+            __atomic_sub_fetch(&buffered, buf->size - MAX_HEADER_SIZE, __ATOMIC_RELAXED);
+            buf->data = data;
+            buf->size = MAX_HEADER_SIZE;
+        }
+    }
+}
+
+/*******************************************************************
+ * Streamed request body: received in rcvbuf right after the headers,
+ * which stay in place so that the http_message remains valid.
+ */
+struct http_body_reader {
+    int connection;
+    struct conn_buffer* buf;
+    size_t body_start;  // where body chunks are received
+    size_t pos;         // first byte of buf not given out yet
+    size_t remaining;   // body bytes not given out yet
+    size_t length;      // whole body
+};
+
+size_t http_body_length(const struct http_body_reader* reader)
+{
+    return reader != NULL ? reader->length : 0;
+}
+
+ssize_t http_body_next(struct http_body_reader* reader, const char** data)
+{
+    M_REQUIRE_NON_NULL(reader);
+    M_REQUIRE_NON_NULL(data);
+
+    if (reader->remaining == 0) {
+        return 0;
+    }
+
+    struct conn_buffer* buf = reader->buf;
+    if (reader->pos >= buf->len) {
+        // everything given out: receive the next chunk over the previous one
+        buf->len = reader->body_start;
+        reader->pos = reader->body_start;
+        size_t room = buf->size - buf->len;
+        if (room > reader->remaining) {
+            room = reader->remaining;   // leave the next request in the socket
+        }
+        const int ready = wait_readable(reader->connection, limits.body_timeout_ms, &timed_out_body, 0);
+        if (ready <= 0) {
+            return ERR_IO;
+        }
+        ssize_t read_ = 0;
+        do {
+            read_ = tcp_read(reader->connection, buf->data + buf->len, room);
+        } while (read_ < 0 && errno == EINTR);
+        if (read_ <= 0) {
+            return ERR_IO;
+        }
+        buf->len += (size_t) read_;
+    }
+
+    // bytes already received may go beyond this body (pipelined request)
+    size_t len = buf->len - reader->pos;
+    if (len > reader->remaining) {
+        len = reader->remaining;
+    }
+    *data = buf->data + reader->pos;
+    reader->pos += len;
+    reader->remaining -= len;
+    return (ssize_t) len;
+}
+
+int http_body_discard(struct http_body_reader* reader)
+{
+    M_REQUIRE_NON_NULL(reader);
+
+    const char* data = NULL;
+    ssize_t ret = 0;
+    while ((ret = http_body_next(reader, &data)) > 0);
+    return (int) ret;
+}
+
+/*******************************************************************
+ * Give the request to the stream callback before its body is received.
+ * Returns 1 if the request was handled, 0 if declined, <0 on error.
+ */
+static int stream_request(int connection, struct conn_buffer* buf, struct http_parser* parser,
+                          struct http_message* message)
+{
+    int ret = conn_buffer_reserve(buf, parser->header_len + STREAM_CHUNK_SIZE);
+    if (ret != ERR_NONE) {
+        reply_unavailable(connection, 1);
+        return ret;
+    }
+    // buf may have moved: refresh the pointers of message
+    ret = http_parser_execute(parser, buf->data, buf->len, message);
+    if (ret < 0) {
+        return ret;
+    }
+
+    struct http_body_reader reader = {
+        .connection = connection, .buf = buf,
+        .body_start = parser->header_len, .pos = parser->header_len,
+        .remaining = parser->content_length, .length = parser->content_length
+    };
+    if (!admit(&in_flight, limits.max_in_flight)) {
+        reply_unavailable(connection, 1);
+        return ERR_IO;
+    }
+    ret = stream_cb(message, connection, &reader);
+    release(&in_flight);
+    if (ret == HTTP_STREAM_DECLINED) {
+        return 0;
+    }
+    if (reader.remaining > 0) {
+        return ERR_IO;  // cannot tell where the next request starts
+    }
+    conn_buffer_consume(buf, reader.pos);
+    return 1;
+}
+
 /*******************************************************************
  * Handle connection, multithreaded (detached --> return values dont matter --> simple "return NULL;")
  * arg is the socket file descriptor (on heap)
@@ -38,127 +364,187 @@ MK_OUR_ERR(ERR_IO);
  */
 static void *handle_connection(void *arg)
 {
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT );
-    sigaddset(&mask, SIGTERM);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
-
     if (arg == NULL) return &our_ERR_INVALID_ARGUMENT;
 
     int active_socket = *(int*)arg;
 
-    char* rcvbuf = calloc(1, MAX_HEADER_SIZE);
-    if(rcvbuf == NULL) {
-        close(active_socket);
-        return NULL;
-    }
-    ssize_t read_ = 0;
-    ssize_t r_total = 0;
+    struct conn_buffer rcvbuf = { NULL, 0, 0 };
     struct http_message message;
-    int content_length = 0;
-    int extended = 0;
-    while(1) {
-        read_ = tcp_read(active_socket, rcvbuf + r_total, (size_t)MAX_HEADER_SIZE + (size_t)content_length - (size_t)r_total);
-        // connection abandoned or recv error
-        if (read_ <= 0) {
-            if (close(active_socket) == -1) {
-                perror("Error in close() of active_socket");
-            }
-            free(rcvbuf);
-            free(arg);
-            return NULL;
+    struct http_parser parser;
+    http_parser_init(&parser);
+    int stream_offered = 0;
+    int64_t header_deadline = 0;    // of the request being received, 0 before its first byte
+    struct trace_span request_span, receive_span, handle_span;
+    int receiving = 0;              // the first byte of a request is there
+
+    while (conn_buffer_reserve(&rcvbuf, MAX_HEADER_SIZE) == ERR_NONE) {
+        if (!receiving && rcvbuf.len > 0) {
+            receiving = 1;
+            TRACE_REQUEST_BEGIN();
+            TRACE_SPAN_BEGIN(&request_span, "request");
+            TRACE_SPAN_BEGIN(&receive_span, "receive");
         }
-        r_total += read_;
 
-        int ret = http_parse_message(rcvbuf, (size_t)r_total, &message, &content_length);
+        // first process what is already there: it may hold several pipelined requests
+        // (the parser resumes where it stopped, even if rcvbuf was moved by realloc)
+        int ret = http_parser_execute(&parser, rcvbuf.data, rcvbuf.len, &message);
 
         // case: problem
-        if(ret < 0) {
-            free(rcvbuf);
-            if (close(active_socket) == -1) {
-                perror("Error in close() of active_socket");
-            }
-            free(arg);
-            return NULL;
+        if (ret == NOT_IMPLEMENTED) {
+            reply_and_close(active_socket, HTTP_NOT_IMPLEMENTED, "Error: Transfer coding not supported\n");
+            break;
+        }
+        if (ret < 0) {
+            reply_and_close(active_socket, HTTP_BAD_REQUEST, "Error: Malformed request\n");
+            break;
         }
 
-        // case: extended but still need a few reads
-        if (extended && message.body.len < content_length) {
+        // case: message fully received, now process it on our end (server side)
+        if (ret > 0) {
+            TRACE_SPAN_END(&receive_span);
+            TRACE_SPAN_BEGIN(&handle_span, "handle");
+            http_decode_chunked_body(&parser, rcvbuf.data, &message);
+            if (admit(&in_flight, limits.max_in_flight)) {
+                cb(&message, active_socket);
+                release(&in_flight);
+            } else {
+                reply_unavailable(active_socket, 0);
+            }
+            TRACE_SPAN_END(&handle_span);
+            TRACE_SPAN_END(&request_span);
+            TRACE_REQUEST_END();
+            if (is_draining()) {
+                break;  // the reply said "Connection: close"
+            }
+            receiving = 0;
+            conn_buffer_consume(&rcvbuf, parser.message_len);
+            http_parser_init(&parser);
+            stream_offered = 0;
+            header_deadline = 0;
             continue;
         }
 
-        // case: allocate more memory
-        if (ret == 0 && !extended && content_length > 0) {
-            extended = 1;
-            char* new_rcvbuf = realloc(rcvbuf, (unsigned long)MAX_HEADER_SIZE + (unsigned long)content_length);
-            if (new_rcvbuf == NULL) {
-                free(rcvbuf);
-                if (close(active_socket) == -1) {
-                    perror("Error in close() of active_socket");
+        // case: body still to come, the stream callback may take it as it arrives
+        // (only with a Content-Length: the callbacks need the length up front)
+        if (parser.state >= HTTP_STATE_BODY && !parser.chunked && stream_cb != NULL && !stream_offered) {
+            // refused before a callback reserves room for it
+            if (parser.content_length > stream_max_length) {
+                reply_too_large(active_socket);
+                break;
+            }
+            stream_offered = 1;
+            TRACE_SPAN_BEGIN(&handle_span, "handle_stream");
+            ret = stream_request(active_socket, &rcvbuf, &parser, &message);
+            if (ret < 0) {
+                break;
+            }
+            if (ret > 0) {
+                TRACE_SPAN_END(&handle_span);
+                TRACE_SPAN_END(&request_span);
+                TRACE_REQUEST_END();
+                if (is_draining()) {
+                    break;
                 }
-                free(arg);
-                return NULL;
+                receiving = 0;
+                http_parser_init(&parser);
+                stream_offered = 0;
+                header_deadline = 0;
+                continue;
             }
-            rcvbuf = new_rcvbuf;
-            memset(rcvbuf + MAX_HEADER_SIZE, 0, content_length);
         }
 
-        // case: message fully received, now process it on our end (server side)
-        if (ret > 0) {
-            cb(&message, active_socket);
-            read_ = 0;
-            r_total = 0;
-            content_length = 0;
-            extended = 0;
-            free(rcvbuf);
-            rcvbuf = calloc(1, MAX_HEADER_SIZE);
-            if (rcvbuf == NULL) {
-                if (close(active_socket) == -1) {
-                    perror("Error in close() of active_socket");
-                }
-                free(arg);
-                return NULL;
+        // case: need more bytes; headers must fit in MAX_HEADER_SIZE, body is received after them
+        if (parser.state >= HTTP_STATE_BODY && parser.chunked) {
+            // the buffer grows (doubles) as the chunks come
+            const size_t max = parser.header_len + MAX_CHUNKED_REQUEST_SIZE;
+            if (parser.content_length > MAX_REQUEST_SIZE || rcvbuf.len >= max) {
+                reply_too_large(active_socket);
+                break;
+            }
+            if (rcvbuf.len == rcvbuf.size
+                && conn_buffer_reserve(&rcvbuf, 2 * rcvbuf.size < max ? 2 * rcvbuf.size : max) != ERR_NONE) {
+                reply_unavailable(active_socket, 1);
+                break;
             }
+        } else if (parser.state >= HTTP_STATE_BODY) {
+            if (parser.content_length > MAX_REQUEST_SIZE) {
+                reply_too_large(active_socket);
+                break;
+            }
+            if (conn_buffer_reserve(&rcvbuf, parser.header_len + parser.content_length) != ERR_NONE) {
+                reply_unavailable(active_socket, 1);
+                break;
+            }
+        } else if (rcvbuf.len >= MAX_HEADER_SIZE) {
+            reply_and_close(active_socket, HTTP_HEADERS_TOO_LARGE, "Error: Request headers too large\n");
+            break;
+        }
+
+        // wait for the next bytes: a new request (idle), the end of the headers
+        // (from the first byte of the request), or more of the body
+        int ready = 0;
+        if (parser.state >= HTTP_STATE_BODY) {
+            ready = wait_readable(active_socket, limits.body_timeout_ms, &timed_out_body, 0);
+        } else if (rcvbuf.len == 0) {
+            ready = wait_readable(active_socket, limits.idle_timeout_ms, &timed_out_idle, 1);
+            header_deadline = 0;
+        } else {
+            if (header_deadline == 0) {
+                header_deadline = now_ms() + limits.header_timeout_ms;
+            }
+            const int64_t left = header_deadline - now_ms();
+            ready = wait_readable(active_socket, limits.header_timeout_ms == 0 ? 0 : (left > 0 ? (int) left : -1),
+                                  &timed_out_header, 0);
+        }
+        if (ready == 0 && rcvbuf.len > 0) {
+            reply_timeout(active_socket);
+        }
+        if (ready <= 0) {
+            break;
         }
+
+        const ssize_t read_ = tcp_read(active_socket, rcvbuf.data + rcvbuf.len, rcvbuf.size - rcvbuf.len);
+        // connection abandoned or recv error
+        if (read_ <= 0) {
+            break;
+        }
+        rcvbuf.len += (size_t) read_;
     }
 
     if (close(active_socket) == -1) {
         perror("Error in close() of active_socket");
     }
 
+    __atomic_sub_fetch(&buffered, rcvbuf.size, __ATOMIC_RELAXED);
+    free(rcvbuf.data);
     free(arg);
+    release(&open_connections);
     return NULL;
 }
 
 
 /*******************************************************************
- * Init connection
+ * Over max_connections: a 503 from the accepting thread, without
+ * waiting (the send buffer of a new connection has room for it)
  */
-int http_init(uint16_t port, EventCallback callback)
+static void reject_connection(int connection)
 {
-    passive_socket = tcp_server_init(port);
-    cb = callback;
-    return passive_socket;
-}
-
-/*******************************************************************
- * Close connection
- */
-void http_close(void)
-{
-    if (passive_socket > 0) {
-        if (close(passive_socket) == -1)
-            perror("close() in http_close()");
-        else
-            passive_socket = -1;
+    char reply[256];
+    static const char body[] = "Error: Too many connections, retry later\n";
+    const int len = snprintf(reply, sizeof(reply), "%s%s%sRetry-After: %d\r\nConnection: close\r\n"
+                             "Content-Length: %zu%s%s", HTTP_PROTOCOL_ID, HTTP_SERVICE_UNAVAILABLE,
+                             HTTP_LINE_DELIM, RETRY_AFTER_SECONDS, sizeof(body) - 1, HTTP_HDR_END_DELIM, body);
+    if (len > 0 && (size_t) len < sizeof(reply)) {
+        send(connection, reply, (size_t) len, MSG_DONTWAIT | MSG_NOSIGNAL);
     }
+    __atomic_add_fetch(&rejected_connections, 1, __ATOMIC_RELAXED);
+    close(connection);
 }
 
 /*******************************************************************
- * Receive content
+ * Accepts one connection on passive_socket and starts its thread
  */
-int http_receive(void)
+static int accept_connection(int passive_socket)
 {
     // part 1: connect to socket with tcp_accept
     int* active_socket = calloc(1, sizeof(int));
@@ -170,27 +556,44 @@ int http_receive(void)
         free(active_socket);
         return ERR_IO;
     }
+    if (!admit(&open_connections, limits.max_connections)) {
+        reject_connection(*active_socket);
+        free(active_socket);
+        return ERR_NONE;
+    }
 
     // part 2: tool function handle_connection
     pthread_attr_t attr;
     if (pthread_attr_init(&attr)) {
         perror("Error initializing thread attribute");
+        close(*active_socket);
         free(active_socket);
+        release(&open_connections);
         return ERR_THREADING;
     }
 
     if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)) {
         perror("Error setting thread attribute");
         pthread_attr_destroy(&attr);
+        close(*active_socket);
         free(active_socket);
+        release(&open_connections);
         return ERR_THREADING;
     }
 
+    // signals are left to the main thread: blocked from the start of the thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
     pthread_t thread;
-    if (pthread_create(&thread, &attr, handle_connection, active_socket)) {
+    const int created = pthread_create(&thread, &attr, handle_connection, active_socket);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (created) {
         perror("Error creating thread");
-        pthread_attr_destroy(&attr);
+        close(*active_socket);
         free(active_socket);
+        release(&open_connections);
         return ERR_THREADING;
     }
 
@@ -198,58 +601,494 @@ int http_receive(void)
 }
 
 /*******************************************************************
- * Serve a file content over HTTP
+ * Additional acceptor: accepts on its own socket until it fails
+ * (e.g. closed by http_close())
  */
-int http_serve_file(int connection, const char* filename)
+static void* acceptor(void* arg)
 {
-    M_REQUIRE_NON_NULL(filename);
+    const size_t i = (size_t) arg;
+    const int sock = __atomic_load_n(&passive_sockets[i], __ATOMIC_ACQUIRE);
+    int err = ERR_NONE;
+    while ((err = accept_connection(sock)) == ERR_NONE);
 
-    // open file
-    FILE* file = fopen(filename, "r");
-    if (file == NULL) {
-        fprintf(stderr, "http_serve_file(): Failed to open file \"%s\"\n", filename);
-        return http_reply(connection, "404 Not Found", "", "", 0);
+    // a socket nobody accepts on any more must not get new connections; if it is
+    // no longer in its slot, close_passive_sockets() took (and closes) it
+    if (__atomic_exchange_n(&passive_sockets[i], -1, __ATOMIC_ACQ_REL) == sock) {
+        fprintf(stderr, "acceptor %zu failed: %s\n", i, ERR_MSG(err));
+        shutdown(sock, SHUT_RDWR);
+        close(sock);
+    }
+    return NULL;
+}
+
+static int start_acceptor(size_t i)
+{
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr)) {
+        return ERR_THREADING;
     }
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-    // get its size
-    fseek(file, 0, SEEK_END);
-    const long pos = ftell(file);
-    if (pos < 0) {
-        fprintf(stderr, "http_serve_file(): Failed to tell file size of \"%s\"\n",
-                filename);
-        fclose(file);
+    // signals are left to the main thread (accept_connection() blocks them the same
+    // way for the connection threads it starts)
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t thread;
+    const int ret = pthread_create(&thread, &attr, acceptor, (void*) i);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    return ret ? ERR_THREADING : ERR_NONE;
+}
+
+/*******************************************************************
+ * Init connection
+ */
+int http_init(uint16_t port, EventCallback callback)
+{
+    const struct http_options options = { DEFAULT_BACKLOG, 1, 0, 0, 0, 0, 0, 0, 0, NULL };
+    return http_init_options(port, callback, &options);
+}
+
+int http_init_options(uint16_t port, EventCallback callback, const struct http_options* options)
+{
+    M_REQUIRE_NON_NULL(options);
+    if (options->acceptors == 0 || options->acceptors > MAX_ACCEPTORS || options->backlog <= 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    cb = callback;
+    limits = *options;
+
+    if ((drain_fd < 0 && (drain_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        || (wake_fd < 0 && (wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)) {
+        perror("eventfd() in http_init_options()");
         return ERR_IO;
     }
-    rewind(file);
-    const size_t file_size = (size_t) pos;
 
-    // read file content
-    char* const buffer = calloc(file_size + 1, 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "http_serve_file(): Failed to allocate memory to serve \"%s\"\n", filename);
-        fclose(file);
+    for (size_t i = 0; i < MAX_ACCEPTORS + 1; ++i) {
+        passive_sockets[i] = -1;
+    }
+    const int reuseport = options->acceptors > 1;
+    for (nb_passive_sockets = 0; nb_passive_sockets < options->acceptors; ++nb_passive_sockets) {
+        const int sock = tcp_server_listen(port, options->backlog, reuseport);
+        if (sock < 0) {
+            http_close();
+            return sock;
+        }
+        passive_sockets[nb_passive_sockets] = sock;
+    }
+    if (options->unix_path != NULL) {
+        const int sock = unix_server_listen(options->unix_path, options->backlog);
+        unix_path = sock >= 0 ? strdup(options->unix_path) : NULL;
+        if (unix_path == NULL) {
+            if (sock >= 0) {
+                close(sock);
+                unlink(options->unix_path);
+            }
+            http_close();
+            return sock < 0 ? sock : ERR_OUT_OF_MEMORY;
+        }
+        passive_sockets[nb_passive_sockets++] = sock;
+    }
+    for (size_t i = 1; i < nb_passive_sockets; ++i) {
+        const int ret = start_acceptor(i);
+        if (ret) {
+            http_close();
+            return ret;
+        }
+    }
+    return passive_sockets[0];
+}
+
+void http_set_stream_callback(StreamCallback callback, size_t max_length)
+{
+    stream_cb = callback;
+    stream_max_length = max_length;
+}
+
+static void static_files_clear(void);
+
+/*******************************************************************
+ * Close connection
+ */
+static void close_passive_sockets(void)
+{
+    for (size_t i = 0; i < nb_passive_sockets; ++i) {
+        const int sock = __atomic_exchange_n(&passive_sockets[i], -1, __ATOMIC_ACQ_REL);
+        if (sock >= 0) {
+            // shutdown() wakes up a thread blocked in accept(), close() alone does not
+            shutdown(sock, SHUT_RDWR);
+            if (close(sock) == -1)
+                perror("close() in http_close()");
+        }
+    }
+    nb_passive_sockets = 0;
+}
+
+/*******************************************************************
+ * Drain: stop accepting, then wait for the open connections
+ */
+unsigned http_drain(void)
+{
+    __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+    close_passive_sockets();
+    if (drain_fd >= 0) {
+        const uint64_t one = 1;
+        if (write(drain_fd, &one, sizeof(one)) != (ssize_t) sizeof(one)) {
+            perror("write() in http_drain()");
+        }
+    }
+
+    const int64_t deadline = now_ms() + limits.drain_timeout_ms;
+    unsigned left = 0;
+    while ((left = __atomic_load_n(&open_connections, __ATOMIC_ACQUIRE)) > 0
+           && (limits.drain_timeout_ms == 0 || now_ms() < deadline)) {
+        const struct timespec pause = { 0, 10 * 1000000 };
+        nanosleep(&pause, NULL);
+    }
+    return left;
+}
+
+void http_close(void)
+{
+    close_passive_sockets();
+    if (unix_path != NULL) {
+        unlink(unix_path);
+        free(unix_path);
+        unix_path = NULL;
+    }
+    static_files_clear();
+}
+
+/*******************************************************************
+ * Receive content
+ */
+int http_receive(void)
+{
+    const int sock = __atomic_load_n(&passive_sockets[0], __ATOMIC_ACQUIRE);
+    struct pollfd pfd[2] = {
+        { .fd = sock,    .events = POLLIN, .revents = 0 },
+        { .fd = wake_fd, .events = POLLIN, .revents = 0 }
+    };
+    int ret = 0;
+    do {
+        ret = poll(pfd, wake_fd >= 0 ? 2 : 1, -1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 || (pfd[0].revents & POLLNVAL)) {
         return ERR_IO;
     }
+    if (pfd[1].revents & POLLIN) {
+        return ERR_NONE;    // woken up by http_wake()
+    }
+    return accept_connection(sock);
+}
+
+void http_wake(void)
+{
+    if (wake_fd >= 0) {
+        const uint64_t one = 1;
+        // nothing to do if it fails: the counter is already set
+        if (write(wake_fd, &one, sizeof(one)) < 0) {
+            return;
+        }
+    }
+}
+
+/*******************************************************************
+ * Static files (the front page), kept in memory with their gzip variant.
+ * A cached file is checked against the disk (stat) at most once per
+ * STATIC_REVALIDATE_MS, and reloaded if it changed.
+ */
+#define MAX_STATIC_FILES 8
+#define STATIC_REVALIDATE_MS 1000
+// "<size>-<mtime in ns>[-gzip]", in hex, quotes included
+#define STATIC_ETAG_SIZE 48
+
+struct static_file {
+    unsigned refs;          // the cache, and each reply being sent; static_mutex held
+    char* data;
+    size_t len;
+    char* gzip;             // NULL if not worth compressing
+    size_t gzip_len;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char etag[STATIC_ETAG_SIZE];
+};
+
+struct static_slot {
+    char* filename;
+    struct static_file* file;
+    int64_t checked_ms;     // last stat()
+};
+
+static struct static_slot static_files[MAX_STATIC_FILES];
+static pthread_mutex_t static_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    const size_t bytes_read = fread(buffer, 1, file_size, file);
-    if (bytes_read != file_size) {
+// static_mutex held
+static void static_file_release(struct static_file* file)
+{
+    if (file != NULL && --file->refs == 0) {
+        free(file->data);
+        free(file->gzip);
+        free(file);
+    }
+}
+
+static int same_file(const struct static_file* file, const struct stat* st)
+{
+    return file->dev == st->st_dev && file->ino == st->st_ino && file->len == (size_t) st->st_size
+           && file->mtime.tv_sec == st->st_mtim.tv_sec && file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static struct static_slot* static_slot_of(const char* filename)
+{
+    for (size_t i = 0; i < MAX_STATIC_FILES; ++i) {
+        if (static_files[i].filename != NULL && !strcmp(static_files[i].filename, filename)) {
+            return &static_files[i];
+        }
+    }
+    return NULL;
+}
+
+// reads the file and compresses it; *file has one reference
+static int static_file_load(const char* filename, struct static_file** file)
+{
+    const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return ERR_IO;
+    }
+    struct stat st;
+    struct static_file* loaded = NULL;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)
+        || (loaded = calloc(1, sizeof(struct static_file))) == NULL
+        || (loaded->data = malloc((size_t) st.st_size + 1)) == NULL) {
+        fprintf(stderr, "http_serve_file(): Failed to load \"%s\"\n", filename);
+        free(loaded);
+        close(fd);
+        return ERR_IO;
+    }
+    size_t done = 0;
+    while (done < (size_t) st.st_size) {
+        const ssize_t n = read(fd, loaded->data + done, (size_t) st.st_size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += (size_t) n;
+    }
+    close(fd);
+    if (done != (size_t) st.st_size) {
         fprintf(stderr, "http_serve_file(): Failed to read \"%s\"\n", filename);
-        fclose(file);
+        free(loaded->data);
+        free(loaded);
         return ERR_IO;
     }
 
-    // send the file
-    const int  ret = http_reply(connection, HTTP_OK,
-                                "Content-Type: text/html; charset=utf-8" HTTP_LINE_DELIM,
-                                buffer, file_size);
+    loaded->refs = 1;
+    loaded->len = done;
+    loaded->dev = st.st_dev;
+    loaded->ino = st.st_ino;
+    loaded->mtime = st.st_mtim;
+    snprintf(loaded->etag, STATIC_ETAG_SIZE, "\"%zx-%" PRIx64 "\"", loaded->len,
+             (uint64_t) st.st_mtim.tv_sec * 1000000000u + (uint64_t) st.st_mtim.tv_nsec);
+    if (loaded->len >= MIN_COMPRESS_SIZE
+        && content_encode(HTTP_ENCODING_GZIP, loaded->data, loaded->len, &loaded->gzip, &loaded->gzip_len)) {
+        loaded->gzip = NULL;    // served uncompressed then
+    }
+    *file = loaded;
+    return ERR_NONE;
+}
+
+// the cached file, revalidated or (re)loaded if needed; NULL if it cannot be read
+static struct static_file* static_file_get(const char* filename)
+{
+    const int64_t now = now_ms();
+    struct static_file* file = NULL;
+    pthread_mutex_lock(&static_mutex);
+    struct static_slot* slot = static_slot_of(filename);
+    if (slot != NULL && now - slot->checked_ms < STATIC_REVALIDATE_MS) {
+        file = slot->file;
+        ++file->refs;
+    }
+    pthread_mutex_unlock(&static_mutex);
+    if (file != NULL) {
+        return file;
+    }
+
+    struct stat st;
+    if (stat(filename, &st)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&static_mutex);
+    slot = static_slot_of(filename);
+    if (slot != NULL && same_file(slot->file, &st)) {
+        slot->checked_ms = now;
+        file = slot->file;
+        ++file->refs;
+    }
+    pthread_mutex_unlock(&static_mutex);
+    if (file != NULL || static_file_load(filename, &file)) {
+        return file;
+    }
 
-    // garbage collecting
-    fclose(file);
-    free(buffer);
+    // kept for the next requests if there is room (a reply in progress keeps the old version)
+    pthread_mutex_lock(&static_mutex);
+    slot = static_slot_of(filename);
+    for (size_t i = 0; slot == NULL && i < MAX_STATIC_FILES; ++i) {
+        if (static_files[i].filename == NULL && (static_files[i].filename = strdup(filename)) != NULL) {
+            slot = &static_files[i];
+        }
+    }
+    if (slot != NULL) {
+        static_file_release(slot->file);
+        slot->file = file;
+        slot->checked_ms = now;
+        ++file->refs;
+    }
+    pthread_mutex_unlock(&static_mutex);
+    return file;
+}
+
+static void static_files_clear(void)
+{
+    pthread_mutex_lock(&static_mutex);
+    for (size_t i = 0; i < MAX_STATIC_FILES; ++i) {
+        static_file_release(static_files[i].file);
+        free(static_files[i].filename);
+        static_files[i].filename = NULL;
+        static_files[i].file = NULL;
+    }
+    pthread_mutex_unlock(&static_mutex);
+}
+
+static const char* content_type_of(const char* filename)
+{
+    static const char* const types[][2] = {
+        { ".html", "text/html; charset=utf-8" },
+        { ".css",  "text/css; charset=utf-8" },
+        { ".js",   "text/javascript; charset=utf-8" },
+        { ".json", "application/json" },
+        { ".svg",  "image/svg+xml" },
+        { ".png",  "image/png" },
+        { ".jpg",  "image/jpeg" }
+    };
+    const char* ext = strrchr(filename, '.');
+    for (size_t i = 0; ext != NULL && i < sizeof(types) / sizeof(types[0]); ++i) {
+        if (!strcmp(ext, types[i][0])) {
+            return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+/*******************************************************************
+ * Serve a file content over HTTP, from memory
+ */
+int http_serve_file(int connection, const struct http_message* msg, const char* filename)
+{
+    M_REQUIRE_NON_NULL(filename);
+
+    struct static_file* file = static_file_get(filename);
+    if (file == NULL) {
+        fprintf(stderr, "http_serve_file(): Failed to open file \"%s\"\n", filename);
+        return http_reply(connection, "404 Not Found", "", "", 0);
+    }
+
+    const int gzip = msg != NULL && file->gzip != NULL
+                     && http_accept_encoding(http_get_header(msg, "Accept-Encoding")) == HTTP_ENCODING_GZIP;
+    // the gzip variant has its own ETag: "...-gzip" instead of "..."
+    char etag[STATIC_ETAG_SIZE];
+    snprintf(etag, sizeof(etag), "%.*s%s\"", (int) strlen(file->etag) - 1, file->etag, gzip ? "-gzip" : "");
+
+    char headers[256];
+    snprintf(headers, sizeof(headers), "Content-Type: %s" HTTP_LINE_DELIM "%s"
+             "Vary: Accept-Encoding" HTTP_LINE_DELIM "ETag: %s" HTTP_LINE_DELIM "Cache-Control: no-cache" HTTP_LINE_DELIM,
+             content_type_of(filename), gzip ? "Content-Encoding: gzip" HTTP_LINE_DELIM : "", etag);
+    int ret = ERR_NONE;
+    if (msg != NULL && http_etag_match(http_get_header(msg, "If-None-Match"), etag)) {
+        ret = http_reply_no_body(connection, HTTP_NOT_MODIFIED, headers);
+    } else {
+        ret = gzip ? http_reply(connection, HTTP_OK, headers, file->gzip, file->gzip_len)
+                   : http_reply(connection, HTTP_OK, headers, file->data, file->len);
+    }
+
+    pthread_mutex_lock(&static_mutex);
+    static_file_release(file);
+    pthread_mutex_unlock(&static_mutex);
     return ret;
 }
 
 
+/*******************************************************************
+ * Format status line and headers of a reply, returns the header length
+ */
+// while draining, replies tell the client that the connection is closed after them
+static const char* drain_header(const char* headers)
+{
+    return is_draining() && strstr(headers, "Connection:") == NULL ? "Connection: close" HTTP_LINE_DELIM : "";
+}
+
+static int format_reply_header(char* header, size_t header_size, const char* status,
+                               const char* headers, size_t body_len)
+{
+    const int header_len = snprintf(header, header_size, "%s%s%s%s%sContent-Length: %zu%s",
+                                    HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, drain_header(headers),
+                                    body_len, HTTP_HDR_END_DELIM);
+    if (header_len < 0 || (size_t) header_len >= header_size) {
+        return ERR_RUNTIME;
+    }
+    return header_len;
+}
+
+/*******************************************************************
+ * Wait until connection can take more data (after EAGAIN)
+ */
+static int wait_writable(int connection)
+{
+    struct pollfd pfd = { .fd = connection, .events = POLLOUT, .revents = 0 };
+    int ret = 0;
+    do {
+        ret = poll(&pfd, 1, SEND_WAIT_MS);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0 ? ERR_NONE : ERR_IO;
+}
+
+/*******************************************************************
+ * Send all the buffers of iov, resuming after partial writes.
+ * iov is modified to keep track of what has been sent.
+ */
+static int send_all_iov(int connection, struct iovec* iov, size_t iovcnt, int more)
+{
+    struct trace_span span;
+    TRACE_SPAN_BEGIN(&span, "send");
+    while (iovcnt > 0) {
+        const ssize_t sent = tcp_sendv(connection, iov, iovcnt, more);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(connection) == ERR_NONE) {
+                continue;
+            }
+            return ERR_IO;
+        }
+        metrics_add_bytes_sent((uint64_t) sent);
+
+        // skip what went out: fully sent buffers, then the start of a partial one
+        size_t done = (size_t) sent;
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    TRACE_SPAN_END(&span);
+    return ERR_NONE;
+}
+
 /*******************************************************************
  * Create and send HTTP reply
  */
@@ -262,34 +1101,234 @@ int http_reply(int connection, const char* status, const char* headers, const ch
     }
 
     char header[MAX_HEADER_SIZE];
-    memset(header, 0, sizeof(MAX_HEADER_SIZE));
-    int header_len = snprintf(header, sizeof(header), "%s%s%s%sContent-Length: %d%s",
-                              HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, body_len, HTTP_HDR_END_DELIM);
+    int header_len = format_reply_header(header, sizeof(header), status, headers, body_len);
+    if (header_len < 0) {
+        return header_len;
+    }
 
-    int msg_len = header_len + body_len;
-    char* buffer = (char*)calloc(msg_len, 1);
+    // header and body are gathered by the kernel, no intermediate buffer
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    struct iovec iov[2] = {
+        { .iov_base = header,       .iov_len = (size_t) header_len },
+        { .iov_base = (char*) body, .iov_len = body_len }
+    };
+#pragma GCC diagnostic pop
 
-    if (buffer == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
+    return send_all_iov(connection, iov, body_len > 0 ? 2 : 1, 0);
+}
 
-    if (memcpy(buffer, header, header_len) == NULL) {
-        free(buffer);
-        return ERR_IO;
+/*******************************************************************
+ * Send status line and headers only
+ */
+int http_reply_no_body(int connection, const char* status, const char* headers)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+
+    char header[MAX_HEADER_SIZE];
+    const int header_len = snprintf(header, sizeof(header), "%s%s%s%s%s%s",
+                                    HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, drain_header(headers),
+                                    HTTP_LINE_DELIM);
+    if (header_len < 0 || (size_t) header_len >= sizeof(header)) {
+        return ERR_RUNTIME;
     }
+    struct iovec iov = { .iov_base = header, .iov_len = (size_t) header_len };
+    return send_all_iov(connection, &iov, 1, 0);
+}
 
-    if (body_len > 0) {
-        if (memcpy(buffer + header_len, body, body_len) == NULL) {
-            free(buffer);
+/*******************************************************************
+ * Send len bytes of file fd from offset, with sendfile()
+ */
+static int send_file_region(int connection, int fd, uint64_t offset, size_t len)
+{
+    off_t off = (off_t) offset;
+    size_t remaining = len;
+    struct trace_span span;
+    TRACE_SPAN_BEGIN(&span, "sendfile");
+    while (remaining > 0) {
+        const ssize_t sent = tcp_sendfile(connection, fd, &off, remaining);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+            && wait_writable(connection) == ERR_NONE) {
+            continue;
+        }
+        if (sent <= 0) {    // error or file shorter than expected
             return ERR_IO;
         }
+        metrics_add_bytes_sent((uint64_t) sent);
+        remaining -= (size_t) sent;
     }
+    TRACE_SPAN_END(&span);
+    return ERR_NONE;
+}
 
-    ssize_t ret = tcp_send(connection, buffer, msg_len);
-    free(buffer);
-    if (ret != msg_len) {   // strict statement but should be true
-        return ERR_IO;
+/*******************************************************************
+ * Send HTTP reply whose body is a region of a file (zero-copy)
+ */
+int http_reply_file_range(int connection, const char* status, const char* headers,
+                          int fd, uint64_t offset, size_t len)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+
+    char header[MAX_HEADER_SIZE];
+    int header_len = format_reply_header(header, sizeof(header), status, headers, len);
+    if (header_len < 0) {
+        return header_len;
     }
 
-    return ERR_NONE;
+    // header goes first, MSG_MORE lets it share packets with the start of the body
+    struct iovec iov = { .iov_base = header, .iov_len = (size_t) header_len };
+    int ret = send_all_iov(connection, &iov, 1, len > 0);
+    if (ret != ERR_NONE) {
+        return ret;
+    }
+    return send_file_region(connection, fd, offset, len);
+}
+
+/*******************************************************************
+ * Send 206 reply with some byte ranges of a file region
+ */
+#define PART_HEADER_SIZE 256
+
+int http_reply_file_ranges(int connection, const char* headers, const char* content_type,
+                           int fd, uint64_t offset, size_t size,
+                           const struct http_range* ranges, size_t nb_ranges)
+{
+    M_REQUIRE_NON_NULL(headers);
+    M_REQUIRE_NON_NULL(content_type);
+    M_REQUIRE_NON_NULL(ranges);
+    if (nb_ranges == 0 || nb_ranges > MAX_RANGES) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char extra[MAX_HEADER_SIZE];
+    if (nb_ranges == 1) {
+        const int len = snprintf(extra, sizeof(extra), "%sContent-Type: %s%sContent-Range: bytes %zu-%zu/%zu%s",
+                                 headers, content_type, HTTP_LINE_DELIM,
+                                 ranges[0].start, ranges[0].start + ranges[0].len - 1, size, HTTP_LINE_DELIM);
+        if (len < 0 || (size_t) len >= sizeof(extra)) {
+            return ERR_RUNTIME;
+        }
+        return http_reply_file_range(connection, HTTP_PARTIAL, extra, fd, offset + ranges[0].start, ranges[0].len);
+    }
+
+    // multipart/byteranges: part headers are formatted first, the body length depends on them
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "imgfs-%016" PRIx64, offset ^ ((uint64_t) size << 32));
+    char parts[MAX_RANGES + 1][PART_HEADER_SIZE];
+    size_t parts_len[MAX_RANGES + 1];
+    size_t body_len = 0;
+    for (size_t i = 0; i <= nb_ranges; ++i) {
+        const int len = i < nb_ranges
+                        ? snprintf(parts[i], PART_HEADER_SIZE, "%s--%s%sContent-Type: %s%sContent-Range: bytes %zu-%zu/%zu%s",
+                                   HTTP_LINE_DELIM, boundary, HTTP_LINE_DELIM, content_type, HTTP_LINE_DELIM,
+                                   ranges[i].start, ranges[i].start + ranges[i].len - 1, size, HTTP_HDR_END_DELIM)
+                        : snprintf(parts[i], PART_HEADER_SIZE, "%s--%s--%s", HTTP_LINE_DELIM, boundary, HTTP_LINE_DELIM);
+        if (len < 0 || len >= PART_HEADER_SIZE) {
+            return ERR_RUNTIME;
+        }
+        parts_len[i] = (size_t) len;
+        body_len += parts_len[i] + (i < nb_ranges ? ranges[i].len : 0);
+    }
+
+    const int extra_len = snprintf(extra, sizeof(extra), "%sContent-Type: multipart/byteranges; boundary=%s%s",
+                                   headers, boundary, HTTP_LINE_DELIM);
+    if (extra_len < 0 || (size_t) extra_len >= sizeof(extra)) {
+        return ERR_RUNTIME;
+    }
+    char header[MAX_HEADER_SIZE];
+    const int header_len = format_reply_header(header, sizeof(header), HTTP_PARTIAL, extra, body_len);
+    if (header_len < 0) {
+        return header_len;
+    }
+
+    // reply header goes out with the first part header
+    struct iovec iov[2] = {
+        { .iov_base = header,   .iov_len = (size_t) header_len },
+        { .iov_base = parts[0], .iov_len = parts_len[0] }
+    };
+    int ret = send_all_iov(connection, iov, 2, 1);
+    for (size_t i = 0; ret == ERR_NONE && i < nb_ranges; ++i) {
+        ret = send_file_region(connection, fd, offset + ranges[i].start, ranges[i].len);
+        if (ret == ERR_NONE) {
+            struct iovec part = { .iov_base = parts[i + 1], .iov_len = parts_len[i + 1] };
+            ret = send_all_iov(connection, &part, 1, i + 1 < nb_ranges);
+        }
+    }
+    return ret;
+}
+
+/*******************************************************************
+ * Chunked replies: body of unknown length, sent as it is produced
+ */
+int http_reply_chunked_begin(int connection, const char* status, const char* headers)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+
+    char header[MAX_HEADER_SIZE];
+    const int header_len = snprintf(header, sizeof(header), "%s%s%s%s%sTransfer-Encoding: chunked%s",
+                                    HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, drain_header(headers),
+                                    HTTP_HDR_END_DELIM);
+    if (header_len < 0 || (size_t) header_len >= sizeof(header)) {
+        return ERR_RUNTIME;
+    }
+    struct iovec iov = { .iov_base = header, .iov_len = (size_t) header_len };
+    return send_all_iov(connection, &iov, 1, 1);
+}
+
+int http_send_chunk(int connection, const char* data, size_t len)
+{
+    if (len == 0) {
+        return ERR_NONE;    // an empty chunk would end the body
+    }
+    M_REQUIRE_NON_NULL(data);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    const struct iovec part = { .iov_base = (char*) data, .iov_len = len };
+#pragma GCC diagnostic pop
+    return http_send_chunk_iov(connection, &part, 1);
+}
+
+int http_send_chunk_iov(int connection, const struct iovec* parts, size_t nb_parts)
+{
+    M_REQUIRE_NON_NULL(parts);
+    if (nb_parts > MAX_CHUNK_PARTS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < nb_parts; ++i) {
+        len += parts[i].iov_len;
+    }
+    if (len == 0) {
+        return ERR_NONE;    // an empty chunk would end the body
+    }
+
+    char size_line[24];
+    const int size_len = snprintf(size_line, sizeof(size_line), "%zx%s", len, HTTP_LINE_DELIM);
+
+    // size line, data and CRLF in one system call
+    struct iovec iov[MAX_CHUNK_PARTS + 2];
+    iov[0].iov_base = size_line;
+    iov[0].iov_len = (size_t) size_len;
+    memcpy(iov + 1, parts, nb_parts * sizeof(struct iovec));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    iov[nb_parts + 1].iov_base = (char*) HTTP_LINE_DELIM;
+#pragma GCC diagnostic pop
+    iov[nb_parts + 1].iov_len = strlen(HTTP_LINE_DELIM);
+    return send_all_iov(connection, iov, nb_parts + 2, 1);
+}
+
+int http_reply_chunked_end(int connection)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    struct iovec iov = { .iov_base = (char*) "0" HTTP_HDR_END_DELIM, .iov_len = strlen("0" HTTP_HDR_END_DELIM) };
+#pragma GCC diagnostic pop
+    return send_all_iov(connection, &iov, 1, 0);
 }
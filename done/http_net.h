@@ -8,6 +8,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <sys/types.h> // ssize_t
+#include <sys/uio.h>   // struct iovec
 #include "http_prot.h" // for structs
 
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
@@ -15,12 +17,189 @@
 
 typedef int (*EventCallback)(struct http_message*, int);
 
+/**
+ * @brief Access to the body of a request while it is being received.
+ */
+struct http_body_reader;
+
+// returned by a StreamCallback which does not handle the request
+#define HTTP_STREAM_DECLINED 1
+
+/**
+ * @brief Called once the headers of a request are received but not its whole body.
+ *
+ * The callback either returns HTTP_STREAM_DECLINED without reading anything (the
+ * body is then buffered and the request given to the EventCallback as usual), or
+ * handles the request, reading the body with http_body_next() as it arrives.
+ * A body which is not completely read closes the connection. A request whose
+ * Content-Length is over the max_length given to http_set_stream_callback() is
+ * not offered: it gets 413 Payload Too Large and its connection is closed.
+ */
+typedef int (*StreamCallback)(struct http_message*, int, struct http_body_reader*);
+
+#define DEFAULT_BACKLOG 128
+#define MAX_ACCEPTORS 64
+
+// admission limits of the server; 0 means unlimited
+#define DEFAULT_MAX_CONNECTIONS 1024
+#define DEFAULT_MAX_IN_FLIGHT   256
+#define DEFAULT_MAX_BUFFERED    ((size_t) 256 << 20)
+// seconds a client turned away with 503 is asked to wait
+#define RETRY_AFTER_SECONDS 1
+
+// how long a connection may wait for a new request, take to send its headers,
+// or leave its body without progress; 0 means no limit
+#define DEFAULT_IDLE_TIMEOUT_MS   60000
+#define DEFAULT_HEADER_TIMEOUT_MS 10000
+#define DEFAULT_BODY_TIMEOUT_MS   30000
+// how long http_drain() lets the requests in progress finish; 0 means no limit
+#define DEFAULT_DRAIN_TIMEOUT_MS  10000
+
+struct http_options {
+    int backlog;            // pending connections per listening socket
+    unsigned acceptors;     // listening sockets, each with its own accepting thread
+    unsigned max_connections;   // open connections
+    unsigned max_in_flight;     // requests being handled
+    size_t max_buffered;        // bytes of all the receive buffers
+    int idle_timeout_ms;        // between two requests
+    int header_timeout_ms;      // from the first byte of a request to the end of its headers
+    int body_timeout_ms;        // between two parts of a body
+    int drain_timeout_ms;       // for http_drain()
+    const char* unix_path;      // if not NULL, Unix domain socket also listened on
+};
+
+/**
+ * @brief Load of the server, what was turned away with 503 because of the limits,
+ *        and the connections closed because of the timeouts.
+ */
+struct http_stats {
+    unsigned open_connections;
+    unsigned in_flight;
+    size_t buffered;
+    uint64_t rejected_connections;
+    uint64_t rejected_requests;
+    uint64_t timed_out_idle;
+    uint64_t timed_out_header;
+    uint64_t timed_out_body;
+};
+
 int http_init(uint16_t port, EventCallback cb);
 
+/**
+ * @brief Like http_init(), with options->acceptors sockets bound to port with
+ *        SO_REUSEPORT, so that the kernel spreads the connections among them.
+ *        The first one is served by http_receive(), the others by threads of
+ *        their own, started here.
+ *        With options->unix_path, one more socket is listened on there, with
+ *        its own accepting thread; its connections are handled the same way.
+ */
+int http_init_options(uint16_t port, EventCallback cb, const struct http_options* options);
+
+/**
+ * @brief Current load and rejection counters.
+ */
+void http_get_stats(struct http_stats* stats);
+
+/**
+ * @brief Registers the callback for requests whose body is streamed, of at most
+ *        max_length bytes (the callback may reserve room for that much up front).
+ */
+void http_set_stream_callback(StreamCallback callback, size_t max_length);
+
+/**
+ * @brief Returns the announced length (Content-Length) of the body.
+ */
+size_t http_body_length(const struct http_body_reader* reader);
+
+/**
+ * @brief Points data to the next received part of the body (no copy).
+ *
+ * The data stays valid until the next call.
+ * Returns its length, 0 once the whole body was read, a negative error code otherwise.
+ */
+ssize_t http_body_next(struct http_body_reader* reader, const char** data);
+
+/**
+ * @brief Reads and drops the rest of the body, e.g. before replying with an error.
+ */
+int http_body_discard(struct http_body_reader* reader);
+
+/**
+ * @brief Waits for a connection on the first socket and starts its thread.
+ *        Returns ERR_NONE without accepting once http_wake() was called.
+ */
 int http_receive(void);
 
-int http_serve_file(int connection, const char* filename);
+/**
+ * @brief Makes http_receive() return, now or at its next call. Async-signal-safe.
+ */
+void http_wake(void);
+
+/**
+ * @brief Replies with the content of a file, from memory: files are cached
+ *        with their gzip variant (sent if msg accepts it) and checked for
+ *        changes at most once a second. msg may be NULL (no conditional
+ *        request, no compression).
+ */
+int http_serve_file(int connection, const struct http_message* msg, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Sends a reply without body nor Content-Length, e.g. 304 Not Modified.
+ */
+int http_reply_no_body(int connection, const char* status, const char* headers);
+
+/**
+ * @brief Sends an HTTP reply whose body is the len bytes of file descriptor fd
+ *        starting at offset. The body is sent with sendfile(), it is never
+ *        copied to user space.
+ */
+int http_reply_file_range(int connection, const char* status, const char* headers,
+                          int fd, uint64_t offset, size_t len);
+
+/**
+ * @brief Sends a 206 reply with the given ranges of the size bytes of fd starting
+ *        at offset. A single range is sent as is, several ones as multipart/byteranges
+ *        whose parts are of type content_type. Ranges are sent with sendfile().
+ */
+int http_reply_file_ranges(int connection, const char* headers, const char* content_type,
+                           int fd, uint64_t offset, size_t size,
+                           const struct http_range* ranges, size_t nb_ranges);
+
+/**
+ * @brief Starts a reply whose body is sent with chunked transfer encoding,
+ *        in any number of http_send_chunk(), then http_reply_chunked_end().
+ */
+int http_reply_chunked_begin(int connection, const char* status, const char* headers);
+
+/**
+ * @brief Sends len bytes of body as one chunk (nothing if len is 0).
+ */
+int http_send_chunk(int connection, const char* data, size_t len);
+
+// buffers of one http_send_chunk_iov() at most
+#define MAX_CHUNK_PARTS 8
+
+/**
+ * @brief Sends the nb_parts buffers of parts as one chunk, in one gather write
+ *        (nothing if they are all empty).
+ */
+int http_send_chunk_iov(int connection, const struct iovec* parts, size_t nb_parts);
+
+/**
+ * @brief Sends the last (empty) chunk.
+ */
+int http_reply_chunked_end(int connection);
+
+/**
+ * @brief Graceful stop: no new connection is accepted, idle ones are closed at
+ *        once, and the others once their request is answered (with a
+ *        "Connection: close" header). Waits for them at most
+ *        options->drain_timeout_ms.
+ *
+ * @return The number of connections still open at the deadline, 0 if all closed.
+ */
+unsigned http_drain(void);
+
 void http_close(void);
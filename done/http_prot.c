@@ -6,6 +6,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
+#include <stdint.h>  // SIZE_MAX
+#include <limits.h>  // INT_MAX
 #include "http_prot.h"
 #include "error.h"
 #include "error.h"
@@ -32,55 +35,334 @@ int http_match_verb(const struct http_string* method, const char* verb)
     return !strncmp(method->val, verb, method->len);
 }
 
-int http_get_var(const struct http_string* url, const char* name, char* out, size_t out_len)
+/*******************************************************************
+ * Incremental request parser
+ */
+#define HTTP_VERSION "HTTP/1.1"
+#define HTTP_CONTENT_LENGTH "Content-Length"
+#define HTTP_TRANSFER_ENCODING "Transfer-Encoding"
+
+void http_parser_init(struct http_parser *parser)
 {
-    M_REQUIRE_NON_NULL(url);
-    M_REQUIRE_NON_NULL(name);
-    M_REQUIRE_NON_NULL(out);
-    if (out_len <= 0) {
+    if (parser != NULL) {
+        memset(parser, 0, sizeof(*parser));
+        parser->state = HTTP_STATE_REQUEST_LINE;
+    }
+}
+
+static int span_equals(const char *stream, struct http_span span, const char *literal)
+{
+    return strlen(literal) == span.len && !memcmp(stream + span.off, literal, span.len);
+}
+
+static int span_equals_ci(const char *stream, struct http_span span, const char *literal)
+{
+    return strlen(literal) == span.len && !strncasecmp(stream + span.off, literal, span.len);
+}
+
+static int is_http_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// strict decimal parsing: no sign, no spaces, no overflow
+static int parse_content_length(const char *val, size_t len, size_t *out)
+{
+    if (len == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    size_t value = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (val[i] < '0' || val[i] > '9' || value > (SIZE_MAX / 2 - 9) / 10) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        value = value * 10 + (size_t) (val[i] - '0');
+    }
+    *out = value;
+    return ERR_NONE;
+}
+
+// request line example: GET /imgfs/read?res=orig&img_id=mure.jpg HTTP/1.1
+static int parse_request_line(struct http_parser *parser, const char *stream, size_t start, size_t end)
+{
+    const char *line = stream + start;
+    const size_t len = end - start;
+
+    const char *sp1 = memchr(line, ' ', len);
+    if (sp1 == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
-    size_t name_len = strlen(name);
-    char* new_name = (char*)malloc(name_len + 2);  // name + "="
-    if (new_name == NULL) {
-        return ERR_OUT_OF_MEMORY;
+    const char *sp2 = memchr(sp1 + 1, ' ', len - (size_t) (sp1 + 1 - line));
+    if (sp2 == NULL || sp1 == line || sp2 == sp1 + 1) {
+        return ERR_INVALID_ARGUMENT;
     }
-    strncpy(new_name, name, name_len);
-    new_name[name_len] = '=';
-    new_name[name_len + 1] = '\0';
 
-    char* new_url = (char*)malloc(url->len + 1);
-    if (new_url == NULL) {
-        free(new_name);
-        return ERR_OUT_OF_MEMORY;
+    parser->method.off = start;
+    parser->method.len = (size_t) (sp1 - line);
+    parser->uri.off = start + (size_t) (sp1 + 1 - line);
+    parser->uri.len = (size_t) (sp2 - sp1 - 1);
+
+    struct http_span version = { start + (size_t) (sp2 + 1 - line), (size_t) (line + len - sp2 - 1) };
+    if (!span_equals(stream, version, HTTP_VERSION)) {
+        debug_printf("Unknown protocol %.*s\n", (int) version.len, stream + version.off);
+        return ERR_INVALID_ARGUMENT;
     }
-    strncpy(new_url, url->val, url->len);
-    new_url[url->len] = '\0';
+    return ERR_NONE;
+}
 
-    char* needle = strstr(new_url, new_name);
-    if (needle) {
-        needle += strlen(new_name);
-        char* token = strtok(needle, "&");
-        if (strlen(token) > out_len) {
-            free(new_name);
-            free(new_url);
-            return ERR_RUNTIME;
+// header line example: Content-Length: 12
+static int parse_header_line(struct http_parser *parser, const char *stream, size_t start, size_t end)
+{
+    if (parser->num_headers >= MAX_HEADERS) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const char *colon = memchr(stream + start, ':', end - start);
+    if (colon == NULL || colon == stream + start || is_http_space(colon[-1])) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    size_t val_start = (size_t) (colon - stream) + 1;
+    size_t val_end = end;
+    while (val_start < val_end && is_http_space(stream[val_start])) ++val_start;
+    while (val_end > val_start && is_http_space(stream[val_end - 1])) --val_end;
+
+    struct http_span *key = &parser->keys[parser->num_headers];
+    struct http_span *value = &parser->values[parser->num_headers];
+    key->off = start;
+    key->len = (size_t) (colon - stream) - start;
+    value->off = val_start;
+    value->len = val_end - val_start;
+    ++parser->num_headers;
+
+    if (span_equals_ci(stream, *key, HTTP_CONTENT_LENGTH)) {
+        size_t length = 0;
+        if (parse_content_length(stream + value->off, value->len, &length) != ERR_NONE) {
+            return ERR_INVALID_ARGUMENT;
         }
-        int len = strlen(token);
-        strncpy(out, token, len);
-        free(new_name);
-        free(new_url);
-        return len;
-    } else {
-        free(new_name);
-        free(new_url);
-        return ERR_NONE;
+        // repeated with another value, the end of the request is ambiguous (RFC 9112, 6.3)
+        if (parser->has_content_length && parser->content_length != length) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        parser->has_content_length = 1;
+        parser->content_length = length;
+    } else if (span_equals_ci(stream, *key, HTTP_TRANSFER_ENCODING)) {
+        // chunked is the only coding supported, and then the last one
+        if (!span_equals_ci(stream, *value, "chunked")) {
+            return NOT_IMPLEMENTED;
+        }
+        parser->chunked = 1;
+    }
+    return ERR_NONE;
+}
+
+// both would make the end of the request ambiguous (request smuggling)
+static int check_body_framing(const struct http_parser *parser, const char *stream)
+{
+    for (size_t i = 0; parser->chunked && i < parser->num_headers; ++i) {
+        if (span_equals_ci(stream, parser->keys[i], HTTP_CONTENT_LENGTH)) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    return ERR_NONE;
+}
+
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// chunk size line example: 1a2b;name=value (extensions are ignored)
+static int parse_chunk_size(const char *line, size_t len, size_t *size)
+{
+    size_t value = 0;
+    size_t i = 0;
+    for (; i < len && hex_digit(line[i]) >= 0; ++i) {
+        if (value > (SIZE_MAX / 2) >> 4) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        value = value * 16 + (size_t) hex_digit(line[i]);
+    }
+    if (i == 0) {
+        return ERR_INVALID_ARGUMENT;
     }
+    while (i < len && is_http_space(line[i])) ++i;
+    if (i < len && line[i] != ';') {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *size = value;
+    return ERR_NONE;
+}
+
+// chunked body: the framing is checked as it comes, the data only counted.
+// Same return values as http_parser_execute().
+static int parse_chunks(struct http_parser *parser, const char *stream, size_t bytes_received)
+{
+    while (parser->state == HTTP_STATE_BODY) {
+        if (parser->chunk_state == HTTP_CHUNK_DATA) {
+            const size_t available = bytes_received - parser->pos;
+            const size_t n = available < parser->chunk_left ? available : parser->chunk_left;
+            parser->pos += n;
+            parser->chunk_left -= n;
+            if (parser->chunk_left > 0) {
+                return 0;
+            }
+            parser->chunk_state = HTTP_CHUNK_DATA_END;
+            parser->line_start = parser->pos;
+            continue;
+        }
+
+        // the other parts are lines
+        if (parser->pos >= bytes_received) {
+            return 0;
+        }
+        const char *nl = memchr(stream + parser->pos, '\n', bytes_received - parser->pos);
+        if (nl == NULL) {
+            parser->pos = bytes_received;
+            return 0;
+        }
+        const size_t next = (size_t) (nl - stream) + 1;
+        size_t end = next - 1;
+        if (end > parser->line_start && stream[end - 1] == '\r') {
+            --end;
+        }
+
+        size_t size = 0;
+        switch (parser->chunk_state) {
+        case HTTP_CHUNK_SIZE:
+            if (parse_chunk_size(stream + parser->line_start, end - parser->line_start, &size) != ERR_NONE
+                || size > SIZE_MAX / 2 - parser->content_length) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            parser->content_length += size;
+            parser->chunk_left = size;
+            parser->chunk_state = size > 0 ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            break;
+        case HTTP_CHUNK_DATA_END:
+            if (end != parser->line_start) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            parser->chunk_state = HTTP_CHUNK_SIZE;
+            break;
+        default:
+            // trailer fields are ignored, up to the empty line ending the request
+            if (end == parser->line_start) {
+                parser->message_len = next;
+                parser->state = HTTP_STATE_DONE;
+            }
+            break;
+        }
+        parser->line_start = next;
+        parser->pos = next;
+    }
+    return 1;
+}
+
+void http_decode_chunked_body(const struct http_parser *parser, char *stream, struct http_message *out)
+{
+    if (parser == NULL || stream == NULL || out == NULL || !parser->chunked || parser->state != HTTP_STATE_DONE) {
+        return;
+    }
+    // the framing was checked by the parser: size line, data, CRLF... up to the empty chunk
+    size_t src = parser->header_len;
+    size_t dst = parser->header_len;
+    for (;;) {
+        const char *nl = memchr(stream + src, '\n', parser->message_len - src);
+        size_t size = 0;
+        parse_chunk_size(stream + src, (size_t) (nl - stream) - src - (nl[-1] == '\r'), &size);
+        src = (size_t) (nl - stream) + 1;
+        if (size == 0) {
+            break;
+        }
+        memmove(stream + dst, stream + src, size);
+        dst += size;
+        src += size;
+        src = (size_t) ((const char *) memchr(stream + src, '\n', parser->message_len - src) - stream) + 1;
+    }
+    out->body.val = stream + parser->header_len;
+    out->body.len = dst - parser->header_len;
+}
+
+// rebuilds out from the offsets stored in parser, for the current location of stream
+static void fill_message(const struct http_parser *parser, const char *stream, size_t bytes_received,
+                         struct http_message *out)
+{
+    out->method.val = stream + parser->method.off;
+    out->method.len = parser->method.len;
+    out->uri.val = stream + parser->uri.off;
+    out->uri.len = parser->uri.len;
+    for (size_t i = 0; i < parser->num_headers; ++i) {
+        out->headers[i].key.val = stream + parser->keys[i].off;
+        out->headers[i].key.len = parser->keys[i].len;
+        out->headers[i].value.val = stream + parser->values[i].off;
+        out->headers[i].value.len = parser->values[i].len;
+    }
+    out->num_headers = parser->num_headers;
+
+    const size_t received = bytes_received - parser->header_len;
+    out->body.val = stream + parser->header_len;
+    out->body.len = parser->chunked ? 0 : (received < parser->content_length ? received : parser->content_length);
+}
+
+int http_parser_execute(struct http_parser *parser, const char *stream, size_t bytes_received,
+                        struct http_message *out)
+{
+    M_REQUIRE_NON_NULL(parser);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+
+    // request line and headers: one complete line at a time
+    while (parser->state == HTTP_STATE_REQUEST_LINE || parser->state == HTTP_STATE_HEADERS) {
+        if (parser->pos >= bytes_received) {
+            return 0;
+        }
+        const char *nl = memchr(stream + parser->pos, '\n', bytes_received - parser->pos);
+        if (nl == NULL) {
+            parser->pos = bytes_received;   // the next call only scans the new bytes
+            return 0;
+        }
+        const size_t next = (size_t) (nl - stream) + 1;
+        size_t end = next - 1;
+        if (end > parser->line_start && stream[end - 1] == '\r') {
+            --end;
+        }
+
+        int ret = ERR_NONE;
+        if (parser->state == HTTP_STATE_REQUEST_LINE) {
+            ret = parse_request_line(parser, stream, parser->line_start, end);
+            parser->state = HTTP_STATE_HEADERS;
+        } else if (end == parser->line_start) {
+            // empty line: end of headers
+            parser->header_len = next;
+            parser->state = HTTP_STATE_BODY;
+            ret = check_body_framing(parser, stream);
+        } else {
+            ret = parse_header_line(parser, stream, parser->line_start, end);
+        }
+        if (ret != ERR_NONE) {
+            return ret;
+        }
+        parser->line_start = next;
+        parser->pos = next;
+    }
+
+    // body: only counted
+    memset(out, 0, sizeof(*out));
+    fill_message(parser, stream, bytes_received, out);
+    if (parser->chunked) {
+        return parse_chunks(parser, stream, bytes_received);
+    }
+    if (out->body.len < parser->content_length) {
+        return 0;
+    }
+    parser->message_len = parser->header_len + parser->content_length;
+    parser->state = HTTP_STATE_DONE;
+    return 1;
 }
 
-// stream points to the beginning of received buffer even if http_parse_message gets called for the second time from handle_connection
-// however realloc might point to another address (only guarantee is that contents are the same, not necessarily an expansion of the memory but maybe a migration of the contents)
-// --> consequence: need to rerun enitire http_parse_message as pointers stored in out might turn out different
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
 {
     M_REQUIRE_NON_NULL(stream);
@@ -89,85 +371,540 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
 
     memset(out, 0, sizeof(struct http_message));
 
-    // return 0: interpreted as "message incomplete"
-    if (strstr(stream, HTTP_HDR_END_DELIM) == NULL) {
+    struct http_parser parser;
+    http_parser_init(&parser);
+    const int ret = http_parser_execute(&parser, stream, bytes_received, out);
+    if (ret >= 0 && parser.state >= HTTP_STATE_BODY) {
+        if (parser.content_length > INT_MAX) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        *content_len = (int) parser.content_length;
+    }
+    return ret;
+}
+
+const struct http_string* http_get_header(const struct http_message *message, const char *key)
+{
+    if (message == NULL || key == NULL) {
+        return NULL;
+    }
+    const size_t key_len = strlen(key);
+    for (size_t i = 0; i < message->num_headers; ++i) {
+        const struct http_string *k = &message->headers[i].key;
+        if (k->len == key_len && !strncasecmp(k->val, key, key_len)) {
+            return &message->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************
+ * Range header
+ */
+#define RANGE_UNIT "bytes="
+
+// parses digits in [*p, end), moving *p after them; returns 0 if there are none
+static int parse_range_number(const char **p, const char *end, size_t *out)
+{
+    size_t value = 0;
+    const char *start = *p;
+    for (; *p < end && **p >= '0' && **p <= '9'; ++*p) {
+        if (value > (SIZE_MAX - 9) / 10) {
+            return 0;
+        }
+        value = value * 10 + (size_t) (**p - '0');
+    }
+    *out = value;
+    return *p > start;
+}
+
+int http_parse_range(const struct http_string *value, size_t size,
+                     struct http_range *ranges, size_t max_ranges)
+{
+    M_REQUIRE_NON_NULL(value);
+    M_REQUIRE_NON_NULL(value->val);
+    M_REQUIRE_NON_NULL(ranges);
+
+    const size_t unit_len = strlen(RANGE_UNIT);
+    if (value->len < unit_len || strncasecmp(value->val, RANGE_UNIT, unit_len)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const char *p = value->val + unit_len;
+    const char *const end = value->val + value->len;
+    size_t nb_specs = 0;
+    size_t nb_ranges = 0;
+    while (p < end) {
+        while (p < end && (is_http_space(*p) || *p == ',')) ++p;
+        if (p == end) {
+            break;
+        }
+        if (++nb_specs > max_ranges) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        size_t first = 0, last = 0;
+        const int has_first = parse_range_number(&p, end, &first);
+        if (p == end || *p != '-') {
+            return ERR_INVALID_ARGUMENT;
+        }
+        ++p;
+        const int has_last = parse_range_number(&p, end, &last);
+        while (p < end && is_http_space(*p)) ++p;
+        if ((p < end && *p != ',') || (!has_first && !has_last) || (has_first && has_last && last < first)) {
+            return ERR_INVALID_ARGUMENT;
+        }
+
+        if (!has_first) {
+            // suffix range: the last bytes
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            first = last < size ? size - last : 0;
+            last = size - 1;
+        } else if (first >= size) {
+            continue;
+        } else if (!has_last || last >= size) {
+            last = size - 1;
+        }
+        ranges[nb_ranges].start = first;
+        ranges[nb_ranges].len = last - first + 1;
+        ++nb_ranges;
+    }
+    return nb_specs > 0 ? (int) nb_ranges : ERR_INVALID_ARGUMENT;
+}
+
+/*******************************************************************
+ * Entity tags
+ */
+int http_etag_match(const struct http_string *value, const char *etag)
+{
+    if (value == NULL || value->val == NULL || etag == NULL) {
+        return 0;
+    }
+
+    const size_t etag_len = strlen(etag);
+    const char *p = value->val;
+    const char *const end = value->val + value->len;
+    while (p < end) {
+        while (p < end && (is_http_space(*p) || *p == ',')) ++p;
+        const char *const tag = p;
+        while (p < end && *p != ',') ++p;
+        size_t len = (size_t) (p - tag);
+        while (len > 0 && is_http_space(tag[len - 1])) --len;
+
+        if (len == 1 && tag[0] == '*') {
+            return 1;
+        }
+        const size_t weak = len > 2 && !strncmp(tag, "W/", 2) ? 2 : 0;
+        if (len - weak == etag_len && !memcmp(tag + weak, etag, etag_len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int http_etag_match_strong(const struct http_string *value, const char *etag)
+{
+    if (value == NULL || value->val == NULL || etag == NULL) {
         return 0;
     }
 
-    char* start_addr = stream;
+    size_t start = 0;
+    size_t end = value->len;
+    while (start < end && is_http_space(value->val[start])) ++start;
+    while (end > start && is_http_space(value->val[end - 1])) --end;
+    return end - start == strlen(etag) && !memcmp(value->val + start, etag, end - start);
+}
+
+/*******************************************************************
+ * Accept-Encoding negotiation
+ */
+#define Q_MAX 1000  // q-values in thousandths
+
+// parses a q-value ("0", "0.5", "1.000"), returns -1 if invalid
+static int parse_qvalue(const char *val, size_t len)
+{
+    if (len == 0 || (val[0] != '0' && val[0] != '1')) {
+        return -1;
+    }
+    int q = (val[0] - '0') * Q_MAX;
+    if (len > 1) {
+        if (val[1] != '.' || len > 5) {
+            return -1;
+        }
+        int scale = Q_MAX / 10;
+        for (size_t i = 2; i < len; ++i, scale /= 10) {
+            if (val[i] < '0' || val[i] > '9') {
+                return -1;
+            }
+            q += (val[i] - '0') * scale;
+        }
+    }
+    return q <= Q_MAX ? q : -1;
+}
+
+enum http_encoding http_accept_encoding(const struct http_string *value)
+{
+    if (value == NULL || value->val == NULL) {
+        return HTTP_ENCODING_IDENTITY;
+    }
+
+    // q-value of each coding, -1 when not listed
+    int q_gzip = -1, q_deflate = -1, q_any = -1;
+    const char *p = value->val;
+    const char *const end = value->val + value->len;
+    while (p < end) {
+        while (p < end && (is_http_space(*p) || *p == ',')) ++p;
+        const char *const coding = p;
+        while (p < end && *p != ',' && *p != ';' && !is_http_space(*p)) ++p;
+        const struct http_span name = { 0, (size_t) (p - coding) };
+
+        int q = Q_MAX;
+        while (p < end && *p != ',') {
+            while (p < end && (is_http_space(*p) || *p == ';')) ++p;
+            const char *const param = p;
+            while (p < end && *p != ',' && *p != ';' && !is_http_space(*p)) ++p;
+            if (p - param > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = parse_qvalue(param + 2, (size_t) (p - param - 2));
+            }
+        }
+        if (q < 0) {
+            continue;   // invalid entry, ignored
+        }
+
+        if (span_equals_ci(coding, name, "gzip") || span_equals_ci(coding, name, "x-gzip")) {
+            q_gzip = q;
+        } else if (span_equals_ci(coding, name, "deflate")) {
+            q_deflate = q;
+        } else if (span_equals_ci(coding, name, "*")) {
+            q_any = q;
+        }
+    }
+
+    if (q_gzip < 0) q_gzip = q_any;
+    if (q_deflate < 0) q_deflate = q_any;
+    if (q_gzip > 0 && q_gzip >= q_deflate) {
+        return HTTP_ENCODING_GZIP;
+    }
+    return q_deflate > 0 ? HTTP_ENCODING_DEFLATE : HTTP_ENCODING_IDENTITY;
+}
+
+/*******************************************************************
+ * Multipart bodies
+ */
+#define MULTIPART_TYPE "multipart/"
+#define BOUNDARY_PARAM "boundary="
+
+// first occurrence of needle in [p, end), NULL if none
+static const char *find_bytes(const char *p, const char *end, const char *needle, size_t needle_len)
+{
+    while ((size_t) (end - p) >= needle_len) {
+        const char *first = memchr(p, needle[0], (size_t) (end - p) - needle_len + 1);
+        if (first == NULL) {
+            return NULL;
+        }
+        if (!memcmp(first, needle, needle_len)) {
+            return first;
+        }
+        p = first + 1;
+    }
+    return NULL;
+}
+
+int http_multipart_init(struct http_multipart *it, const struct http_string *content_type,
+                        const struct http_string *body)
+{
+    M_REQUIRE_NON_NULL(it);
+    M_REQUIRE_NON_NULL(content_type);
+    M_REQUIRE_NON_NULL(content_type->val);
+    M_REQUIRE_NON_NULL(body);
 
-    // start line example: GET /imgfs/read?res=orig&img_id=mure.jpg HTTP/1.1
-    // parse method and uri
-    char* space = " ";
-    stream = get_next_token(stream, space, &out->method);
-    stream = get_next_token(stream, space, &out->uri);
+    memset(it, 0, sizeof(*it));
+    const size_t type_len = strlen(MULTIPART_TYPE);
+    if (content_type->len < type_len || strncasecmp(content_type->val, MULTIPART_TYPE, type_len)) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-    // skip rest of start line
-    struct http_string check;
-    stream = get_next_token(stream, HTTP_LINE_DELIM, &check);
-    if (strncmp(check.val, "HTTP/1.1", check.len)) {
-        printf("Unknown protocol %.*s", check.len, check.val);
+    // the boundary parameter, possibly quoted
+    const char *p = content_type->val;
+    const char *const end = content_type->val + content_type->len;
+    const size_t param_len = strlen(BOUNDARY_PARAM);
+    while (p < end && ((size_t) (end - p) < param_len || strncasecmp(p, BOUNDARY_PARAM, param_len)
+                       || (p > content_type->val && p[-1] != ';' && !is_http_space(p[-1])))) {
+        ++p;
+    }
+    if (p == end) {
         return ERR_INVALID_ARGUMENT;
     }
+    p += param_len;
+    const char *boundary = p;
+    if (p < end && *p == '"') {
+        boundary = ++p;
+        while (p < end && *p != '"') ++p;
+    } else {
+        while (p < end && *p != ';' && !is_http_space(*p)) ++p;
+    }
+    const size_t boundary_len = (size_t) (p - boundary);
+    if (boundary_len == 0 || boundary_len > MAX_MULTIPART_BOUNDARY) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    memcpy(it->delimiter, HTTP_LINE_DELIM "--", 4);
+    memcpy(it->delimiter + 4, boundary, boundary_len);
+    it->delimiter_len = boundary_len + 4;
+    it->end = body->val + body->len;
+
+    // the first delimiter may start the body (no CRLF before it), or follow a preamble
+    if (body->len >= it->delimiter_len - 2
+        && !memcmp(body->val, it->delimiter + 2, it->delimiter_len - 2)) {
+        it->pos = body->val + it->delimiter_len - 2;
+    } else {
+        const char *first = body->val != NULL
+                            ? find_bytes(body->val, it->end, it->delimiter, it->delimiter_len) : NULL;
+        if (first == NULL) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        it->pos = first + it->delimiter_len;
+    }
+    return ERR_NONE;
+}
+
+// value of parameter name ("name", "filename") in a Content-Disposition value
+static struct http_string disposition_param(const char *p, const char *end, const char *name)
+{
+    struct http_string value = { "", 0 };
+    const size_t name_len = strlen(name);
+    while (p < end) {
+        while (p < end && *p != ';') ++p;
+        while (p < end && (*p == ';' || is_http_space(*p))) ++p;
+        if ((size_t) (end - p) > name_len && !strncasecmp(p, name, name_len) && p[name_len] == '=') {
+            p += name_len + 1;
+            const char *start = p;
+            if (p < end && *p == '"') {
+                start = ++p;
+                while (p < end && *p != '"') ++p;
+            } else {
+                while (p < end && *p != ';' && !is_http_space(*p)) ++p;
+            }
+            value.val = start;
+            value.len = (size_t) (p - start);
+            return value;
+        }
+    }
+    return value;
+}
 
-    stream = http_parse_headers(stream, out);
+int http_multipart_next(struct http_multipart *it, struct http_part *part)
+{
+    M_REQUIRE_NON_NULL(it);
+    M_REQUIRE_NON_NULL(part);
+    if (it->pos == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-    char* body_addr = stream;
+    // after a delimiter: "--" for the last one, otherwise (padding and) CRLF
+    const char *p = it->pos;
+    if (it->end - p >= 2 && p[0] == '-' && p[1] == '-') {
+        it->pos = it->end;
+        return 0;
+    }
+    while (p < it->end && (*p == ' ' || *p == '\t')) ++p;
+    if (it->end - p < 2 || p[0] != '\r' || p[1] != '\n') {
+        return ERR_INVALID_ARGUMENT;
+    }
+    p += 2;
 
-    // extract content-length
-    int found = 0;
-    for (int i = 0; i < out->num_headers; ++i) {
-        if (!strncmp(out->headers[i].key.val, "Content-Length", out->headers[i].key.len)) {
-            *content_len = atoi(out->headers[i].value.val);
-            found = 1;
+    // part headers, up to an empty line
+    memset(part, 0, sizeof(*part));
+    part->name.val = part->filename.val = part->content_type.val = "";
+    for (;;) {
+        const char *eol = find_bytes(p, it->end, HTTP_LINE_DELIM, 2);
+        if (eol == NULL) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        if (eol == p) {
+            p += 2;
             break;
         }
+        const char *colon = memchr(p, ':', (size_t) (eol - p));
+        if (colon != NULL) {
+            const struct http_span key = { 0, (size_t) (colon - p) };
+            const char *value = colon + 1;
+            while (value < eol && is_http_space(*value)) ++value;
+            if (span_equals_ci(p, key, "Content-Disposition")) {
+                part->name = disposition_param(value, eol, "name");
+                part->filename = disposition_param(value, eol, "filename");
+            } else if (span_equals_ci(p, key, "Content-Type")) {
+                part->content_type.val = value;
+                part->content_type.len = (size_t) (eol - value);
+            }
+        }
+        p = eol + 2;
     }
 
-    // return 1 if there is no body (no Content-Length header, or is value is 0) or you were able to read the full body;
-    // content length is body length (always take content length as body length (strlen() might not work bcs of null bytes))
-    int header_len = body_addr - start_addr;
-    if (!found || *content_len == 0 || (bytes_received - header_len + sizeof(HTTP_HDR_END_DELIM)) >= *content_len) {
-        out->body.val = stream;
-        out->body.len = *content_len;
-        return 1;
+    // the content, up to the next delimiter
+    const char *next = find_bytes(p, it->end, it->delimiter, it->delimiter_len);
+    if (next == NULL) {
+        return ERR_INVALID_ARGUMENT;
     }
+    part->body.val = p;
+    part->body.len = (size_t) (next - p);
+    it->pos = next + it->delimiter_len;
+    return 1;
+}
 
-    // return 0 if not received the full body.
-    return 0;
+/*******************************************************************
+ * Query string
+ */
+
+// next non-empty key[=value] pair of [*pos, end), escapes left as is
+static int query_next(const char **pos, const char *end,
+                      struct http_string *key, struct http_string *value)
+{
+    const char *p = *pos;
+    while (p < end && *p == '&') {
+        ++p;
+    }
+    if (p == end) {
+        return 0;
+    }
+    const char *amp = memchr(p, '&', (size_t) (end - p));
+    const char *pair_end = amp != NULL ? amp : end;
+    const char *eq = memchr(p, '=', (size_t) (pair_end - p));
+    key->val = p;
+    key->len = (size_t) ((eq != NULL ? eq : pair_end) - p);
+    value->val = eq != NULL ? eq + 1 : pair_end;
+    value->len = (size_t) (pair_end - value->val);
+    *pos = pair_end;
+    return 1;
 }
 
-static const char* get_next_token(const char* message, const char* delimiter, struct http_string* output)
+// percent-decodes in to out; ERR_RUNTIME if longer than out_len, '+' is kept
+static int percent_decode(const struct http_string *in, char *out, size_t out_len)
 {
-    M_REQUIRE_NON_NULL(message);
-    M_REQUIRE_NON_NULL(delimiter);
+    size_t len = 0;
+    for (size_t i = 0; i < in->len; ++i, ++len) {
+        char c = in->val[i];
+        if (c == '%') {
+            const int high = i + 2 < in->len ? hex_digit(in->val[i + 1]) : -1;
+            const int low = high >= 0 ? hex_digit(in->val[i + 2]) : -1;
+            // values end up in C strings: no NUL byte
+            if (low < 0 || (high == 0 && low == 0)) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            c = (char) (high * 16 + low);
+            i += 2;
+        }
+        if (len >= out_len || len >= INT_MAX) {
+            return ERR_RUNTIME;
+        }
+        out[len] = c;
+    }
+    return (int) len;
+}
+
+static const char *query_start(const struct http_string *uri)
+{
+    const char *mark = memchr(uri->val, '?', uri->len);
+    return mark != NULL ? mark + 1 : uri->val + uri->len;
+}
+
+// in as is if it has no escape, else decoded to the buffer of query
+static int query_decode(const struct http_string *in, struct http_query *query, size_t *used,
+                        struct http_string *out)
+{
+    if (memchr(in->val, '%', in->len) == NULL) {
+        *out = *in;
+        return ERR_NONE;
+    }
+    const int len = percent_decode(in, query->buffer + *used, MAX_QUERY_DECODED - *used);
+    if (len < 0) {
+        return len;
+    }
+    out->val = query->buffer + *used;
+    out->len = (size_t) len;
+    *used += (size_t) len;
+    return ERR_NONE;
+}
 
-    int del_length = strlen(delimiter);
-    char* del_start = strstr(message, delimiter);
+int http_parse_query(const struct http_string *uri, struct http_query *query)
+{
+    M_REQUIRE_NON_NULL(uri);
+    M_REQUIRE_NON_NULL(query);
+    query->nb_params = 0;
 
-    if (output != NULL && del_start != NULL) {
-        output->len = (size_t) (del_start - message);
-        output->val = message;
+    const char *pos = query_start(uri);
+    const char *end = uri->val + uri->len;
+    size_t used = 0;
+    struct http_string key, value;
+    while (query_next(&pos, end, &key, &value)) {
+        if (query->nb_params == MAX_QUERY_PARAMS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        struct http_header *param = &query->params[query->nb_params];
+        int ret = query_decode(&key, query, &used, &param->key);
+        if (ret == ERR_NONE) {
+            ret = query_decode(&value, query, &used, &param->value);
+        }
+        if (ret) {
+            return ret;
+        }
+        ++query->nb_params;
     }
+    return ERR_NONE;
+}
 
-    // return NULL if delimiter not found
-    if (del_start == NULL) {
+const struct http_string *http_query_get(const struct http_query *query, const char *name)
+{
+    if (query == NULL || name == NULL) {
         return NULL;
     }
-
-    return (const char*) del_start + del_length;;
+    const size_t name_len = strlen(name);
+    for (size_t i = 0; i < query->nb_params; ++i) {
+        const struct http_string *key = &query->params[i].key;
+        if (key->len == name_len && !memcmp(key->val, name, name_len)) {
+            return &query->params[i].value;
+        }
+    }
+    return NULL;
 }
 
+int http_query_copy(const struct http_query *query, const char *name, char *out, size_t out_len)
+{
+    M_REQUIRE_NON_NULL(query);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(out);
+    const struct http_string *value = http_query_get(query, name);
+    if (value == NULL || value->len == 0) {
+        return 0;
+    }
+    if (value->len >= out_len) {
+        return ERR_RUNTIME;
+    }
+    memcpy(out, value->val, value->len);
+    out[value->len] = '\0';
+    return (int) value->len;
+}
 
-static const char* http_parse_headers(const char* header_start, struct http_message* output)
+// same as http_query_copy() on a single parameter, without building the table
+int http_get_var(const struct http_string* url, const char* name, char* out, size_t out_len)
 {
-    size_t header_count = 0;
-    // assuming header delimiter is a double line delimiter --> after taking away a delimiter there is still a delimiter at the beginning
-    while (strstr(header_start, HTTP_LINE_DELIM) != header_start) {
-        header_start = get_next_token(header_start, HTTP_HDR_KV_DELIM, &output->headers[header_count].key);
-        header_start = get_next_token(header_start, HTTP_LINE_DELIM, &output->headers[header_count].value);
-        header_count++;
+    M_REQUIRE_NON_NULL(url);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(out);
+    if (out_len <= 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const size_t name_len = strlen(name);
+    const char *pos = query_start(url);
+    const char *end = url->val + url->len;
+    struct http_string key, value;
+    while (query_next(&pos, end, &key, &value)) {
+        // names are compared undecoded: those of the server need no escaping
+        if (key.len == name_len && !memcmp(key.val, name, name_len)) {
+            return percent_decode(&value, out, out_len);
+        }
     }
-    output->num_headers = header_count;
-    return get_next_token(header_start, HTTP_LINE_DELIM, NULL);
+    return ERR_NONE;
 }
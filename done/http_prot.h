@@ -15,6 +15,16 @@
 #define HTTP_PROTOCOL_ID   "HTTP/1.1 "
 #define HTTP_OK            "200 OK"
 #define HTTP_BAD_REQUEST   "400 Bad Request"
+#define HTTP_PARTIAL       "206 Partial Content"
+#define HTTP_NOT_MODIFIED  "304 Not Modified"
+#define HTTP_REQUEST_TIMEOUT "408 Request Timeout"
+#define HTTP_PAYLOAD_TOO_LARGE "413 Payload Too Large"
+#define HTTP_HEADERS_TOO_LARGE "431 Request Header Fields Too Large"
+#define HTTP_RANGE_NOT_SATISFIABLE "416 Range Not Satisfiable"
+#define HTTP_NOT_IMPLEMENTED "501 Not Implemented"
+#define HTTP_SERVICE_UNAVAILABLE "503 Service Unavailable"
+
+#define MAX_RANGES 8
 
 #include <stddef.h>
 
@@ -44,10 +54,101 @@ struct http_message {
  */
 int http_match_uri(const struct http_message *message, const char *target_uri);
 
+/**
+ * @brief Progress of an http_parser through a request.
+ */
+enum http_parse_state {
+    HTTP_STATE_REQUEST_LINE,
+    HTTP_STATE_HEADERS,
+    HTTP_STATE_BODY,
+    HTTP_STATE_DONE
+};
+
+/**
+ * @brief Progress of an http_parser through a chunked body (Transfer-Encoding: chunked).
+ */
+enum http_chunk_state {
+    HTTP_CHUNK_SIZE,        // size line of the next chunk
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_END,    // CRLF after the data
+    HTTP_CHUNK_TRAILER      // trailer fields after the last (empty) chunk, up to an empty line
+};
+
+/**
+ * @brief Position of a token in the stream.
+ *
+ * Offsets rather than pointers, so that the stream may be moved (e.g. realloc'ed)
+ * between two calls to http_parser_execute().
+ */
+struct http_span {
+    size_t off;
+    size_t len;
+};
+
+/**
+ * @brief Resumable HTTP request parser.
+ *
+ * Keeps its position across calls: every line is parsed once, when it is complete,
+ * and the body is only counted, never scanned. Nothing is allocated.
+ */
+struct http_parser {
+    enum http_parse_state state;
+    size_t line_start;      // start of the line being parsed
+    size_t pos;             // first byte not scanned yet
+    size_t header_len;      // length of request line + headers + empty line, once known
+    size_t content_length;  // if chunked, that of the chunks received so far
+    int has_content_length;
+    size_t message_len;     // whole request, body framing included, once done
+    int chunked;
+    enum http_chunk_state chunk_state;
+    size_t chunk_left;      // bytes of the current chunk not received yet
+    struct http_span method;
+    struct http_span uri;
+    struct http_span keys[MAX_HEADERS];
+    struct http_span values[MAX_HEADERS];
+    size_t num_headers;
+};
+
+/**
+ * @brief Prepares parser for a new request.
+ */
+void http_parser_init(struct http_parser *parser);
+
+/**
+ * @brief Continues parsing a request whose first bytes_received bytes are in stream.
+ *
+ * stream must hold the same leading bytes as in the previous calls for this request,
+ * but may have been moved. Binary bodies (with NUL bytes) are supported, stream does
+ * not need to be NUL-terminated. Header names are matched case-insensitively.
+ *
+ * Once the headers are complete, out is filled; out->body then holds the part of the
+ * body received so far and parser->content_length the announced body length.
+ * The whole message is parser->message_len bytes long (once done).
+ *
+ * A chunked body is checked and counted as it comes, but left as is: out->body is
+ * empty until http_decode_chunked_body(). A request with both Transfer-Encoding and
+ * Content-Length is an error.
+ *
+ * Returns:
+ *  NOT_IMPLEMENTED for a transfer coding other than chunked
+ *  another negative int if there was an error
+ *  0 if the message has not been received completely (partial treatment)
+ *  1 if the message was fully received and parsed
+ */
+int http_parser_execute(struct http_parser *parser, const char *stream, size_t bytes_received,
+                        struct http_message *out);
+
+/**
+ * @brief Once parser is done with a chunked request, moves the data of its chunks
+ *        together, in place (right after the headers), and points out->body to them.
+ *        Nothing is done for a request which is not chunked.
+ */
+void http_decode_chunked_body(const struct http_parser *parser, char *stream, struct http_message *out);
+
 /**
  * @brief Accepts a potentially partial TCP stream and parses an HTTP message.
  *
- * Assumes that all characters of stream that are not filled by reading are set to 0.
+ * Stateless version of http_parser_execute(): the stream is parsed from its start.
  *
  * Places the complete HTTP message in out.
  * Also writes the content of header "Content Length" to content_len upon parsing the header in the stream.
@@ -61,20 +162,160 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
 
 /**
- * @brief Returns pointer to character after delimiter while storing preceding characters in output.
+ * @brief Returns the value of header key (case-insensitive) in message, NULL if absent.
+ */
+const struct http_string* http_get_header(const struct http_message *message, const char *key);
+
+/**
+ * @brief Byte range of a resource: len bytes starting at start.
+ */
+struct http_range {
+    size_t start;
+    size_t len;
+};
+
+/**
+ * @brief Parses the value of a Range header ("bytes=0-99,200-,-50") for a resource
+ *        of size bytes. Ranges are clipped to the resource, unsatisfiable ones dropped.
  *
- * Returns NULL if delimiter not found
-*/
-static const char* get_next_token(const char* message, const char* delimiter, struct http_string* output);
+ * Returns:
+ *  the number of ranges written to ranges (at most max_ranges)
+ *  0 if none of the ranges is satisfiable (416)
+ *  a negative int if the header is malformed or has more than max_ranges ranges
+ *  (the Range header is then to be ignored)
+ */
+int http_parse_range(const struct http_string *value, size_t size,
+                     struct http_range *ranges, size_t max_ranges);
 
+/**
+ * @brief Checks whether etag (with its quotes) is in the value of an If-None-Match
+ *        header: a comma-separated list of entity tags, or "*".
+ *        Weak tags (W/"...") match their strong counterpart (weak comparison).
+ *
+ * Returns: 1 if it is, 0 if it is not.
+ */
+int http_etag_match(const struct http_string *value, const char *etag);
 
 /**
- * @brief Fills headers and num_headers in output and returns message body ie after HTTP_HDR_END_DELIM = \r\n\r\n
-*/
-static const char* http_parse_headers(const char* header_start, struct http_message* output);
+ * @brief Checks whether the value of an If-Range header is etag itself (strong
+ *        comparison, RFC 9110 13.1.5): a weak tag, a list or a date never matches.
+ *
+ * Returns: 1 if it is, 0 if it is not.
+ */
+int http_etag_match_strong(const struct http_string *value, const char *etag);
+
+/**
+ * @brief Content codings the server can send.
+ */
+enum http_encoding {
+    HTTP_ENCODING_IDENTITY,
+    HTTP_ENCODING_GZIP,
+    HTTP_ENCODING_DEFLATE,
+    NB_HTTP_ENCODINGS
+};
+
+/**
+ * @brief Chooses the content coding from the value of an Accept-Encoding header
+ *        ("gzip, deflate;q=0.5, *;q=0"): the one with the highest q-value, gzip
+ *        when equal. identity if value is NULL or neither is acceptable.
+ */
+enum http_encoding http_accept_encoding(const struct http_string *value);
+
+/**
+ * @brief Longest boundary of a multipart body (RFC 2046).
+ */
+#define MAX_MULTIPART_BOUNDARY 70
+
+/**
+ * @brief Iterator over the parts of a multipart body (multipart/form-data, ...).
+ */
+struct http_multipart {
+    const char *pos;
+    const char *end;
+    char delimiter[MAX_MULTIPART_BOUNDARY + 4]; // CRLF "--" boundary
+    size_t delimiter_len;
+};
+
+/**
+ * @brief One part of a multipart body; all fields point into the body.
+ */
+struct http_part {
+    struct http_string name;     // from Content-Disposition, empty if absent
+    struct http_string filename; // idem
+    struct http_string content_type;
+    struct http_string body;
+};
+
+/**
+ * @brief Prepares it to go through body, given the value of the Content-Type header
+ *        of the message ("multipart/form-data; boundary=...").
+ *
+ * Returns: some error code (ERR_INVALID_ARGUMENT if not multipart). 0 if no error.
+ */
+int http_multipart_init(struct http_multipart *it, const struct http_string *content_type,
+                        const struct http_string *body);
+
+/**
+ * @brief Moves to the next part of the body.
+ *
+ * Returns:
+ *  1 if part was filled
+ *  0 after the last part
+ *  a negative int if the body is malformed
+ */
+int http_multipart_next(struct http_multipart *it, struct http_part *part);
+
+/**
+ * @brief Most parameters of a query string, and total size of those of its
+ *        keys and values which need decoding (ids and names have no escapes
+ *        most of the time, and an escaped image id takes at most 3 * MAX_IMG_ID).
+ */
+#define MAX_QUERY_PARAMS  16
+#define MAX_QUERY_DECODED 1024
+
+/**
+ * @brief Parameters of the query string of a request, percent-decoded.
+ *
+ * Keys and values without escapes point into the URI (which must outlive
+ * the table), the others into buffer; nothing is allocated.
+ */
+struct http_query {
+    struct http_header params[MAX_QUERY_PARAMS];
+    size_t nb_params;
+    char buffer[MAX_QUERY_DECODED];
+};
+
+/**
+ * @brief Parses the query string of uri (after '?') into query, in one pass.
+ *        Empty pairs are skipped; a key without '=' has an empty value.
+ *        Escapes (%XX) are decoded, '+' is not (it is not a space in a URI).
+ *
+ * Returns:
+ *  ERR_NONE, with an empty table if there is no query string
+ *  ERR_INVALID_ARGUMENT on a malformed escape, an escaped NUL byte,
+ *  or more than MAX_QUERY_PARAMS parameters
+ *  ERR_RUNTIME if the escaped keys and values exceed MAX_QUERY_DECODED once decoded
+ */
+int http_parse_query(const struct http_string *uri, struct http_query *query);
+
+/**
+ * @brief Returns the decoded value of the first parameter called name, NULL if absent.
+ */
+const struct http_string* http_query_get(const struct http_query *query, const char *name);
+
+/**
+ * @brief Copies the value of parameter name to out, NUL-terminated.
+ *
+ * Returns:
+ *  the length of the value
+ *  0 if it is absent or empty
+ *  ERR_RUNTIME if it does not fit in out (out_len bytes, NUL included)
+ */
+int http_query_copy(const struct http_query *query, const char *name, char *out, size_t out_len);
 
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
+ *        The value is decoded as by http_parse_query(), but not NUL-terminated.
  *
  * Return the length of the value.
  * 0 or negative return values indicate an error.
@@ -0,0 +1,240 @@
+/**
+ * @file image_cache.c
+ * @brief Sharded, byte-budgeted LRU cache of image variants.
+ */
+
+#include "image_cache.h"
+#include "error.h"
+
+#include <stdlib.h> // for malloc
+#include <string.h> // for memcpy
+
+/********************************************************************
+ * Shard and bucket of a key: the SHA is already uniformly distributed
+ */
+static struct image_cache_shard* shard_of(struct image_cache* cache, const unsigned char* sha)
+{
+    return &cache->shards[sha[0] % IMAGE_CACHE_SHARDS];
+}
+
+// all the variants of a content are in the same bucket
+static struct image_cache_entry** bucket_of(struct image_cache_shard* shard, const unsigned char* sha)
+{
+    return &shard->buckets[sha[1] % IMAGE_CACHE_BUCKETS];
+}
+
+/********************************************************************
+ * LRU list
+ */
+static void lru_unlink(struct image_cache_shard* shard, struct image_cache_entry* entry)
+{
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(struct image_cache_shard* shard, struct image_cache_entry* entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+/********************************************************************
+ * Takes entry out of the shard; it is freed now or by its last holder.
+ * The shard lock must be held.
+ */
+static void shard_drop(struct image_cache_shard* shard, struct image_cache_entry* entry)
+{
+    struct image_cache_entry** link = bucket_of(shard, entry->sha);
+    while (*link != entry) {
+        link = &(*link)->bucket_next;
+    }
+    *link = entry->bucket_next;
+    lru_unlink(shard, entry);
+
+    shard->bytes -= entry->size;
+    shard->entries--;
+    entry->cached = 0;
+    if (entry->refcount == 0) {
+        free(entry);
+    }
+}
+
+/********************************************************************/
+int image_cache_init(struct image_cache* cache, size_t budget)
+{
+    M_REQUIRE_NON_NULL(cache);
+
+    memset(cache, 0, sizeof(*cache));
+    cache->shard_budget = budget / IMAGE_CACHE_SHARDS;
+    // a single image may not take more than a quarter of its shard
+    cache->max_entry_size = cache->shard_budget / 4;
+    for (size_t i = 0; i < IMAGE_CACHE_SHARDS; ++i) {
+        if (pthread_mutex_init(&cache->shards[i].lock, NULL)) {
+            while (i-- > 0) {
+                pthread_mutex_destroy(&cache->shards[i].lock);
+            }
+            return ERR_THREADING;
+        }
+    }
+    return ERR_NONE;
+}
+
+void image_cache_free(struct image_cache* cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < IMAGE_CACHE_SHARDS; ++i) {
+        struct image_cache_shard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->lru_head != NULL) {
+            shard_drop(shard, shard->lru_head);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_destroy(&shard->lock);
+    }
+}
+
+const struct image_cache_entry* image_cache_get(struct image_cache* cache,
+                                                const unsigned char* sha, int resolution)
+{
+    if (cache == NULL || sha == NULL) {
+        return NULL;
+    }
+
+    struct image_cache_shard* shard = shard_of(cache, sha);
+    pthread_mutex_lock(&shard->lock);
+    struct image_cache_entry* entry = *bucket_of(shard, sha);
+    while (entry != NULL && (entry->resolution != resolution
+                             || memcmp(entry->sha, sha, SHA256_DIGEST_LENGTH))) {
+        entry = entry->bucket_next;
+    }
+    if (entry != NULL) {
+        entry->refcount++;
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+
+void image_cache_release(struct image_cache* cache, const struct image_cache_entry* entry)
+{
+    if (cache == NULL || entry == NULL) {
+        return;
+    }
+
+    struct image_cache_shard* shard = shard_of(cache, entry->sha);
+    pthread_mutex_lock(&shard->lock);
+    struct image_cache_entry* held = (struct image_cache_entry*) (uintptr_t) entry;
+    held->refcount--;
+    const int unused = held->refcount == 0 && !held->cached;
+    pthread_mutex_unlock(&shard->lock);
+    if (unused) {
+        free(held);
+    }
+}
+
+int image_cache_put(struct image_cache* cache, const unsigned char* sha, int resolution,
+                    const char* data, size_t size)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(data);
+
+    if (size == 0 || size > cache->max_entry_size) {
+        return ERR_NONE;
+    }
+
+    // copied before taking the lock
+    struct image_cache_entry* entry = malloc(sizeof(struct image_cache_entry) + size);
+    if (entry == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->sha, sha, SHA256_DIGEST_LENGTH);
+    entry->resolution = resolution;
+    entry->cached = 1;
+    entry->size = size;
+    memcpy(entry->data, data, size);
+
+    struct image_cache_shard* shard = shard_of(cache, sha);
+    pthread_mutex_lock(&shard->lock);
+    struct image_cache_entry** bucket = bucket_of(shard, sha);
+    for (struct image_cache_entry* other = *bucket; other != NULL; other = other->bucket_next) {
+        if (other->resolution == resolution && !memcmp(other->sha, sha, SHA256_DIGEST_LENGTH)) {
+            // added meanwhile by another reader
+            pthread_mutex_unlock(&shard->lock);
+            free(entry);
+            return ERR_NONE;
+        }
+    }
+
+    while (shard->lru_tail != NULL && shard->bytes + size > cache->shard_budget) {
+        shard_drop(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    lru_push_front(shard, entry);
+    shard->bytes += size;
+    shard->entries++;
+    pthread_mutex_unlock(&shard->lock);
+    return ERR_NONE;
+}
+
+void image_cache_remove(struct image_cache* cache, const unsigned char* sha)
+{
+    if (cache == NULL || sha == NULL) {
+        return;
+    }
+
+    struct image_cache_shard* shard = shard_of(cache, sha);
+    pthread_mutex_lock(&shard->lock);
+    struct image_cache_entry* entry = *bucket_of(shard, sha);
+    while (entry != NULL) {
+        struct image_cache_entry* next = entry->bucket_next;
+        if (!memcmp(entry->sha, sha, SHA256_DIGEST_LENGTH)) {
+            shard_drop(shard, entry);
+        }
+        entry = next;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void image_cache_get_stats(struct image_cache* cache, struct image_cache_stats* stats)
+{
+    if (cache == NULL || stats == NULL) {
+        return;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < IMAGE_CACHE_SHARDS; ++i) {
+        struct image_cache_shard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->bytes += shard->bytes;
+        stats->entries += shard->entries;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
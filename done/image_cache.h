@@ -0,0 +1,106 @@
+/**
+ * @file image_cache.h
+ * @brief In-memory cache of image variants, keyed by (SHA, resolution).
+ *
+ * The cache is split in shards, each with its own lock, LRU list and byte
+ * budget, so that concurrent readers of different images rarely contend.
+ * Entries are reference counted: an entry handed out by image_cache_get()
+ * stays valid until image_cache_release(), even if it is evicted meanwhile.
+ */
+
+#pragma once
+
+#include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
+#include <pthread.h>
+#include <stddef.h>      // for size_t
+#include <stdint.h>      // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IMAGE_CACHE_SHARDS  16
+#define IMAGE_CACHE_BUCKETS 256     // hash buckets per shard
+
+struct image_cache_entry {
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    int resolution;
+    unsigned refcount;      // holders, protected by the shard lock
+    int cached;             // still in the shard (not evicted nor removed)
+    struct image_cache_entry* lru_prev;
+    struct image_cache_entry* lru_next;
+    struct image_cache_entry* bucket_next;
+    size_t size;
+    char data[];
+};
+
+struct image_cache_shard {
+    pthread_mutex_t lock;
+    struct image_cache_entry* buckets[IMAGE_CACHE_BUCKETS];
+    struct image_cache_entry* lru_head;    // most recently used
+    struct image_cache_entry* lru_tail;    // next to evict
+    size_t bytes;
+    size_t entries;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct image_cache {
+    size_t shard_budget;    // bytes of image data per shard
+    size_t max_entry_size;  // larger images are not cached
+    struct image_cache_shard shards[IMAGE_CACHE_SHARDS];
+};
+
+struct image_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t bytes;
+    size_t entries;
+};
+
+/**
+ * @brief Prepares an empty cache holding at most budget bytes of image data.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int image_cache_init(struct image_cache* cache, size_t budget);
+
+/**
+ * @brief Frees all the entries. No entry may be held anymore.
+ */
+void image_cache_free(struct image_cache* cache);
+
+/**
+ * @brief Looks up a variant; counts a hit or a miss.
+ *
+ * @return The entry, to be given back with image_cache_release(), NULL if absent.
+ */
+const struct image_cache_entry* image_cache_get(struct image_cache* cache,
+                                                const unsigned char* sha, int resolution);
+
+void image_cache_release(struct image_cache* cache, const struct image_cache_entry* entry);
+
+/**
+ * @brief Adds a copy of the size bytes of data, evicting the least recently
+ *        used entries of the shard if needed. Images too large are ignored.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int image_cache_put(struct image_cache* cache, const unsigned char* sha, int resolution,
+                    const char* data, size_t size);
+
+/**
+ * @brief Drops all the variants of content sha (e.g. after a delete).
+ */
+void image_cache_remove(struct image_cache* cache, const unsigned char* sha);
+
+/**
+ * @brief Sums the counters of all the shards.
+ */
+void image_cache_get_stats(struct image_cache* cache, struct image_cache_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
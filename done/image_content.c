@@ -1,5 +1,8 @@
 #include "imgfs.h"
+#include "image_content.h"
 #include "imgfscmd_functions.h"
+#include "util.h" // for MIN
+#include "trace.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -29,6 +32,7 @@ int lazily_resize(int type, struct imgfs_file *imgfs_file, size_t index)
     VipsImage *transformed_image = NULL;
     size_t len = 0;
     void* output_buffer = NULL;
+    struct trace_span span;
     if (type == SMALL_RES) {
         if (imgfs_file->metadata[index].size[SMALL_RES] == 0) {
             void *buffer = calloc(1, orig_img_size);
@@ -41,6 +45,7 @@ int lazily_resize(int type, struct imgfs_file *imgfs_file, size_t index)
                 }
                 return ERR_OUT_OF_MEMORY;
             }
+            TRACE_SPAN_BEGIN(&span, "read_orig");
             ret = fseek(imgfs_file->file, imgfs_file->metadata[index].offset[ORIG_RES], SEEK_SET);
             if (ret) {
                 free(buffer);
@@ -51,21 +56,30 @@ int lazily_resize(int type, struct imgfs_file *imgfs_file, size_t index)
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            TRACE_SPAN_BEGIN(&span, "jpegload");
             ret = vips_jpegload_buffer(buffer, orig_img_size, &orig_image, NULL);
             if (ret) {
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            TRACE_SPAN_BEGIN(&span, "thumbnail");
             ret = vips_thumbnail_image(orig_image, &transformed_image, imgfs_file->header.resized_res[2], "height", imgfs_file->header.resized_res[3], NULL);
             if (ret) {
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            // vips is lazy: decoding and resizing mostly happen here
+            TRACE_SPAN_BEGIN(&span, "jpegsave");
             ret = vips_jpegsave_buffer(transformed_image, &output_buffer, &len, NULL);
             if (ret) {
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            TRACE_SPAN_BEGIN(&span, "append_variant");
             ret = fseek(imgfs_file->file, 0, SEEK_END);
             if (ret) {
                 free(buffer);
@@ -78,6 +92,7 @@ int lazily_resize(int type, struct imgfs_file *imgfs_file, size_t index)
                 g_free(output_buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
             imgfs_file->metadata[index].offset[SMALL_RES] = ftell(imgfs_file->file) - len;
             imgfs_file->metadata[index].size[SMALL_RES] = len;
             free(buffer);
@@ -104,6 +119,7 @@ int lazily_resize(int type, struct imgfs_file *imgfs_file, size_t index)
                 }
                 return ERR_OUT_OF_MEMORY;
             }
+            TRACE_SPAN_BEGIN(&span, "read_orig");
             ret = fseek(imgfs_file->file, imgfs_file->metadata[index].offset[ORIG_RES], SEEK_SET);
             if (ret) {
                 free(buffer);
@@ -114,21 +130,30 @@ int lazily_resize(int type, struct imgfs_file *imgfs_file, size_t index)
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            TRACE_SPAN_BEGIN(&span, "jpegload");
             ret = vips_jpegload_buffer(buffer, orig_img_size, &orig_image, NULL);
             if (ret) {
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            TRACE_SPAN_BEGIN(&span, "thumbnail");
             ret = vips_thumbnail_image(orig_image, &transformed_image, imgfs_file->header.resized_res[0], "height", imgfs_file->header.resized_res[1], NULL);
             if (ret) {
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            // vips is lazy: decoding and resizing mostly happen here
+            TRACE_SPAN_BEGIN(&span, "jpegsave");
             ret = vips_jpegsave_buffer(transformed_image, &output_buffer, &len, NULL);
             if (ret) {
                 free(buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
+            TRACE_SPAN_BEGIN(&span, "append_variant");
             ret = fseek(imgfs_file->file, 0, SEEK_END);
             if (ret) {
                 free(buffer);
@@ -141,6 +166,7 @@ int lazily_resize(int type, struct imgfs_file *imgfs_file, size_t index)
                 g_free(output_buffer);
                 goto clean;
             }
+            TRACE_SPAN_END(&span);
             imgfs_file->metadata[index].offset[THUMB_RES] = ftell(imgfs_file->file) - len;
             imgfs_file->metadata[index].size[THUMB_RES] = len;
             free(buffer);
@@ -178,7 +204,129 @@ clean:
     return ERR_IO;
 }
 
-// --- PROVIDED ---
+/*******************************************************************
+ * JPEG dimensions from the frame header (SOFn segment), scanned as
+ * the bytes arrive: segments before it are skipped using their length.
+ */
+enum jpeg_probe_state {
+    PROBE_SOI,      // FF D8
+    PROBE_MARKER,   // FF, then marker code
+    PROBE_CODE,
+    PROBE_LENGTH,   // 2 bytes, includes themselves
+    PROBE_SKIP,     // rest of a segment we are not interested in
+    PROBE_FRAME,    // length + precision + height + width
+    PROBE_DONE
+};
+
+void jpeg_probe_init(struct jpeg_probe* probe)
+{
+    if (probe != NULL) {
+        memset(probe, 0, sizeof(*probe));
+        probe->state = PROBE_SOI;
+    }
+}
+
+int jpeg_probe_done(const struct jpeg_probe* probe)
+{
+    return probe != NULL && probe->state == PROBE_DONE;
+}
+
+// start of frame markers, except DHT (C4), JPG (C8) and DAC (CC)
+static int is_sof_marker(unsigned char code)
+{
+    return code >= 0xC0 && code <= 0xCF && code != 0xC4 && code != 0xC8 && code != 0xCC;
+}
+
+int jpeg_probe_feed(struct jpeg_probe* probe, const char* data, size_t len)
+{
+    M_REQUIRE_NON_NULL(probe);
+    if (len > 0) {
+        M_REQUIRE_NON_NULL(data);
+    }
+
+    const unsigned char* bytes = (const unsigned char*) data;
+    size_t i = 0;
+    while (i < len && probe->state != PROBE_DONE) {
+        const unsigned char c = bytes[i];
+        switch (probe->state) {
+        case PROBE_SOI:
+            probe->field[probe->field_len++] = c;
+            ++i;
+            if (probe->field_len == 2) {
+                if (probe->field[0] != 0xFF || probe->field[1] != 0xD8) {
+                    return ERR_IMGLIB;
+                }
+                probe->state = PROBE_MARKER;
+            }
+            break;
+        case PROBE_MARKER:
+            // stray bytes between segments are skipped, as libjpeg does (with a warning)
+            if (c == 0xFF) {
+                probe->state = PROBE_CODE;
+            }
+            ++i;
+            break;
+        case PROBE_CODE:
+            ++i;
+            if (c == 0xFF) {                    // fill byte
+                break;
+            }
+            if (c == 0xD9 || c == 0xDA) {       // end of image or scan data before any frame header
+                return ERR_IMGLIB;
+            }
+            // markers without segment, or a stuffed FF 00 (stray too)
+            if (c == 0x00 || c == 0x01 || (c >= 0xD0 && c <= 0xD8)) {
+                probe->state = PROBE_MARKER;
+                break;
+            }
+            probe->field_len = 0;
+            probe->state = is_sof_marker(c) ? PROBE_FRAME : PROBE_LENGTH;
+            break;
+        case PROBE_LENGTH:
+            probe->field[probe->field_len++] = c;
+            ++i;
+            if (probe->field_len == 2) {
+                const uint32_t seg_len = (uint32_t) probe->field[0] << 8 | probe->field[1];
+                if (seg_len < 2) {
+                    return ERR_IMGLIB;
+                }
+                probe->skip = seg_len - 2;
+                probe->state = probe->skip > 0 ? PROBE_SKIP : PROBE_MARKER;
+            }
+            break;
+        case PROBE_SKIP: {
+            const size_t n = MIN(len - i, (size_t) probe->skip);
+            probe->skip -= (uint32_t) n;
+            i += n;
+            if (probe->skip == 0) {
+                probe->state = PROBE_MARKER;
+            }
+            break;
+        }
+        case PROBE_FRAME:
+            probe->field[probe->field_len++] = c;
+            ++i;
+            if (probe->field_len == 7) {
+                probe->height = (uint32_t) probe->field[3] << 8 | probe->field[4];
+                probe->width  = (uint32_t) probe->field[5] << 8 | probe->field[6];
+                if (probe->height == 0 || probe->width == 0) {
+                    return ERR_IMGLIB;
+                }
+                probe->state = PROBE_DONE;
+            }
+            break;
+        default:
+            return ERR_IMGLIB;
+        }
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Dimensions of a whole image: the same scan as for an image inserted
+ * while it arrives, so that an image is accepted (or not) whichever way
+ * it is inserted.
+ */
 int get_resolution(uint32_t *height, uint32_t *width,
                    const char *image_buffer, size_t image_size)
 {
@@ -186,18 +334,12 @@ int get_resolution(uint32_t *height, uint32_t *width,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
-    VipsImage* original = NULL;
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wcast-qual"
-    const int err = vips_jpegload_buffer((void*) image_buffer, image_size,
-                                         &original, NULL);
-#pragma GCC diagnostic pop
-    if (err != ERR_NONE) return ERR_IMGLIB;
-
-    *height = (uint32_t) vips_image_get_height(original);
-    *width  = (uint32_t) vips_image_get_width (original);
+    struct jpeg_probe probe;
+    jpeg_probe_init(&probe);
+    const int err = jpeg_probe_feed(&probe, image_buffer, image_size);
+    if (err != ERR_NONE || !jpeg_probe_done(&probe)) return ERR_IMGLIB;
 
-    g_object_unref(VIPS_OBJECT(original));
+    *height = probe.height;
+    *width  = probe.width;
     return ERR_NONE;
 }
-// -----------------
\ No newline at end of file
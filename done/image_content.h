@@ -17,7 +17,7 @@ extern "C" {
 #endif
 
 /**
- * @brief Gets the resolution of an image.
+ * @brief Gets the resolution of a JPEG image, from its frame header (as jpeg_probe_feed()).
  *
  * @param height Where to put the calculated image height.
  * @param width Where to put the calculated image width.
@@ -26,6 +26,27 @@ extern "C" {
  */
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
 
+/**
+ * @brief Prepares probe to scan the start of a JPEG image.
+ */
+void jpeg_probe_init(struct jpeg_probe* probe);
+
+/**
+ * @brief Feeds the next bytes of a JPEG image to probe, which looks for its dimensions
+ *        in the frame header without decoding anything.
+ *
+ * @param probe The scan state, initialized by jpeg_probe_init()
+ * @param data Next bytes of the image
+ * @param len Number of bytes in data
+ * @return Some error code (ERR_IMGLIB if not a JPEG image). 0 if no error.
+ */
+int jpeg_probe_feed(struct jpeg_probe* probe, const char* data, size_t len);
+
+/**
+ * @brief Tells whether probe has found the dimensions (then in probe->height, probe->width).
+ */
+int jpeg_probe_done(const struct jpeg_probe* probe);
+
 /**
  * @brief Calls the create_resized_img function and updates the metadata on the disk
  *
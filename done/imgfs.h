@@ -21,6 +21,7 @@
                     * all the functions of this lib.
                     */
 #include <openssl/sha.h>   // for SHA256_DIGEST_LENGTH
+#include <openssl/evp.h>   // for EVP_MD_CTX
 #include <stdint.h>        // for uint32_t, uint64_t
 #include <stdio.h>         // for FILE
 
@@ -29,6 +30,7 @@
 // Constraints
 #define MAX_IMGFS_NAME  31  // max. size of a ImgFS name
 #define MAX_IMG_ID     127  // max. size of an image id
+#define MAX_STREAM_IMAGE_SIZE ((uint64_t) 1 << 26) // max. size of an image inserted while it arrives
 
 // For is_valid in imgfs_metadata
 #define EMPTY     0
@@ -71,6 +73,43 @@ struct imgfs_file {
     struct img_metadata * metadata;
 };
 
+/**
+ * @brief State of a JPEG header scan fed chunk by chunk (see image_content.h).
+ */
+struct jpeg_probe {
+    int state;
+    uint32_t skip;          // bytes of the current segment still to skip
+    unsigned char field[7]; // bytes of the length / frame header being read
+    uint32_t field_len;
+    uint32_t height;
+    uint32_t width;
+};
+
+/**
+ * @brief An image being inserted while its content arrives (see do_insert_stream_begin()).
+ */
+struct imgfs_insert_stream {
+    char img_id[MAX_IMG_ID + 1];
+    EVP_MD_CTX* sha;        // incremental SHA-256 of the content
+    struct jpeg_probe probe;
+    uint64_t offset;        // start of the region reserved for the content
+    uint32_t size;          // announced size of the content
+    uint32_t written;
+};
+
+/**
+ * @brief One image of a bulk insert (see do_insert_batch()).
+ */
+struct imgfs_insert_item {
+    char img_id[MAX_IMG_ID + 1];
+    const char* data;       // content, not owned
+    size_t size;
+    int result;             // error code of this image, 0 once inserted
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t height;
+    uint32_t width;
+};
+
 /**
  * @brief Prints imgFS header informations.
  *
@@ -114,6 +153,11 @@ enum do_list_mode {
     NB_DO_LIST_MODES
 };
 
+// layout of the JSON list: JSON_LIST_START, then " \"id\"" for the first ID and
+// ", \"id\"" for the next ones, then JSON_LIST_END
+#define JSON_LIST_START "{ \"Images\": ["
+#define JSON_LIST_END   " ] }"
+
 /**
  * @brief Displays (on stdout) imgFS metadata.
  *
@@ -126,6 +170,29 @@ enum do_list_mode {
 int do_list(const struct imgfs_file* imgfs_file,
             enum do_list_mode output_mode, char** json);
 
+/**
+ * @brief Position in a listing done in several calls to do_list_ids().
+ */
+struct imgfs_list_cursor {
+    uint32_t slot;  // next metadata entry to look at
+    size_t skip;    // matching images still to be skipped (offset of the page)
+};
+
+/**
+ * @brief Copies the IDs of the next valid images whose ID starts with prefix.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param prefix Only IDs starting with it are listed, "" for all.
+ * @param cursor Where to start, updated for the next call. The listing is
+ *      over when cursor->slot reaches header.max_files.
+ * @param ids Where to copy the (NUL-terminated) IDs, room for max_ids of them.
+ * @param nb_ids Number of IDs copied.
+ * @return some error code.
+ */
+int do_list_ids(const struct imgfs_file* imgfs_file, const char* prefix,
+                struct imgfs_list_cursor* cursor,
+                char (*ids)[MAX_IMG_ID + 1], size_t max_ids, size_t* nb_ids);
+
 /**
  * @brief Creates the imgFS called imgfs_filename. Writes the header and the
  *        preallocated empty metadata array to imgFS file.
@@ -149,6 +216,16 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
  */
 int do_delete(const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Finds the index of a valid image in the metadata array.
+ *
+ * @param img_id The ID of the image to be found.
+ * @param imgfs_file The main in-memory data structure
+ * @param index Location of the index of the image
+ * @return Some error code. 0 if no error.
+ */
+int find_image(const char* img_id, const struct imgfs_file* imgfs_file, size_t* index);
+
 /**
  * @brief Transforms resolution string to its int value.
  *
@@ -171,6 +248,24 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Locates the content of an image inside the imgFS file without reading it.
+ *
+ * The requested resolution is created first if needed (as for do_read()).
+ * The content can then be streamed directly from the returned file descriptor,
+ * e.g. with sendfile(); it is never modified once written.
+ *
+ * @param img_id The ID of the image to be located.
+ * @param resolution The desired resolution for the image.
+ * @param fd Location of the file descriptor of the imgFS file
+ * @param offset Location of the offset of the image content in the file
+ * @param image_size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_location(const char* img_id, int resolution, int* fd, uint64_t* offset,
+                     uint32_t* image_size, struct imgfs_file* imgfs_file);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -182,6 +277,89 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Starts inserting an image whose content is not in memory (streaming insert).
+ *
+ * Checks that img_id can be inserted and reserves image_size bytes (at most
+ * MAX_STREAM_IMAGE_SIZE) at the end of the imgFS file. Nothing is visible (no metadata) until do_insert_stream_commit().
+ * Must be called under the same lock as the other functions modifying imgfs_file.
+ *
+ * @param img_id Image ID
+ * @param image_size Exact size of the content to come
+ * @param stream The insert to initialize
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_stream_begin(const char* img_id, uint64_t image_size,
+                           struct imgfs_insert_stream* stream, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Appends the next part of the content of a streaming insert.
+ *
+ * Writes it to the reserved region with pwrite(), hashes it and looks for the image
+ * dimensions. Only stream is modified, so this does not need the imgfs_file lock.
+ *
+ * @param stream The insert in progress
+ * @param data Next bytes of the content
+ * @param len Number of bytes in data
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_stream_write(struct imgfs_insert_stream* stream, const char* data, size_t len,
+                           const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Finishes a streaming insert: deduplicates and writes the metadata.
+ *
+ * Must be called under the same lock as do_insert_stream_begin().
+ *
+ * @param stream The insert in progress, all its content must have been written
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_stream_commit(struct imgfs_insert_stream* stream, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Cancels a streaming insert, giving back the reserved region when still possible.
+ *
+ * Must be called under the same lock as do_insert_stream_begin().
+ *
+ * @param stream The insert to cancel
+ * @param imgfs_file The main in-memory data structure
+ */
+void do_insert_stream_abort(struct imgfs_insert_stream* stream, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Hashes the images of a bulk insert and reads their dimensions, in parallel.
+ *
+ * Only the items are modified, so this does not need the imgfs_file lock. An item
+ * whose result is already set is skipped; otherwise its result is set to the error
+ * found (e.g. ERR_IMGLIB if it is not a JPEG image) or 0.
+ *
+ * @param items The images to prepare
+ * @param nb_items Number of items
+ * @param nb_threads Maximum number of threads to use (1: in the calling thread)
+ * @return Some error code (ERR_THREADING only if no thread could be started). 0 if no error.
+ */
+int do_insert_batch_prepare(struct imgfs_insert_item* items, size_t nb_items, size_t nb_threads);
+
+/**
+ * @brief Inserts the prepared images of a bulk insert.
+ *
+ * The new contents are appended one after the other, then the header and the
+ * metadata are written once for the whole batch. Each item gets its own result
+ * (e.g. ERR_DUPLICATE_ID, ERR_IMGFS_FULL); the others are inserted anyway.
+ * Must be called under the same lock as the other functions modifying imgfs_file.
+ *
+ * @param items The images, prepared by do_insert_batch_prepare()
+ * @param nb_items Number of items
+ * @param nb_inserted Location of the number of images inserted
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code, for the batch as a whole (then nothing is inserted). 0 if no error.
+ */
+int do_insert_batch(struct imgfs_insert_item* items, size_t nb_items, size_t* nb_inserted,
+                    struct imgfs_file* imgfs_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
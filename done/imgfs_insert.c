@@ -5,6 +5,53 @@
 #include <unistd.h> // for fcntl
 #include <fcntl.h>  // for fcntl
 #include <string.h> // for strncpy
+#include <errno.h>
+#include "image_dedup.h"    // for do_name_and_content_dedup()
+#include <pthread.h>
+#include <stdlib.h> // for calloc
+#include <inttypes.h> // for PRIu32, PRIu64
+
+int decr_header(struct imgfs_file* imgfs_file);
+
+// marks metadata[i] valid, updates the header and writes both to disk
+static int commit_metadata(struct imgfs_file* imgfs_file, size_t i)
+{
+    // finalize metadata
+    imgfs_file->metadata[i].is_valid = NON_EMPTY;
+
+    // update header data
+    imgfs_file->header.nb_files++;
+    imgfs_file->header.version++;
+
+    // write to disk (header-metadatas-imagecontent)
+    int res = fseek(imgfs_file->file, 0, SEEK_SET);
+    if (res) {
+        return ERR_IO;
+    }
+    res = (int) fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file);
+    if (res != 1) {
+        return ERR_IO;
+    }
+    // "your code must not write all the metadata to disk for each operation!" --> only write modified metadata
+    res = fseek(imgfs_file->file, (long) (i * sizeof(struct img_metadata)), SEEK_CUR);
+    if (res) {
+        int res2 = decr_header(imgfs_file);
+        if (res2) {
+            return res2;
+        }
+        return ERR_IO;
+    }
+    res = (int) fwrite(&imgfs_file->metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file);
+    if (res != 1) {
+        int res2 = decr_header(imgfs_file);
+        if (res2) {
+            return res2;
+        }
+        return ERR_IO;
+    }
+
+    return ERR_NONE;
+}
 
 /**
  * @brief Insert image in the imgFS file
@@ -14,8 +61,6 @@
  * @param img_id Image ID
  * @return Some error code. 0 if no error.
  */
-
-
 int do_insert(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file)
 {
 
@@ -77,41 +122,7 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, s
                 imgfs_file->metadata[i].offset[ORIG_RES] = offset_;
             }
 
-            // finalize metadata
-            imgfs_file->metadata[i].is_valid = NON_EMPTY;
-
-            // update header data
-            imgfs_file->header.nb_files++;
-            imgfs_file->header.version++;
-
-            // write to disk (header-metadatas-imagecontent)
-            res = fseek(imgfs_file->file, 0, SEEK_SET);
-            if (res) {
-                return ERR_IO;
-            }
-            res = fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file);
-            if (res != 1) {
-                return ERR_IO;
-            }
-            // "your code must not write all the metadata to disk for each operation!" --> only write modified metadata
-            res = fseek(imgfs_file->file, i * sizeof(struct img_metadata), SEEK_CUR);
-            if (res) {
-                int res2 = decr_header(imgfs_file);
-                if (res2) {
-                    return res2;
-                }
-                return ERR_IO;
-            }
-            res = fwrite(&imgfs_file->metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file);
-            if (res != 1) {
-                int res2 = decr_header(imgfs_file);
-                if (res2) {
-                    return res2;
-                }
-                return ERR_IO;
-            }
-
-            return ERR_NONE;
+            return commit_metadata(imgfs_file, (size_t) i);
         }
     }
     return ERR_IMGFS_FULL;
@@ -132,4 +143,370 @@ int decr_header(struct imgfs_file* imgfs_file)
     }
 
     return ERR_NONE;
-}
\ No newline at end of file
+}
+
+/********************************************************************
+ * Streaming insert: the content is written to a region reserved at
+ * the end of the file as it arrives, only the metadata is committed
+ * at the end. Memory use does not depend on the image size.
+ */
+static int is_writable(const struct imgfs_file* imgfs_file)
+{
+    int fd = fileno(imgfs_file->file);
+    return (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+}
+
+int do_insert_stream_begin(const char* img_id, uint64_t image_size,
+                           struct imgfs_insert_stream* stream, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    memset(stream, 0, sizeof(*stream));
+    if (image_size == 0 || image_size > MAX_STREAM_IMAGE_SIZE) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (!is_writable(imgfs_file)) {
+        return ERR_IO;
+    }
+    if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) {
+        return ERR_IMGFS_FULL;
+    }
+    // fail before the content is sent rather than after
+    size_t index = 0;
+    if (find_image(img_id, imgfs_file, &index) == ERR_NONE) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    stream->sha = EVP_MD_CTX_new();
+    if (stream->sha == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (EVP_DigestInit_ex(stream->sha, EVP_sha256(), NULL) != 1) {
+        EVP_MD_CTX_free(stream->sha);
+        stream->sha = NULL;
+        return ERR_RUNTIME;
+    }
+
+    // reserve the region: later appends (other inserts, resizes) go after it
+    if (fflush(imgfs_file->file) || fseek(imgfs_file->file, 0, SEEK_END)) {
+        EVP_MD_CTX_free(stream->sha);
+        stream->sha = NULL;
+        return ERR_IO;
+    }
+    const long end = ftell(imgfs_file->file);
+    if (end < 0 || ftruncate(fileno(imgfs_file->file), (off_t) ((uint64_t) end + image_size))) {
+        EVP_MD_CTX_free(stream->sha);
+        stream->sha = NULL;
+        return ERR_IO;
+    }
+
+    strncpy(stream->img_id, img_id, MAX_IMG_ID);
+    jpeg_probe_init(&stream->probe);
+    stream->offset = (uint64_t) end;
+    stream->size = (uint32_t) image_size;
+    return ERR_NONE;
+}
+
+int do_insert_stream_write(struct imgfs_insert_stream* stream, const char* data, size_t len,
+                           const struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(data);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(stream->sha);
+
+    if (len > (size_t) (stream->size - stream->written)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // dimensions come from the first bytes, no need to keep or decode the image
+    if (!jpeg_probe_done(&stream->probe)) {
+        int ret = jpeg_probe_feed(&stream->probe, data, len);
+        if (ret) {
+            return ret;
+        }
+    }
+    if (EVP_DigestUpdate(stream->sha, data, len) != 1) {
+        return ERR_RUNTIME;
+    }
+
+    const int fd = fileno(imgfs_file->file);
+    size_t done = 0;
+    while (done < len) {
+        const ssize_t n = pwrite(fd, data + done, len - done,
+                                 (off_t) (stream->offset + stream->written + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return ERR_IO;
+        }
+        done += (size_t) n;
+    }
+    stream->written += (uint32_t) len;
+    return ERR_NONE;
+}
+
+// gives the reserved region back if nothing was appended after it;
+// otherwise it stays in the file, unused: reported, as nothing refers to it any more
+static void release_reservation(const struct imgfs_insert_stream* stream, struct imgfs_file* imgfs_file)
+{
+    long end = -1;
+    if (!fflush(imgfs_file->file) && !fseek(imgfs_file->file, 0, SEEK_END)) {
+        end = ftell(imgfs_file->file);
+    }
+    if (end >= 0 && (uint64_t) end == stream->offset + stream->size
+        && !ftruncate(fileno(imgfs_file->file), (off_t) stream->offset)) {
+        return;
+    }
+    fprintf(stderr, "insert of %s aborted: %" PRIu32 " unused bytes left at offset %" PRIu64 " of the imgFS file\n",
+            stream->img_id, stream->size, stream->offset);
+}
+
+void do_insert_stream_abort(struct imgfs_insert_stream* stream, struct imgfs_file* imgfs_file)
+{
+    if (stream == NULL || imgfs_file == NULL || stream->sha == NULL) {
+        return;
+    }
+    EVP_MD_CTX_free(stream->sha);
+    stream->sha = NULL;
+    release_reservation(stream, imgfs_file);
+}
+
+int do_insert_stream_commit(struct imgfs_insert_stream* stream, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(stream->sha);
+
+    int ret = ERR_NONE;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    if (stream->written != stream->size) {
+        ret = ERR_IO;
+    } else if (!jpeg_probe_done(&stream->probe)) {
+        ret = ERR_IMGLIB;
+    } else if (EVP_DigestFinal_ex(stream->sha, sha, NULL) != 1) {
+        ret = ERR_RUNTIME;
+    } else if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) {
+        ret = ERR_IMGFS_FULL;   // may have changed while the content was arriving
+    }
+    if (ret) {
+        do_insert_stream_abort(stream, imgfs_file);
+        return ret;
+    }
+    EVP_MD_CTX_free(stream->sha);
+    stream->sha = NULL;
+
+    for (size_t i = 0; i < imgfs_file->header.max_files; i++) {
+        if (!imgfs_file->metadata[i].is_valid) {
+            struct img_metadata* metadata = &imgfs_file->metadata[i];
+            memset(metadata, 0, sizeof(struct img_metadata));
+            memcpy(metadata->SHA, sha, SHA256_DIGEST_LENGTH);
+            strncpy(metadata->img_id, stream->img_id, MAX_IMG_ID);
+            metadata->size[ORIG_RES] = stream->size;
+            metadata->orig_res[0] = stream->probe.width;
+            metadata->orig_res[1] = stream->probe.height;
+
+            ret = do_name_and_content_dedup(imgfs_file, (uint32_t) i);
+            if (ret) {
+                release_reservation(stream, imgfs_file);
+                return ret;
+            }
+
+            if (metadata->offset[ORIG_RES] == 0) {
+                metadata->offset[ORIG_RES] = stream->offset;
+            } else {
+                // same content already stored: the copy just written is not needed
+                release_reservation(stream, imgfs_file);
+            }
+            return commit_metadata(imgfs_file, i);
+        }
+    }
+    release_reservation(stream, imgfs_file);
+    return ERR_IMGFS_FULL;
+}
+
+/********************************************************************
+ * Bulk insert: the images are hashed and probed in parallel, outside
+ * the lock; then their contents are appended one after the other and
+ * all their metadata are written at once.
+ */
+#define MAX_PREPARE_THREADS 16
+
+struct prepare_job {
+    struct imgfs_insert_item* items;
+    size_t nb_items;
+    size_t next;            // next item to take, shared by the threads
+};
+
+static void prepare_item(struct imgfs_insert_item* item)
+{
+    if (item->data == NULL || item->size == 0 || item->size > UINT32_MAX) {
+        item->result = ERR_INVALID_ARGUMENT;
+        return;
+    }
+    SHA256((const unsigned char*) item->data, item->size, item->SHA);
+
+    // dimensions come from the frame header, no need to decode the image
+    item->result = get_resolution(&item->height, &item->width, item->data, item->size);
+}
+
+static void* prepare_worker(void* arg)
+{
+    struct prepare_job* job = arg;
+    for (;;) {
+        const size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->nb_items) {
+            return NULL;
+        }
+        if (job->items[i].result == ERR_NONE) {
+            prepare_item(&job->items[i]);
+        }
+    }
+}
+
+int do_insert_batch_prepare(struct imgfs_insert_item* items, size_t nb_items, size_t nb_threads)
+{
+    M_REQUIRE_NON_NULL(items);
+
+    struct prepare_job job = { items, nb_items, 0 };
+    if (nb_threads > MAX_PREPARE_THREADS) nb_threads = MAX_PREPARE_THREADS;
+    if (nb_threads > nb_items) nb_threads = nb_items;
+
+    // the calling thread works too
+    pthread_t threads[MAX_PREPARE_THREADS];
+    size_t started = 0;
+    while (started + 1 < nb_threads
+           && !pthread_create(&threads[started], NULL, prepare_worker, &job)) {
+        ++started;
+    }
+    prepare_worker(&job);
+    for (size_t t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    return ERR_NONE;
+}
+
+static int write_metadata_range(struct imgfs_file* imgfs_file, size_t first, size_t last)
+{
+    if (fseek(imgfs_file->file, 0, SEEK_SET)
+        || fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1
+        || fseek(imgfs_file->file, (long) (first * sizeof(struct img_metadata)), SEEK_CUR)) {
+        return ERR_IO;
+    }
+    const size_t nb = last - first + 1;
+    if (fwrite(&imgfs_file->metadata[first], sizeof(struct img_metadata), nb, imgfs_file->file) != nb) {
+        return ERR_IO;
+    }
+    return fflush(imgfs_file->file) ? ERR_IO : ERR_NONE;
+}
+
+int do_insert_batch(struct imgfs_insert_item* items, size_t nb_items, size_t* nb_inserted,
+                    struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(items);
+    M_REQUIRE_NON_NULL(nb_inserted);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    *nb_inserted = 0;
+    if (!is_writable(imgfs_file)) {
+        return ERR_IO;
+    }
+    if (fflush(imgfs_file->file) || fseek(imgfs_file->file, 0, SEEK_END)) {
+        return ERR_IO;
+    }
+    const long end = ftell(imgfs_file->file);
+    if (end < 0) {
+        return ERR_IO;
+    }
+
+    // slot taken by each item (max_files if none), and whether its content is to be written
+    const size_t max_files = imgfs_file->header.max_files;
+    size_t* slots = calloc(nb_items > 0 ? nb_items : 1, sizeof(size_t));
+    char* append = calloc(nb_items > 0 ? nb_items : 1, 1);
+    if (slots == NULL || append == NULL) {
+        free(slots);
+        free(append);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // first pass, in memory: each item sees the ones before it (duplicate IDs or contents)
+    uint64_t offset = (uint64_t) end;
+    size_t first = max_files;
+    size_t last = 0;
+    size_t free_slot = 0;
+    for (size_t k = 0; k < nb_items; ++k) {
+        struct imgfs_insert_item* item = &items[k];
+        slots[k] = max_files;
+        if (item->result) {
+            continue;
+        }
+        while (free_slot < max_files && imgfs_file->metadata[free_slot].is_valid) {
+            ++free_slot;
+        }
+        if (free_slot >= max_files) {
+            item->result = ERR_IMGFS_FULL;
+            continue;
+        }
+
+        struct img_metadata* metadata = &imgfs_file->metadata[free_slot];
+        memset(metadata, 0, sizeof(struct img_metadata));
+        memcpy(metadata->SHA, item->SHA, SHA256_DIGEST_LENGTH);
+        strncpy(metadata->img_id, item->img_id, MAX_IMG_ID);
+        metadata->size[ORIG_RES] = (uint32_t) item->size;
+        metadata->orig_res[0] = item->width;
+        metadata->orig_res[1] = item->height;
+
+        item->result = do_name_and_content_dedup(imgfs_file, (uint32_t) free_slot);
+        if (item->result) {
+            continue;
+        }
+        if (metadata->offset[ORIG_RES] == 0) {
+            metadata->offset[ORIG_RES] = offset;
+            offset += item->size;
+            append[k] = 1;
+        }
+        metadata->is_valid = NON_EMPTY;
+        slots[k] = free_slot;
+        first = free_slot < first ? free_slot : first;
+        last = free_slot > last ? free_slot : last;
+        ++*nb_inserted;
+    }
+
+    // then on disk: the new contents in order, the header and all the metadata at once
+    int ret = ERR_NONE;
+    if (*nb_inserted > 0) {
+        for (size_t k = 0; ret == ERR_NONE && k < nb_items; ++k) {
+            if (append[k] && fwrite(items[k].data, items[k].size, 1, imgfs_file->file) != 1) {
+                ret = ERR_IO;
+            }
+        }
+        imgfs_file->header.nb_files += (uint32_t) *nb_inserted;
+        imgfs_file->header.version += (uint32_t) *nb_inserted;
+        if (ret == ERR_NONE) {
+            ret = write_metadata_range(imgfs_file, first, last);
+        }
+    }
+
+    if (ret) {
+        // nothing of the batch is kept
+        imgfs_file->header.nb_files -= (uint32_t) *nb_inserted;
+        imgfs_file->header.version -= (uint32_t) *nb_inserted;
+        for (size_t k = 0; k < nb_items; ++k) {
+            if (slots[k] < max_files) {
+                imgfs_file->metadata[slots[k]].is_valid = EMPTY;
+                items[k].result = ret;
+            }
+        }
+        *nb_inserted = 0;
+        if (write_metadata_range(imgfs_file, first, last) == ERR_NONE
+            && ftruncate(fileno(imgfs_file->file), (off_t) end)) {
+            perror("ftruncate() in do_insert_batch()");
+        }
+    }
+    free(slots);
+    free(append);
+    return ret;
+}
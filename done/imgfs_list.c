@@ -2,8 +2,9 @@
 #include "util.h"   // for "TO_BE_IMPLEMENTED"
 #include <unistd.h> // for fcntl
 #include <fcntl.h>  // for fcntl
-#include <json-c/json.h>
+#include "json_writer.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -38,29 +39,56 @@ int do_list(const struct imgfs_file* structure, enum do_list_mode output_mode, c
     }
     if (output_mode == JSON) {
         M_REQUIRE_NON_NULL(json);
-        struct json_object* json_object  = json_object_new_object();
-        if (json_object == NULL) {
-            return ERR_RUNTIME;
-        }
-        struct json_object* json_array = json_object_new_array();
-        if (json_array == NULL) {
-            json_object_put(json_object);
-            return ERR_RUNTIME;
-        }
-        struct json_object* json_string;
-        for (int i = 0; i < structure->header.max_files; i++) {
+        // written as it goes, no intermediate object tree
+        struct json_memory memory = { NULL, 0, 0 };
+        struct json_writer writer;
+        json_writer_init(&writer, json_memory_sink, &memory);
+
+        json_write_raw(&writer, JSON_LIST_START, strlen(JSON_LIST_START));
+        int first = 1;
+        for (uint32_t i = 0; i < structure->header.max_files; i++) {
             if (structure->metadata[i].is_valid != 0) {
-                json_object_array_add(json_array, json_object_new_string(structure->metadata[i].img_id));
+                json_write_raw(&writer, first ? " " : ", ", first ? 1 : 2);
+                json_write_string(&writer, structure->metadata[i].img_id, MAX_IMG_ID);
+                first = 0;
             }
         }
-        json_object_object_add(json_object,"Images",  json_array);
-        *json = calloc(structure->header.nb_files * MAX_IMG_ID + 18, sizeof(char));
-        if(*json==NULL) {
-            return ERR_OUT_OF_MEMORY;
+        json_write_raw(&writer, JSON_LIST_END, strlen(JSON_LIST_END));
+
+        const int ret = json_writer_flush(&writer);
+        if (ret != ERR_NONE) {
+            free(memory.data);
+            return ret;
+        }
+        *json = memory.data;
+    }
+    return ERR_NONE;
+}
+
+int do_list_ids(const struct imgfs_file* imgfs_file, const char* prefix,
+                struct imgfs_list_cursor* cursor,
+                char (*ids)[MAX_IMG_ID + 1], size_t max_ids, size_t* nb_ids)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(prefix);
+    M_REQUIRE_NON_NULL(cursor);
+    M_REQUIRE_NON_NULL(ids);
+    M_REQUIRE_NON_NULL(nb_ids);
+
+    const size_t prefix_len = strlen(prefix);
+    *nb_ids = 0;
+    for (; cursor->slot < imgfs_file->header.max_files && *nb_ids < max_ids; cursor->slot++) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[cursor->slot];
+        if (!metadata->is_valid || strncmp(metadata->img_id, prefix, prefix_len)) {
+            continue;
+        }
+        if (cursor->skip > 0) {
+            cursor->skip--;
+            continue;
         }
-        const char *result = json_object_to_json_string(json_object);
-        strncpy(*json, result, strlen(result)*sizeof(char));
-        json_object_put(json_object);
+        strncpy(ids[*nb_ids], metadata->img_id, MAX_IMG_ID);
+        ids[*nb_ids][MAX_IMG_ID] = '\0';
+        ++*nb_ids;
     }
     return ERR_NONE;
-}
\ No newline at end of file
+}
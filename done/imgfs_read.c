@@ -4,53 +4,105 @@
 #include <stdio.h>         // for FILE
 #include "imgfs.h"
 #include "image_content.h"
+#include "trace.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h> // for fcntl
 #include <fcntl.h>  // for fcntl
 
+// finds img_id and makes sure the requested resolution exists in the file
+static int prepare_read(const char* img_id, int resolution, struct imgfs_file* imgfs_file, size_t* index)
+{
+    if (resolution < 0 || resolution >= NB_RES) {
+        return ERR_RESOLUTIONS;
+    }
+
+    int ret = find_image(img_id, imgfs_file, index);
+    if (ret) {
+        return ret;
+    }
+
+    const struct img_metadata* metadata = &imgfs_file->metadata[*index];
+    if (metadata->offset[resolution] == 0 || metadata->size[resolution] == 0) {
+        // check if imgfs_file->file is not opened in write mode
+        int fd = fileno(imgfs_file->file);
+        // get flags
+        int mode = fcntl(fd, F_GETFL) & O_ACCMODE;
+        if (mode != O_RDWR) {
+            return ERR_IO;
+        }
+        struct trace_span span;
+        TRACE_SPAN_BEGIN(&span, "lazily_resize");
+        ret = lazily_resize(resolution, imgfs_file, *index);
+        TRACE_SPAN_END(&span);
+        if (ret) {
+            return ret;
+        }
+    }
+    return ERR_NONE;
+}
+
 int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
 {
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(imgfs_file);
     M_REQUIRE_NON_NULL(image_buffer);
     M_REQUIRE_NON_NULL(image_size);
+
+    size_t i = 0;
+    int ret = prepare_read(img_id, resolution, imgfs_file, &i);
+    if (ret) {
+        return ret;
+    }
+
+    *image_buffer = calloc(1, imgfs_file->metadata[i].size[resolution]);
+    if (*image_buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    *image_size = imgfs_file->metadata[i].size[resolution];
+    struct trace_span span;
+    TRACE_SPAN_BEGIN(&span, "read_image");
+    ret = fseek(imgfs_file->file, (long) imgfs_file->metadata[i].offset[resolution], SEEK_SET);
+    if(ret) {
+        free(*image_buffer);
+        *image_buffer = NULL;
+        return ERR_IO;
+    }
+    ret = (int) fread(*image_buffer, *image_size, 1, imgfs_file->file);
+    if(ret != 1) {
+        free(*image_buffer);
+        *image_buffer = NULL;
+        return ERR_IO;
+    }
+    TRACE_SPAN_END(&span);
+    return ERR_NONE;
+}
+
+int do_read_location(const char* img_id, int resolution, int* fd, uint64_t* offset,
+                     uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(fd);
+    M_REQUIRE_NON_NULL(offset);
+    M_REQUIRE_NON_NULL(image_size);
     M_REQUIRE_NON_NULL(imgfs_file);
 
-    int ret = 0;
-    for (int i = 0; i < imgfs_file->header.max_files; i++) {
-        if(!strncmp(imgfs_file->metadata[i].img_id, img_id, MAX_IMG_ID)) {
-            if (!(imgfs_file->metadata[i].is_valid)) {
-                return ERR_INVALID_IMGID;
-            }
-            if (imgfs_file->metadata[i].offset[resolution] == NULL || imgfs_file->metadata[i].size[resolution] == NULL) {
-                // check if imgfs_file->file is not opened in write mode
-                int fd = fileno(imgfs_file->file);
-                // get flags
-                int mode = fcntl(fd, F_GETFL) & O_ACCMODE;
-                if (mode != O_RDWR) {
-                    return ERR_IO;
-                }
-                lazily_resize(resolution, imgfs_file, i);
-            }
-            *image_buffer = calloc(1, imgfs_file->metadata[i].size[resolution]);
-            if (image_buffer == NULL) {
-                return ERR_OUT_OF_MEMORY;
-            }
-            *image_size = imgfs_file->metadata[i].size[resolution];
-            ret = fseek(imgfs_file->file, imgfs_file->metadata[i].offset[resolution], SEEK_SET);
-            if(ret) {
-                free(*image_buffer);
-                return ERR_IO;
-            }
-            ret = fread(*image_buffer, *image_size, 1, imgfs_file->file);
-            if(ret != 1) {
-                free(*image_buffer);
-                return ERR_IO;
-            }
-            *image_size = imgfs_file->metadata[i].size[resolution];
-            return ERR_NONE;
-        }
+    size_t i = 0;
+    int ret = prepare_read(img_id, resolution, imgfs_file, &i);
+    if (ret) {
+        return ret;
     }
-    return ERR_IMAGE_NOT_FOUND;
-}
\ No newline at end of file
+
+    // a fresh resize may still sit in the stdio buffer: the caller reads the fd directly
+    struct trace_span span;
+    TRACE_SPAN_BEGIN(&span, "fflush");
+    if (fflush(imgfs_file->file)) {
+        return ERR_IO;
+    }
+    TRACE_SPAN_END(&span);
+
+    *fd = fileno(imgfs_file->file);
+    *offset = imgfs_file->metadata[i].offset[resolution];
+    *image_size = imgfs_file->metadata[i].size[resolution];
+    return ERR_NONE;
+}
@@ -17,11 +17,14 @@
 #include <stdlib.h> // abort()
 #include <bits/sigaction.h>
 
+// set by the signal handler, which also wakes the main thread up in http_receive()
+static volatile sig_atomic_t stopping;
+
 /********************************************************************/
 static void signal_handler(int sig_num _unused)
 {
-    server_shutdown();
-    exit(0);
+    stopping = 1;
+    http_wake();
 }
 
 /********************************************************************/
@@ -39,6 +42,12 @@ static void set_signal_handler(void)
         perror("sigaction() in set_signal_handler()");
         abort();
     }
+    // a client gone while sendfile() writes to it gives EPIPE, not a killed server
+    action.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &action, NULL) < 0) {
+        perror("sigaction() in set_signal_handler()");
+        abort();
+    }
 }
 
 /********************************************************************/
@@ -51,10 +60,12 @@ int main (int argc, char *argv[])
     }
     set_signal_handler();
     int err = 0;
-    while ((err = http_receive()) == ERR_NONE);
-
+    while ((err = http_receive()) == ERR_NONE && !stopping);
 
-    fprintf(stderr, "http_receive() failed\n");
-    fprintf(stderr, "%s\n", ERR_MSG(err));
+    if (!stopping) {
+        fprintf(stderr, "http_receive() failed\n");
+        fprintf(stderr, "%s\n", ERR_MSG(err));
+    }
+    server_shutdown();
     return 0;
 }
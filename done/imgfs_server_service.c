@@ -8,14 +8,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdint.h> // uint16_t
+#include <errno.h>
+#include <stdint.h> // uint16_t, SIZE_MAX
+#include <inttypes.h> // PRIu32
 #include <pthread.h>
+#include <unistd.h> // pread
 #include <vips/vips.h>
+#include <openssl/sha.h> // SHA256_DIGEST_LENGTH
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
 #include "http_net.h"
+#include "json_writer.h"
+#include "content_encoding.h"
+#include "image_cache.h"
+#include "list_cache.h"
+#include "tar.h"
+#include "metrics.h"
+#include "trace.h"
 #include "imgfs_server_service.h"
 
 // Main in-memory structure for imgFS
@@ -23,11 +34,115 @@ static struct imgfs_file fs_file;
 static uint16_t server_port;
 static pthread_mutex_t mut;
 
+// rendered /imgfs/list body and its compressed variants, for one version of the imgFS
+// (protected by mut, like fs_file); insert and delete drop it at once to free the memory
+static struct list_cache list_cache;
+
+// hot thumbnails and small images, served from memory (see image_cache.h);
+// keyed by content, so an entry never becomes stale, deletes only free memory
+#define IMAGE_CACHE_BUDGET ((size_t) 64 << 20)
+static struct image_cache image_cache;
+
+/**********************************************************************
+ * The imgFS lock, timed for /metrics: waiting for it, then holding it.
+ ********************************************************************** */
+static uint64_t lock_acquired_ns;   // protected by mut
+static struct trace_span lock_span; // idem
+
+static void fs_lock(void)
+{
+    struct trace_span wait_span;
+    TRACE_SPAN_BEGIN(&wait_span, "lock_wait");
+    const uint64_t start = metrics_now_ns();
+    pthread_mutex_lock(&mut);
+    lock_acquired_ns = metrics_now_ns();
+    TRACE_SPAN_END(&wait_span);
+    TRACE_SPAN_BEGIN(&lock_span, "lock_hold");
+    metrics_observe_lock_wait(lock_acquired_ns - start);
+}
+
+static void fs_unlock(void)
+{
+    const uint64_t held = metrics_now_ns() - lock_acquired_ns;
+    TRACE_SPAN_END(&lock_span);
+    pthread_mutex_unlock(&mut);
+    metrics_observe_lock_hold(held);
+}
+
 #define URI_ROOT "/imgfs"
 
+// a stored image never changes, but an id may be deleted and reused: short max-age, then revalidation
+#define READ_CACHE_CONTROL "public, max-age=60"
+#define LIST_CACHE_CONTROL "no-cache"
+// "<SHA in hex>-<resolution>", quotes included
+#define ETAG_SIZE (2 * SHA256_DIGEST_LENGTH + 16)
+
+/********************************************************************//**
+ * Server options, after the imgFS file name and port:
+ *   -acceptors <N>: N listening sockets (SO_REUSEPORT), each with its accepting thread
+ *   -backlog <N>: at most N pending connections per listening socket
+ *   -max_connections <N>, -max_in_flight <N>, -max_buffered <MiB>: beyond these
+ *      (open connections, requests being handled, receive buffers), 503 (0: no limit)
+ *   -idle_timeout <s>, -header_timeout <s>, -body_timeout <s>: slow clients are
+ *      disconnected after these delays (0: no limit)
+ *   -trace <file>, -trace_sample <N>: spans of one request in N written to file
+ *      at shutdown, as a Chrome trace (if built with make TRACE=1)
+ *   -unix <path>: also listen on this Unix domain socket (e.g. for a local reverse proxy)
+ *   -drain_timeout <s>: at shutdown, how long requests in progress may take (0: no limit)
+ ********************************************************************** */
+static const char* trace_file;
+static unsigned trace_sample = TRACE_DEFAULT_SAMPLE;
+
+static int parse_server_options(int argc, char** argv, struct http_options* options)
+{
+    for (int i = 0; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            return ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+        if (!strcmp(argv[i], "-acceptors")) {
+            options->acceptors = atouint16(argv[i + 1]);
+            if (options->acceptors == 0 || options->acceptors > MAX_ACCEPTORS) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-max_connections")) {
+            options->max_connections = atouint32(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-max_in_flight")) {
+            options->max_in_flight = atouint32(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-max_buffered")) {
+            options->max_buffered = (size_t) atouint32(argv[i + 1]) << 20;
+        } else if (!strcmp(argv[i], "-idle_timeout")) {
+            options->idle_timeout_ms = 1000 * atouint16(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-header_timeout")) {
+            options->header_timeout_ms = 1000 * atouint16(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-body_timeout")) {
+            options->body_timeout_ms = 1000 * atouint16(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-drain_timeout")) {
+            options->drain_timeout_ms = 1000 * atouint16(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-unix")) {
+            options->unix_path = argv[i + 1];
+        } else if (!strcmp(argv[i], "-trace")) {
+            trace_file = argv[i + 1];
+        } else if (!strcmp(argv[i], "-trace_sample")) {
+            trace_sample = atouint32(argv[i + 1]);
+            if (trace_sample == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-backlog")) {
+            options->backlog = atouint16(argv[i + 1]);
+            if (options->backlog == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    return ERR_NONE;
+}
+
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name as argv[1], optionnaly port number as argv[2],
+ * then the server options
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
@@ -36,6 +151,28 @@ int server_startup (int argc, char **argv)
         return ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
+    server_port = DEFAULT_LISTENING_PORT;
+    int first_option = 2;
+    if (argc > 2 && argv[2][0] != '-') {
+        if (atoi(argv[2]) > 0) {
+            server_port = atoi(argv[2]);
+        }
+        first_option = 3;
+    }
+    struct http_options options = { DEFAULT_BACKLOG, 1,
+                                    DEFAULT_MAX_CONNECTIONS, DEFAULT_MAX_IN_FLIGHT, DEFAULT_MAX_BUFFERED,
+                                    DEFAULT_IDLE_TIMEOUT_MS, DEFAULT_HEADER_TIMEOUT_MS, DEFAULT_BODY_TIMEOUT_MS,
+                                    DEFAULT_DRAIN_TIMEOUT_MS, NULL
+                                  };
+    int ret = parse_server_options(argc - first_option, argv + first_option, &options);
+    if (ret) {
+        printf("Usage: %s <imgfs file> [port] [-acceptors <N>] [-backlog <N>]"
+               " [-max_connections <N>] [-max_in_flight <N>] [-max_buffered <MiB>]"
+               " [-idle_timeout <s>] [-header_timeout <s>] [-body_timeout <s>]"
+               " [-trace <file>] [-trace_sample <N>] [-unix <path>] [-drain_timeout <s>]\n", argv[0]);
+        return ret;
+    }
+
     if (VIPS_INIT(argv[0])) {
         vips_error_exit("unable to start VIPS");
     }
@@ -44,38 +181,71 @@ int server_startup (int argc, char **argv)
         perror("Error initializing mutex");
         return ERR_THREADING;
     }
-    pthread_mutex_lock(&mut);
-    int ret = do_open(argv[1], "rb+", &fs_file);
-    pthread_mutex_unlock(&mut);
+    fs_lock();
+    ret = do_open(argv[1], "rb+", &fs_file);
+    fs_unlock();
     if(ret) {
         return ret;
     }
+    ret = image_cache_init(&image_cache, IMAGE_CACHE_BUDGET);
+    if (ret) {
+        do_close(&fs_file);
+        return ret;
+    }
     print_header(&fs_file.header);
-
-    server_port = DEFAULT_LISTENING_PORT;
-    if (argc > 2 && atoi(argv[2]) > 0) {
-        server_port = atoi(argv[2]);
+    ret = trace_file != NULL ? trace_open(trace_file, trace_sample) : ERR_NONE;
+    if (ret) {
+        image_cache_free(&image_cache);
+        do_close(&fs_file);
+        return ret;
     }
 
     // sets handle_http_message as CallBack function
-    http_init(server_port, handle_http_message);
+    http_set_stream_callback(handle_http_stream, MAX_STREAM_IMAGE_SIZE);
+    ret = http_init_options(server_port, handle_http_message, &options);
+    if (ret < 0) {
+        return ret;
+    }
     printf("\"ImgFS server started on http://localhost:%d\"\n", server_port);
+    if (options.unix_path != NULL) {
+        printf("\"ImgFS server also listening on %s\"\n", options.unix_path);
+    }
     return ERR_NONE;
 }
 
 /********************************************************************//**
- * Shutdown function. Free the structures and close the file.
+ * Shutdown function. Lets the requests in progress finish (drain), then
+ * free the structures and close the file, its writes on the disk.
  ********************************************************************** */
 void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
+    const unsigned left = http_drain();
     http_close();
-    pthread_mutex_lock(&mut);
+    trace_close();
+    fs_lock();
+    if (fs_file.file != NULL && (fflush(fs_file.file) || fsync(fileno(fs_file.file)))) {
+        perror("Error flushing the imgFS file");
+    }
+    if (left > 0) {
+        // their threads may still use the imgFS: the lock is kept, and the process about to exit
+        fprintf(stderr, "%u connection(s) still open after the drain timeout\n", left);
+        return;
+    }
+    list_cache_invalidate(&list_cache);
     do_close(&fs_file);
 
-    pthread_mutex_unlock(&mut);
+    fs_unlock();
     pthread_mutex_destroy(&mut);
 
+    struct image_cache_stats stats;
+    image_cache_get_stats(&image_cache, &stats);
+    const uint64_t lookups = stats.hits + stats.misses;
+    fprintf(stderr, "Image cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%%), %" PRIu64 " evictions\n",
+            stats.hits, stats.misses, lookups > 0 ? 100.0 * (double) stats.hits / (double) lookups : 0.0,
+            stats.evictions);
+    image_cache_free(&image_cache);
+
     vips_shutdown();
 }
 /**********************************************************************
@@ -107,42 +277,304 @@ static int reply_302_msg(int connection)
     return http_reply(connection, "302 Found", location, "", 0);
 }
 
+/**********************************************************************
+ * Strong entity tag of an image at a given resolution: its content SHA
+ * (resized variants are derived from it) and the resolution.
+ ********************************************************************** */
+static void image_etag(const unsigned char* sha, int resolution, char* etag)
+{
+    static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+    etag[0] = '"';
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        snprintf(etag + 1 + 2 * i, 3, "%02x", sha[i]);
+    }
+    snprintf(etag + 1 + 2 * SHA256_DIGEST_LENGTH, ETAG_SIZE - 1 - 2 * SHA256_DIGEST_LENGTH,
+             "-%s\"", res_names[resolution]);
+}
+
+/**********************************************************************
+ * do_read_location(), under the lock; the first read of a thumbnail or
+ * small image creates it (lazy resize), which is timed for /metrics.
+ ********************************************************************** */
+static int read_location(const char* img_id, int resolution, size_t index,
+                         int* fd, uint64_t* offset, uint32_t* image_size)
+{
+    const int resize = resolution != ORIG_RES && fs_file.metadata[index].size[resolution] == 0;
+    const uint64_t start = resize ? metrics_now_ns() : 0;
+    const int ret = do_read_location(img_id, resolution, fd, offset, image_size, &fs_file);
+    if (resize && ret == ERR_NONE) {
+        metrics_observe_resize(metrics_now_ns() - start);
+    }
+    return ret;
+}
+
+int handle_list_call(struct http_message* msg, const struct http_query* query, int connection);
+int handle_read_call(struct http_message* msg, const struct http_query* query, int connection);
+int handle_delete_call(const struct http_query* query, int connection);
+int handle_insert_call(struct http_message* msg, const struct http_query* query, int connection);
+static int handle_batch_read_call(struct http_message* msg, const struct http_query* query, int connection);
+static int handle_bulk_insert_call(struct http_message* msg, int connection);
+static int handle_metrics_call(int connection);
+static int handle_info_call(const struct http_query* query, int connection);
+
+/**********************************************************************
+ * Route of a request, as timed in /metrics
+ ********************************************************************** */
+static enum metrics_route route_of(const struct http_message* msg, const struct http_query* query)
+{
+    if (http_match_uri(msg, URI_ROOT "/list")) {
+        return METRICS_ROUTE_LIST;
+    } else if (http_match_uri(msg, URI_ROOT "/insert")) {
+        return METRICS_ROUTE_INSERT;
+    } else if (http_match_uri(msg, URI_ROOT "/bulk_insert")) {
+        return METRICS_ROUTE_BULK_INSERT;
+    } else if (http_match_uri(msg, URI_ROOT "/batch_read")) {
+        return METRICS_ROUTE_BATCH_READ;
+    } else if (http_match_uri(msg, URI_ROOT "/delete")) {
+        return METRICS_ROUTE_DELETE;
+    } else if (http_match_uri(msg, URI_ROOT "/info")) {
+        return METRICS_ROUTE_INFO;
+    } else if (http_match_uri(msg, URI_ROOT "/read")) {
+        char res[10] = "";
+        http_query_copy(query, "res", res, sizeof(res));
+        switch (resolution_atoi(res)) {
+        case THUMB_RES:
+            return METRICS_ROUTE_READ_THUMB;
+        case SMALL_RES:
+            return METRICS_ROUTE_READ_SMALL;
+        case ORIG_RES:
+            return METRICS_ROUTE_READ_ORIG;
+        default:
+            break;
+        }
+    }
+    return METRICS_ROUTE_OTHER;
+}
+
 /**********************************************************************
  * Simple handling of http message. TO BE UPDATED WEEK 13
  ********************************************************************** */
-int handle_http_message(struct http_message* msg, int connection)
+static int route_message(struct http_message* msg, const struct http_query* query, int connection)
 {
-    M_REQUIRE_NON_NULL(msg);
     debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
                  connection,
                  (int) msg->uri.len, msg->uri.val);
     if (http_match_verb(&msg->uri, "/") || http_match_uri(msg, "/index.html")) {
-        return http_serve_file(connection, BASE_FILE);
+        return http_serve_file(connection, msg, BASE_FILE);
+    }
+
+    if (http_match_verb(&msg->uri, "/metrics")) {
+        return handle_metrics_call(connection);
     }
 
     if (http_match_uri(msg, URI_ROOT "/list")) {
-        return handle_list_call(msg, connection);
+        return handle_list_call(msg, query, connection);
     } else if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST")) {
-        return handle_insert_call(msg, connection);
+        return handle_insert_call(msg, query, connection);
+    } else if (http_match_uri(msg, URI_ROOT "/bulk_insert") && http_match_verb(&msg->method, "POST")) {
+        return handle_bulk_insert_call(msg, connection);
+    } else if (http_match_uri(msg, URI_ROOT "/batch_read")) {
+        return handle_batch_read_call(msg, query, connection);
     } else if (http_match_uri(msg, URI_ROOT "/read")) {
-        return handle_read_call(msg, connection);
+        return handle_read_call(msg, query, connection);
     } else if (http_match_uri(msg, URI_ROOT "/delete")) {
-        return handle_delete_call(msg, connection);
+        return handle_delete_call(query, connection);
+    } else if (http_match_uri(msg, URI_ROOT "/info")) {
+        return handle_info_call(query, connection);
     } else {
         return reply_error_msg(connection, ERR_INVALID_COMMAND);
     }
 }
 
-int handle_list_call(struct http_message* msg, int connection)
+// span names of the routes, in traces
+static const char* const route_names[NB_METRICS_ROUTES] = {
+    "list", "read_thumb", "read_small", "read_orig", "batch_read",
+    "insert", "bulk_insert", "delete", "info", "other"
+};
+
+int handle_http_message(struct http_message* msg, int connection)
+{
+    M_REQUIRE_NON_NULL(msg);
+    // the query string is parsed once, for the route and the handler
+    struct http_query query;
+    const int query_ret = http_parse_query(&msg->uri, &query);
+    const enum metrics_route route = route_of(msg, &query);
+    struct trace_span span;
+    TRACE_SPAN_BEGIN(&span, route_names[route]);
+    const uint64_t start = metrics_now_ns();
+    const int ret = query_ret ? reply_error_msg(connection, query_ret) : route_message(msg, &query, connection);
+    metrics_observe_request(route, metrics_now_ns() - start);
+    TRACE_SPAN_END(&span);
+    return ret;
+}
+
+/**********************************************************************
+ * Metrics, in the Prometheus text format: those of metrics.c, then the
+ * gauges and counters kept by the HTTP layer and the image cache.
+ ********************************************************************** */
+static int handle_metrics_call(int connection)
+{
+    struct http_stats http;
+    http_get_stats(&http);
+    struct image_cache_stats cache;
+    image_cache_get_stats(&image_cache, &cache);
+
+    struct metrics_text text = { NULL, 0, 0, 0 };
+    metrics_render(&text);
+    metrics_printf(&text, "# TYPE imgfs_http_open_connections gauge\n"
+                   "imgfs_http_open_connections %u\n"
+                   "# TYPE imgfs_http_in_flight_requests gauge\n"
+                   "imgfs_http_in_flight_requests %u\n"
+                   "# TYPE imgfs_http_buffered_bytes gauge\n"
+                   "imgfs_http_buffered_bytes %zu\n",
+                   http.open_connections, http.in_flight, http.buffered);
+    metrics_printf(&text, "# TYPE imgfs_http_rejected_total counter\n"
+                   "imgfs_http_rejected_total{what=\"connection\"} %" PRIu64 "\n"
+                   "imgfs_http_rejected_total{what=\"request\"} %" PRIu64 "\n"
+                   "# TYPE imgfs_http_timeouts_total counter\n"
+                   "imgfs_http_timeouts_total{phase=\"idle\"} %" PRIu64 "\n"
+                   "imgfs_http_timeouts_total{phase=\"header\"} %" PRIu64 "\n"
+                   "imgfs_http_timeouts_total{phase=\"body\"} %" PRIu64 "\n",
+                   http.rejected_connections, http.rejected_requests,
+                   http.timed_out_idle, http.timed_out_header, http.timed_out_body);
+    metrics_printf(&text, "# TYPE imgfs_image_cache_hits_total counter\n"
+                   "imgfs_image_cache_hits_total %" PRIu64 "\n"
+                   "# TYPE imgfs_image_cache_misses_total counter\n"
+                   "imgfs_image_cache_misses_total %" PRIu64 "\n"
+                   "# TYPE imgfs_image_cache_evictions_total counter\n"
+                   "imgfs_image_cache_evictions_total %" PRIu64 "\n"
+                   "# TYPE imgfs_image_cache_bytes gauge\n"
+                   "imgfs_image_cache_bytes %zu\n",
+                   cache.hits, cache.misses, cache.evictions, cache.bytes);
+
+    const int ret = text.error ? reply_error_msg(connection, text.error)
+                    : http_reply(connection, HTTP_OK, "Content-Type: " METRICS_CONTENT_TYPE HTTP_LINE_DELIM
+                                 "Cache-Control: no-store" HTTP_LINE_DELIM, text.data, text.len);
+    free(text.data);
+    return ret;
+}
+
+/**********************************************************************
+ * Paginated list, streamed with chunked transfer encoding: the IDs are
+ * copied a batch at a time under the lock and encoded outside of it.
+ ********************************************************************** */
+#define LIST_BATCH 256
+
+static int list_sink(void* arg, const char* data, size_t len)
+{
+    return http_send_chunk(*(const int*) arg, data, len);
+}
+
+static int reply_list_page(int connection, const char* headers, enum http_encoding encoding,
+                           const char* prefix, size_t offset, size_t limit)
+{
+    char ids[LIST_BATCH][MAX_IMG_ID + 1];
+    struct imgfs_list_cursor cursor = { 0, offset };
+    size_t listed = 0;
+    int done = 0;
+
+    // the JSON goes to the connection, through the compressor if one was negotiated
+    struct encoding_stream* compressor = NULL;
+    if (encoding != HTTP_ENCODING_IDENTITY) {
+        compressor = malloc(sizeof(struct encoding_stream));
+        if (compressor == NULL || encoding_stream_init(compressor, encoding, list_sink, &connection)) {
+            free(compressor);
+            return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+        }
+    }
+
+    int ret = http_reply_chunked_begin(connection, HTTP_OK, headers);
+    struct json_writer writer;
+    json_writer_init(&writer, compressor != NULL ? encoding_stream_sink : list_sink,
+                     compressor != NULL ? (void*) compressor : (void*) &connection);
+    json_write_raw(&writer, JSON_LIST_START, strlen(JSON_LIST_START));
+
+    while (ret == ERR_NONE && !done && listed < limit) {
+        size_t nb_ids = 0;
+        fs_lock();
+        ret = do_list_ids(&fs_file, prefix, &cursor, ids, MIN(LIST_BATCH, limit - listed), &nb_ids);
+        done = cursor.slot >= fs_file.header.max_files;
+        fs_unlock();
+
+        for (size_t i = 0; i < nb_ids; ++i, ++listed) {
+            json_write_raw(&writer, listed == 0 ? " " : ", ", listed == 0 ? 1 : 2);
+            json_write_string(&writer, ids[i], MAX_IMG_ID);
+        }
+    }
+
+    // look for one more ID, so that clients know whether to ask for the next page
+    size_t nb_more = 0;
+    if (ret == ERR_NONE && !done) {
+        fs_lock();
+        ret = do_list_ids(&fs_file, prefix, &cursor, ids, 1, &nb_more);
+        fs_unlock();
+    }
+
+    const char* end = nb_more > 0 ? " ], \"More\": true }" : " ], \"More\": false }";
+    json_write_raw(&writer, end, strlen(end));
+    if (ret == ERR_NONE) {
+        ret = json_writer_flush(&writer);
+    }
+    if (compressor != NULL) {
+        ret = encoding_stream_finish(compressor, ret);
+        free(compressor);
+    }
+    return ret == ERR_NONE ? http_reply_chunked_end(connection) : ret;
+}
+
+// reads a decimal query parameter: 1 if present, 0 if absent, <0 if invalid
+static int get_size_var(const struct http_query* query, const char* name, size_t* value)
+{
+    char number[24];
+    const int ret = http_query_copy(query, name, number, sizeof(number));
+    if (ret <= 0) {
+        return ret;
+    }
+    char* end = NULL;
+    errno = 0;
+    const unsigned long long parsed = strtoull(number, &end, 10);
+    if (number[0] < '0' || number[0] > '9' || *end != '\0' || errno != 0 || parsed > SIZE_MAX) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *value = (size_t) parsed;
+    return 1;
+}
+
+int handle_list_call(struct http_message* msg, const struct http_query* query, int connection)
 {
     if(msg == NULL) {
         return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
     }
 
+    // optional pagination and filtering: ?offset=<n>&limit=<n>&prefix=<id start>
+    size_t offset = 0;
+    size_t limit = SIZE_MAX;
+    char prefix[MAX_IMG_ID + 1] = "";
+    const int has_offset = get_size_var(query, "offset", &offset);
+    const int has_limit = get_size_var(query, "limit", &limit);
+    const int has_prefix = http_query_copy(query, "prefix", prefix, sizeof(prefix));
+    if (has_offset < 0 || has_limit < 0 || has_prefix < 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+    const int paginated = has_offset || has_limit || has_prefix;
+
+    // compressed variants have their own ETag; Vary tells caches the reply depends on Accept-Encoding
+    enum http_encoding encoding = http_accept_encoding(http_get_header(msg, "Accept-Encoding"));
+
+    // the whole list is rendered (and compressed) once per version, pages are streamed;
+    // the ETag names the coding actually sent, known once the list is prepared
+    char etag[LIST_ETAG_SIZE];
     char* json = NULL;
-    pthread_mutex_lock(&mut);
-    int ret = do_list(&fs_file, JSON, &json);
-    pthread_mutex_unlock(&mut);
+    size_t json_len = 0;
+    fs_lock();
+    int ret = paginated ? ERR_NONE : list_cache_prepare(&list_cache, &fs_file, &encoding);
+    list_cache_etag(&fs_file.header, encoding, etag);
+    const int not_modified = ret == ERR_NONE && http_etag_match(http_get_header(msg, "If-None-Match"), etag);
+    if (ret == ERR_NONE && !not_modified && !paginated) {
+        // a copy, so that the reply is sent without holding the lock
+        ret = list_cache_copy(&list_cache, encoding, &json, &json_len);
+    }
+    fs_unlock();
 
     if (ret) {
         return reply_error_msg(connection, ret);
@@ -152,19 +584,47 @@ int handle_list_call(struct http_message* msg, int connection)
     //                                      status                          (given as arg)
     //                                      Content-Length                  (given as arg)
     // Content-Type: application/json\r\n
+    // Content-Encoding if compressed, Vary: Accept-Encoding
+    // ETag, Cache-Control: the list may change at any time, clients have to revalidate
 
-    char* add_header = "Content-Type: application/json\r\n";
-    int i =http_reply(connection, HTTP_OK, add_header, json, strlen(json));
+    char add_header[2 * ERR_MSG_SIZE];
+    char content_encoding[64] = "";
+    if (!not_modified && encoding != HTTP_ENCODING_IDENTITY) {
+        snprintf(content_encoding, sizeof(content_encoding), "Content-Encoding: %s\r\n", content_encoding_name(encoding));
+    }
+    snprintf(add_header, sizeof(add_header), "%s%sVary: Accept-Encoding\r\nETag: %s\r\nCache-Control: " LIST_CACHE_CONTROL "\r\n",
+             not_modified ? "" : "Content-Type: application/json\r\n", content_encoding, etag);
+    if (not_modified) {
+        return http_reply_no_body(connection, HTTP_NOT_MODIFIED, add_header);
+    }
+    if (paginated) {
+        return reply_list_page(connection, add_header, encoding, prefix, offset, limit);
+    }
+    ret = http_reply(connection, HTTP_OK, add_header, json, json_len);
     free(json);
-    return i;
+    return ret;
 }
 
-int handle_read_call(struct http_message* msg, int connection)
+/**********************************************************************
+ * Reads len bytes of the imgFS file at offset (without moving its position).
+ ********************************************************************** */
+static int read_blob(int fd, char* data, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        const ssize_t n = pread(fd, data, len, (off_t) offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_IO;
+        data += n;
+        len -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+    return ERR_NONE;
+}
+
+int handle_read_call(struct http_message* msg, const struct http_query* query, int connection)
 {
-    const int RES_SIZE = 10;
-    char res[RES_SIZE];
-    memset(res, 0, sizeof(RES_SIZE));
-    int ret = http_get_var(&(msg->uri), "res", res, RES_SIZE);
+    char res[10];
+    int ret = http_query_copy(query, "res", res, sizeof(res));
     if (ret <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     }
@@ -184,41 +644,350 @@ int handle_read_call(struct http_message* msg, int connection)
         return reply_error_msg(connection, ERR_RESOLUTIONS);
     }
 
-    char img_id[MAX_IMG_ID];
-    memset(img_id, 0, MAX_IMG_ID);
-    ret = http_get_var(&(msg->uri), "img_id", img_id, MAX_IMG_ID);
+    char img_id[MAX_IMG_ID + 1];
+    ret = http_query_copy(query, "img_id", img_id, sizeof(img_id));
     if (ret <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     }
 
-    char* image_buffer = NULL;
+    // only the location is looked up under the lock: blobs are never rewritten
+    // once stored, so the content is sent straight from the imgFS file afterwards
+    int fd = -1;
+    uint64_t offset = 0;
     uint32_t image_size = 0;
-    pthread_mutex_lock(&mut);
-    ret = do_read(img_id, resolution, &image_buffer, &image_size, &fs_file);
-    pthread_mutex_unlock(&mut);
+    char etag[ETAG_SIZE];
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    size_t index = 0;
+    // whole thumbnails and small images go through the image cache
+    const int cacheable = resolution != ORIG_RES && http_get_header(msg, "Range") == NULL;
+    // HEAD: the headers only, from the metadata (no resize, no blob I/O)
+    const int head = http_match_verb(&msg->method, "HEAD");
+    const struct image_cache_entry* cached = NULL;
+    fs_lock();
+    ret = find_image(img_id, &fs_file, &index);
+    if (ret == ERR_NONE) {
+        memcpy(sha, fs_file.metadata[index].SHA, SHA256_DIGEST_LENGTH);
+        image_etag(sha, resolution, etag);
+    }
+    // a client which already has this content gets a 304, the blob is not touched (nor resized)
+    const int not_modified = ret == ERR_NONE && http_etag_match(http_get_header(msg, "If-None-Match"), etag);
+    if (ret == ERR_NONE && head) {
+        image_size = fs_file.metadata[index].size[resolution];
+    } else if (ret == ERR_NONE && !not_modified) {
+        cached = cacheable ? image_cache_get(&image_cache, sha, resolution) : NULL;
+        if (cached == NULL) {
+            ret = read_location(img_id, resolution, index, &fd, &offset, &image_size);
+        }
+    }
+    fs_unlock();
     if (ret) {
-        free(image_buffer);
         return reply_error_msg(connection, ret);
     }
 
-    char* add_header = "Content-Type: image/jpeg\r\n";
-    int i = http_reply(connection, HTTP_OK, add_header, image_buffer, image_size);
-    free(image_buffer);
-    return i;
+    char add_header[ERR_MSG_SIZE];
+    snprintf(add_header, ERR_MSG_SIZE, "Accept-Ranges: bytes\r\nETag: %s\r\nCache-Control: " READ_CACHE_CONTROL "\r\n",
+             etag);
+    if (not_modified) {
+        return http_reply_no_body(connection, HTTP_NOT_MODIFIED, add_header);
+    }
+    if (head) {
+        // the size of a variant not created yet is unknown: no Content-Length then
+        char head_header[2 * ERR_MSG_SIZE];
+        const int len = snprintf(head_header, sizeof(head_header), "Content-Type: image/jpeg\r\n%s", add_header);
+        if (image_size > 0) {
+            snprintf(head_header + len, sizeof(head_header) - (size_t) len,
+                     "Content-Length: %" PRIu32 HTTP_LINE_DELIM, image_size);
+        }
+        return http_reply_no_body(connection, HTTP_OK, head_header);
+    }
+
+    // Range: only parts of the image (resumed downloads, progressive viewers);
+    // a malformed Range header, or an If-Range for another version (or with a weak
+    // validator), is ignored and the whole image sent
+    const struct http_string* range = http_get_header(msg, "Range");
+    const struct http_string* if_range = http_get_header(msg, "If-Range");
+    if (range != NULL && (if_range == NULL || http_etag_match_strong(if_range, etag))) {
+        struct http_range ranges[MAX_RANGES];
+        const int nb_ranges = http_parse_range(range, image_size, ranges, MAX_RANGES);
+        if (nb_ranges == 0) {
+            char content_range[ERR_MSG_SIZE];
+            snprintf(content_range, ERR_MSG_SIZE, "Content-Range: bytes */%" PRIu32 HTTP_LINE_DELIM, image_size);
+            return http_reply(connection, HTTP_RANGE_NOT_SATISFIABLE, content_range, "", 0);
+        }
+        if (nb_ranges > 0) {
+            return http_reply_file_ranges(connection, add_header, "image/jpeg",
+                                          fd, offset, image_size, ranges, (size_t) nb_ranges);
+        }
+    }
+
+    char full_header[2 * ERR_MSG_SIZE];
+    snprintf(full_header, sizeof(full_header), "Content-Type: image/jpeg\r\n%s", add_header);
+    if (cached != NULL) {
+        ret = http_reply(connection, HTTP_OK, full_header, cached->data, cached->size);
+        image_cache_release(&image_cache, cached);
+        return ret;
+    }
+    // miss: the image is read once to fill the cache, then sent from memory
+    if (cacheable && image_size <= image_cache.max_entry_size) {
+        char* data = malloc(image_size);
+        if (data != NULL && read_blob(fd, data, image_size, offset) == ERR_NONE) {
+            image_cache_put(&image_cache, sha, resolution, data, image_size);
+            ret = http_reply(connection, HTTP_OK, full_header, data, image_size);
+            free(data);
+            return ret;
+        }
+        free(data);
+    }
+    return http_reply_file_range(connection, HTTP_OK, full_header, fd, offset, image_size);
 }
 
-int handle_delete_call(struct http_message* msg, int connection)
+/**********************************************************************
+ * Metadata of one image, straight from its struct img_metadata (no blob
+ * is read, no variant created; those not created yet have size 0):
+ * {"img_id":"...","is_valid":1,"SHA":"<hex>","orig_res":[w,h],
+ *  "size":{"thumb":...,"small":...,"orig":...}}
+ ********************************************************************** */
+static int handle_info_call(const struct http_query* query, int connection)
 {
-    char img_id[MAX_IMG_ID];
-    memset(img_id, 0, MAX_IMG_ID);
-    int ret = http_get_var(&(msg->uri), "img_id", img_id, MAX_IMG_ID);
+    char img_id[MAX_IMG_ID + 1];
+    int ret = http_query_copy(query, "img_id", img_id, sizeof(img_id));
     if (ret <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     }
 
-    pthread_mutex_lock(&mut);
+    struct img_metadata metadata;
+    size_t index = 0;
+    fs_lock();
+    ret = find_image(img_id, &fs_file, &index);
+    if (ret == ERR_NONE) {
+        metadata = fs_file.metadata[index];
+    }
+    fs_unlock();
+    if (ret) {
+        return reply_error_msg(connection, ret);
+    }
+
+    char sha[2 * SHA256_DIGEST_LENGTH + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        snprintf(sha + 2 * i, 3, "%02x", metadata.SHA[i]);
+    }
+    char fields[256];
+    const int fields_len = snprintf(fields, sizeof(fields),
+                                    ",\"is_valid\":%" PRIu16 ",\"SHA\":\"%s\",\"orig_res\":[%" PRIu32 ",%" PRIu32 "],"
+                                    "\"size\":{\"thumb\":%" PRIu32 ",\"small\":%" PRIu32 ",\"orig\":%" PRIu32 "}}",
+                                    metadata.is_valid, sha, metadata.orig_res[0], metadata.orig_res[1],
+                                    metadata.size[THUMB_RES], metadata.size[SMALL_RES], metadata.size[ORIG_RES]);
+
+    struct json_memory json = { NULL, 0, 0 };
+    struct json_writer writer;
+    json_writer_init(&writer, json_memory_sink, &json);
+    json_write_raw(&writer, "{\"img_id\":", 10);
+    json_write_string(&writer, metadata.img_id, MAX_IMG_ID);
+    json_write_raw(&writer, fields, (size_t) fields_len);
+    ret = json_writer_flush(&writer);
+    if (ret == ERR_NONE) {
+        // lazy resizes change the sizes: always revalidated
+        ret = http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM
+                         "Cache-Control: no-cache" HTTP_LINE_DELIM, json.data, json.len);
+    } else {
+        ret = reply_error_msg(connection, ret);
+    }
+    free(json.data);
+    return ret;
+}
+
+/**********************************************************************
+ * Batch read: the thumbnails (or small images) of a whole gallery in one
+ * reply, for GET /imgfs/batch_read?res=thumb&ids=a,b,c or a POST with the
+ * ids in its body (separated by commas or new lines).
+ * All the images are located under one lock acquisition, then streamed as
+ * multipart/mixed (one part per id, Content-ID: <id>) with chunked transfer
+ * encoding, one chunk per part: the misses are read one at a time, into
+ * one buffer. An id which cannot be read gets a text/plain part with the error.
+ ********************************************************************** */
+#define BATCH_MAX_IDS 64
+#define BATCH_PART_HEADER_SIZE (MAX_IMG_ID + ETAG_SIZE + 192)
+#define BATCH_ERROR_SIZE 96
+
+struct batch_item {
+    char img_id[MAX_IMG_ID + 1];
+    int error;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    const struct image_cache_entry* cached;
+    int fd;
+    uint64_t offset;
+    uint32_t size;
+};
+
+static int parse_batch_ids(const char* list, size_t len, struct batch_item* items, size_t* nb_items)
+{
+    *nb_items = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const size_t start = i;
+        while (i < len && list[i] != ',' && list[i] != '\n' && list[i] != '\r') {
+            ++i;
+        }
+        if (i == start) {
+            continue;
+        }
+        if (*nb_items == BATCH_MAX_IDS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        struct batch_item* item = &items[(*nb_items)++];
+        const size_t id_len = i - start < MAX_IMG_ID ? i - start : MAX_IMG_ID;
+        memcpy(item->img_id, list + start, id_len);
+        item->error = i - start > MAX_IMG_ID ? ERR_INVALID_IMGID : ERR_NONE;
+    }
+    return ERR_NONE;
+}
+
+static int handle_batch_read_call(struct http_message* msg, const struct http_query* query, int connection)
+{
+    char res[10];
+    if (http_query_copy(query, "res", res, sizeof(res)) <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+    // originals are too large to be bundled
+    const int resolution = resolution_atoi(res);
+    if (resolution != THUMB_RES && resolution != SMALL_RES) {
+        return reply_error_msg(connection, ERR_RESOLUTIONS);
+    }
+
+    const char* list = msg->body.val;
+    size_t list_len = msg->body.len;
+    if (!http_match_verb(&msg->method, "POST")) {
+        // already decoded in the query table, no copy needed
+        const struct http_string* ids = http_query_get(query, "ids");
+        if (ids == NULL || ids->len == 0) {
+            return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+        }
+        list = ids->val;
+        list_len = ids->len;
+    }
+
+    struct batch_item* items = calloc(BATCH_MAX_IDS, sizeof(struct batch_item));
+    if (items == NULL) {
+        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    }
+    size_t nb_items = 0;
+    int ret = parse_batch_ids(list, list_len, items, &nb_items);
+    if (ret == ERR_NONE && nb_items == 0) {
+        ret = ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    if (ret) {
+        free(items);
+        return reply_error_msg(connection, ret);
+    }
+
+    // one lock acquisition for the whole batch: cache lookups, else locations (resizing if needed)
+    fs_lock();
+    for (size_t i = 0; i < nb_items; ++i) {
+        struct batch_item* item = &items[i];
+        size_t index = 0;
+        if (item->error || (item->error = find_image(item->img_id, &fs_file, &index))) {
+            continue;
+        }
+        memcpy(item->sha, fs_file.metadata[index].SHA, SHA256_DIGEST_LENGTH);
+        item->cached = image_cache_get(&image_cache, item->sha, resolution);
+        if (item->cached == NULL) {
+            item->error = read_location(item->img_id, resolution, index, &item->fd, &item->offset,
+                                        &item->size);
+        }
+    }
+    fs_unlock();
+
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "imgfs-batch-%016" PRIx64, (uint64_t) (uintptr_t) items ^ (uint64_t) nb_items);
+    char headers[128];
+    snprintf(headers, sizeof(headers), "Content-Type: multipart/mixed; boundary=%s%s", boundary, HTTP_LINE_DELIM);
+    ret = http_reply_chunked_begin(connection, HTTP_OK, headers);
+
+    // the misses are read (and cached) outside of the lock, each one once the previous part is sent
+    char* data = NULL;
+    size_t data_size = 0;
+    for (size_t i = 0; i < nb_items; ++i) {
+        struct batch_item* item = &items[i];
+        if (ret == ERR_NONE && !item->error && item->cached == NULL) {
+            if (item->size > data_size) {
+                char* bigger = realloc(data, item->size);
+                if (bigger != NULL) {
+                    data = bigger;
+                    data_size = item->size;
+                }
+            }
+            if (item->size > data_size) {
+                item->error = ERR_OUT_OF_MEMORY;
+            } else if ((item->error = read_blob(item->fd, data, item->size, item->offset)) == ERR_NONE) {
+                image_cache_put(&image_cache, item->sha, resolution, data, item->size);
+            }
+        }
+
+        const char* body = item->cached != NULL ? item->cached->data : data;
+        size_t body_len = item->cached != NULL ? item->cached->size : item->size;
+        char part_header[BATCH_PART_HEADER_SIZE];
+        char error_msg[BATCH_ERROR_SIZE];
+        if (item->error) {
+            snprintf(error_msg, BATCH_ERROR_SIZE, "Error: %s\n", ERR_MSG(item->error));
+            body = error_msg;
+            body_len = strlen(error_msg);
+            snprintf(part_header, BATCH_PART_HEADER_SIZE,
+                     "%s--%s%sContent-Type: text/plain%sContent-ID: <%s>%sContent-Length: %zu%s",
+                     HTTP_LINE_DELIM, boundary, HTTP_LINE_DELIM, HTTP_LINE_DELIM, item->img_id,
+                     HTTP_LINE_DELIM, body_len, HTTP_HDR_END_DELIM);
+        } else {
+            char etag[ETAG_SIZE];
+            image_etag(item->sha, resolution, etag);
+            snprintf(part_header, BATCH_PART_HEADER_SIZE,
+                     "%s--%s%sContent-Type: image/jpeg%sContent-ID: <%s>%sETag: %s%sContent-Length: %zu%s",
+                     HTTP_LINE_DELIM, boundary, HTTP_LINE_DELIM, HTTP_LINE_DELIM, item->img_id,
+                     HTTP_LINE_DELIM, etag, HTTP_LINE_DELIM, body_len, HTTP_HDR_END_DELIM);
+        }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+        const struct iovec part[2] = {
+            { .iov_base = part_header,  .iov_len = strlen(part_header) },
+            { .iov_base = (char*) body, .iov_len = body_len }   // only read
+        };
+#pragma GCC diagnostic pop
+        if (ret == ERR_NONE) {
+            ret = http_send_chunk_iov(connection, part, 2);
+        }
+        if (item->cached != NULL) {
+            image_cache_release(&image_cache, item->cached);
+        }
+    }
+    free(data);
+    free(items);
+
+    char closing[64];
+    snprintf(closing, sizeof(closing), "%s--%s--%s", HTTP_LINE_DELIM, boundary, HTTP_LINE_DELIM);
+    if (ret == ERR_NONE) {
+        ret = http_send_chunk(connection, closing, strlen(closing));
+    }
+    return ret == ERR_NONE ? http_reply_chunked_end(connection) : ret;
+}
+
+int handle_delete_call(const struct http_query* query, int connection)
+{
+    char img_id[MAX_IMG_ID + 1];
+    int ret = http_query_copy(query, "img_id", img_id, sizeof(img_id));
+    if (ret <= 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    size_t index = 0;
+    fs_lock();
+    const int found = find_image(img_id, &fs_file, &index) == ERR_NONE;
+    if (found) {
+        memcpy(sha, fs_file.metadata[index].SHA, SHA256_DIGEST_LENGTH);
+    }
     ret = do_delete(img_id, &fs_file);
-    pthread_mutex_unlock(&mut);
+    list_cache_invalidate(&list_cache);
+    fs_unlock();
+    if (ret == ERR_NONE && found) {
+        image_cache_remove(&image_cache, sha);
+    }
     if (ret) {
         return reply_error_msg(connection, ret);
     }
@@ -226,30 +995,225 @@ int handle_delete_call(struct http_message* msg, int connection)
     return reply_302_msg(connection);   // URL is in our case always localhost? Otherwise change (custom function)
 }
 
-int handle_insert_call(struct http_message* msg, int connection)
+int handle_insert_call(struct http_message* msg, const struct http_query* query, int connection)
 {
 
     if (msg->body.val == NULL || msg->body.len <= 0) {
         return reply_error_msg(connection, ERR_INVALID_COMMAND);
     }
 
-    char name[MAX_IMGFS_NAME];
-    memset(name, 0, MAX_IMGFS_NAME);
-    int ret = http_get_var(&(msg->uri), "name", name, MAX_IMGFS_NAME);
+    char name[MAX_IMGFS_NAME + 1];
+    int ret = http_query_copy(query, "name", name, sizeof(name));
     if (ret <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
     }
 
-    char* image_buffer = calloc(1, msg->body.len);
-    memcpy(image_buffer, msg->body.val, msg->body.len);
-
-    pthread_mutex_lock(&mut);
-    ret = do_insert(image_buffer, msg->body.len, name, &fs_file);
-    pthread_mutex_unlock(&mut);
-    free(image_buffer);
+    // the body stays in the receive buffer for the whole call, no need to copy it
+    fs_lock();
+    ret = do_insert(msg->body.val, msg->body.len, name, &fs_file);
+    list_cache_invalidate(&list_cache);
+    fs_unlock();
     if (ret) {
         return reply_error_msg(connection, ret);
     }
 
     return reply_302_msg(connection);   // URL is in our case always localhost? Otherwise change (custom function)
-}
\ No newline at end of file
+}
+
+/**********************************************************************
+ * Bulk insert: many images in one body, either multipart/form-data (one
+ * part per file) or a tar archive. The images are hashed and probed in
+ * parallel before taking the lock; then their contents are appended and
+ * all their metadata written at once. Each image is named after its file.
+ ********************************************************************** */
+#define BULK_MAX_IMAGES 1024
+#define BULK_PREPARE_THREADS 8
+
+// img_id of a file: its name without the directories
+static void bulk_item_id(struct imgfs_insert_item* item, const char* path, size_t len)
+{
+    for (size_t i = len; i > 0; --i) {
+        if (path[i - 1] == '/' || path[i - 1] == '\\') {
+            path += i;
+            len -= i;
+            break;
+        }
+    }
+    if (len == 0 || len > MAX_IMG_ID) {
+        item->result = ERR_INVALID_IMGID;
+        len = len > MAX_IMG_ID ? MAX_IMG_ID : len;
+    }
+    memcpy(item->img_id, path, len);
+    item->img_id[len] = '\0';
+}
+
+// fills items from the body; returns the number of images or some error code
+static int bulk_parse_body(const struct http_message* msg, struct imgfs_insert_item* items)
+{
+    size_t nb_items = 0;
+    int ret = 0;
+    const struct http_string* content_type = http_get_header(msg, "Content-Type");
+    struct http_multipart parts;
+    if (content_type != NULL && http_multipart_init(&parts, content_type, &msg->body) == ERR_NONE) {
+        struct http_part part;
+        while ((ret = http_multipart_next(&parts, &part)) == 1) {
+            if (part.filename.len == 0) {
+                continue;   // a plain form field
+            }
+            if (nb_items == BULK_MAX_IMAGES) {
+                return ERR_MAX_FILES;
+            }
+            bulk_item_id(&items[nb_items], part.filename.val, part.filename.len);
+            items[nb_items].data = part.body.val;
+            items[nb_items++].size = part.body.len;
+        }
+    } else {
+        struct tar_reader tar;
+        struct tar_entry entry;
+        tar_reader_init(&tar, msg->body.val, msg->body.len);
+        while ((ret = tar_next(&tar, &entry)) == 1) {
+            if (nb_items == BULK_MAX_IMAGES) {
+                return ERR_MAX_FILES;
+            }
+            bulk_item_id(&items[nb_items], entry.name, strlen(entry.name));
+            items[nb_items].data = entry.data;
+            items[nb_items++].size = entry.size;
+        }
+    }
+    return ret < 0 ? ret : (int) nb_items;
+}
+
+// { "Inserted": N, "Errors": [ { "Id": "...", "Error": "..." }, ... ] }
+static int bulk_reply(int connection, const struct imgfs_insert_item* items, size_t nb_items,
+                      size_t nb_inserted)
+{
+    struct json_memory json = { NULL, 0, 0 };
+    struct json_writer writer;
+    json_writer_init(&writer, json_memory_sink, &json);
+    json_write_raw(&writer, "{\"Inserted\":", 12);
+    json_write_uint(&writer, nb_inserted);
+    json_write_raw(&writer, ",\"Errors\":[", 11);
+    int first = 1;
+    for (size_t i = 0; i < nb_items; ++i) {
+        if (items[i].result == ERR_NONE) {
+            continue;
+        }
+        json_write_raw(&writer, first ? "{\"Id\":" : ",{\"Id\":", first ? 6 : 7);
+        json_write_string(&writer, items[i].img_id, MAX_IMG_ID);
+        json_write_raw(&writer, ",\"Error\":", 9);
+        const char* error = ERR_MSG(items[i].result);
+        json_write_string(&writer, error, strlen(error));
+        json_write_raw(&writer, "}", 1);
+        first = 0;
+    }
+    json_write_raw(&writer, "]}", 2);
+    int ret = json_writer_flush(&writer);
+    if (ret == ERR_NONE) {
+        ret = http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM,
+                         json.data, json.len);
+    } else {
+        ret = reply_error_msg(connection, ret);
+    }
+    free(json.data);
+    return ret;
+}
+
+static int handle_bulk_insert_call(struct http_message* msg, int connection)
+{
+    if (msg->body.val == NULL || msg->body.len == 0) {
+        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    }
+    struct imgfs_insert_item* items = calloc(BULK_MAX_IMAGES, sizeof(struct imgfs_insert_item));
+    if (items == NULL) {
+        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    }
+
+    // the body stays in the receive buffer for the whole call: the items point into it
+    int ret = bulk_parse_body(msg, items);
+    if (ret < 0) {
+        free(items);
+        return reply_error_msg(connection, ret);
+    }
+    const size_t nb_items = (size_t) ret;
+
+    ret = do_insert_batch_prepare(items, nb_items, BULK_PREPARE_THREADS);
+    size_t nb_inserted = 0;
+    if (ret == ERR_NONE) {
+        fs_lock();
+        ret = do_insert_batch(items, nb_items, &nb_inserted, &fs_file);
+        if (nb_inserted > 0) {
+            list_cache_invalidate(&list_cache);
+        }
+        fs_unlock();
+    }
+
+    ret = ret ? reply_error_msg(connection, ret) : bulk_reply(connection, items, nb_items, nb_inserted);
+    free(items);
+    return ret;
+}
+
+/**********************************************************************
+ * Streamed insert: the image is written to the imgFS file as it is
+ * received, the lock is only taken to reserve room and to commit.
+ ********************************************************************** */
+static int stream_insert_call(const struct http_query* query, int connection, struct http_body_reader* body)
+{
+    char name[MAX_IMGFS_NAME + 1];
+    int ret = http_query_copy(query, "name", name, sizeof(name));
+    if (ret <= 0) {
+        http_body_discard(body);
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+
+    struct imgfs_insert_stream stream;
+    fs_lock();
+    ret = do_insert_stream_begin(name, http_body_length(body), &stream, &fs_file);
+    fs_unlock();
+    if (ret) {
+        http_body_discard(body);
+        return reply_error_msg(connection, ret);
+    }
+
+    const char* data = NULL;
+    ssize_t len = 0;
+    while (ret == ERR_NONE && (len = http_body_next(body, &data)) > 0) {
+        ret = do_insert_stream_write(&stream, data, (size_t) len, &fs_file);
+    }
+
+    fs_lock();
+    if (ret == ERR_NONE && len == 0) {
+        ret = do_insert_stream_commit(&stream, &fs_file);
+        list_cache_invalidate(&list_cache);
+    } else {
+        do_insert_stream_abort(&stream, &fs_file);
+    }
+    fs_unlock();
+
+    if (len < 0) {
+        return ERR_IO;  // client is gone, nobody to reply to
+    }
+    if (ret) {
+        http_body_discard(body);
+        return reply_error_msg(connection, ret);
+    }
+    return reply_302_msg(connection);
+}
+
+int handle_http_stream(struct http_message* msg, int connection, struct http_body_reader* body)
+{
+    M_REQUIRE_NON_NULL(msg);
+    if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST")) {
+        const uint64_t start = metrics_now_ns();
+        struct http_query query;
+        int ret = http_parse_query(&msg->uri, &query);
+        if (ret) {
+            http_body_discard(body);
+            ret = reply_error_msg(connection, ret);
+        } else {
+            ret = stream_insert_call(&query, connection, body);
+        }
+        metrics_observe_request(METRICS_ROUTE_INSERT, metrics_now_ns() - start);
+        return ret;
+    }
+    return HTTP_STREAM_DECLINED;
+}
@@ -8,6 +8,7 @@
 #pragma once
 
 #include "http_prot.h"
+#include "http_net.h" // struct http_body_reader
 
 #define BASE_FILE "index.html"
 #define DEFAULT_LISTENING_PORT 8000
@@ -17,3 +18,8 @@ int server_startup (int argc, char **argv);
 void server_shutdown (void);
 
 int handle_http_message(struct http_message* msg, int connection);
+
+/**
+ * @brief Handles the requests whose body is worth streaming (inserts).
+ */
+int handle_http_stream(struct http_message* msg, int connection, struct http_body_reader* body);
@@ -64,6 +64,26 @@ int do_open(const char * imgfs_filename, const char * open_mode, struct imgfs_fi
     return ERR_NONE;
 }
 
+/*******************************************************************
+ * Lookup of a valid image by its ID
+ */
+int find_image(const char* img_id, const struct imgfs_file* imgfs_file, size_t* index)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(index);
+
+    // deleted entries keep their img_id, so skip them instead of stopping at the first match
+    for (size_t i = 0; i < imgfs_file->header.max_files; i++) {
+        if (imgfs_file->metadata[i].is_valid &&
+            !strncmp(imgfs_file->metadata[i].img_id, img_id, MAX_IMG_ID)) {
+            *index = i;
+            return ERR_NONE;
+        }
+    }
+    return ERR_IMAGE_NOT_FOUND;
+}
+
 /*******************************************************************
  * Human-readable SHA
  */
@@ -0,0 +1,117 @@
+/**
+ * @file json_writer.c
+ * @brief Streaming JSON encoder.
+ */
+
+#include "json_writer.h"
+#include "error.h"
+
+#include <inttypes.h> // for PRIu64
+#include <stdio.h>    // for snprintf
+#include <stdlib.h>   // for realloc
+#include <string.h>   // for memcpy
+
+void json_writer_init(struct json_writer* writer, JsonSink sink, void* arg)
+{
+    if (writer != NULL) {
+        writer->sink = sink;
+        writer->arg = arg;
+        writer->error = ERR_NONE;
+        writer->len = 0;
+    }
+}
+
+int json_writer_flush(struct json_writer* writer)
+{
+    M_REQUIRE_NON_NULL(writer);
+
+    if (writer->error == ERR_NONE && writer->len > 0) {
+        writer->error = writer->sink(writer->arg, writer->buffer, writer->len);
+    }
+    writer->len = 0;
+    return writer->error;
+}
+
+int json_write_raw(struct json_writer* writer, const char* data, size_t len)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(data);
+
+    while (len > 0 && writer->error == ERR_NONE) {
+        if (writer->len == JSON_WRITER_BUFFER_SIZE) {
+            json_writer_flush(writer);
+            continue;
+        }
+        size_t n = JSON_WRITER_BUFFER_SIZE - writer->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(writer->buffer + writer->len, data, n);
+        writer->len += n;
+        data += n;
+        len -= n;
+    }
+    return writer->error;
+}
+
+int json_write_string(struct json_writer* writer, const char* str, size_t max_len)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(str);
+
+    json_write_raw(writer, "\"", 1);
+    size_t start = 0;   // first byte not written yet
+    size_t i = 0;
+    for (; i < max_len && str[i] != '\0'; ++i) {
+        const unsigned char c = (unsigned char) str[i];
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+        // runs of plain characters are copied at once
+        json_write_raw(writer, str + start, i - start);
+        char escaped[8];
+        switch (c) {
+        case '"':  memcpy(escaped, "\\\"", 3); break;
+        case '\\': memcpy(escaped, "\\\\", 3); break;
+        case '\n': memcpy(escaped, "\\n", 3); break;
+        case '\r': memcpy(escaped, "\\r", 3); break;
+        case '\t': memcpy(escaped, "\\t", 3); break;
+        default:   snprintf(escaped, sizeof(escaped), "\\u%04x", c); break;
+        }
+        json_write_raw(writer, escaped, strlen(escaped));
+        start = i + 1;
+    }
+    json_write_raw(writer, str + start, i - start);
+    return json_write_raw(writer, "\"", 1);
+}
+
+int json_write_uint(struct json_writer* writer, uint64_t value)
+{
+    char number[24];
+    const int len = snprintf(number, sizeof(number), "%" PRIu64, value);
+    return json_write_raw(writer, number, (size_t) len);
+}
+
+int json_memory_sink(void* arg, const char* data, size_t len)
+{
+    M_REQUIRE_NON_NULL(arg);
+    M_REQUIRE_NON_NULL(data);
+
+    struct json_memory* memory = arg;
+    if (memory->len + len + 1 > memory->size) {
+        size_t size = memory->size > 0 ? 2 * memory->size : JSON_WRITER_BUFFER_SIZE;
+        while (size < memory->len + len + 1) {
+            size *= 2;
+        }
+        char* bigger = realloc(memory->data, size);
+        if (bigger == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        memory->data = bigger;
+        memory->size = size;
+    }
+    memcpy(memory->data + memory->len, data, len);
+    memory->len += len;
+    memory->data[memory->len] = '\0';
+    return ERR_NONE;
+}
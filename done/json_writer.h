@@ -0,0 +1,71 @@
+/**
+ * @file json_writer.h
+ * @brief Streaming JSON encoder.
+ *
+ * Output goes through a small fixed buffer to a sink (a socket, a growing
+ * memory buffer...): memory use does not depend on the size of the document.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_WRITER_BUFFER_SIZE 4096
+
+/**
+ * @brief Receives the encoded output, len bytes at a time. Returns some error code, 0 if no error.
+ */
+typedef int (*JsonSink)(void* arg, const char* data, size_t len);
+
+struct json_writer {
+    JsonSink sink;
+    void* arg;
+    int error;      // first error of the sink, later writes are ignored
+    size_t len;
+    char buffer[JSON_WRITER_BUFFER_SIZE];
+};
+
+/**
+ * @brief Growing memory buffer, to be used with json_memory_sink().
+ *        data is NUL-terminated once something was written; to be freed by the caller.
+ */
+struct json_memory {
+    char* data;
+    size_t len;
+    size_t size;
+};
+
+void json_writer_init(struct json_writer* writer, JsonSink sink, void* arg);
+
+/**
+ * @brief Appends len bytes as they are (punctuation, numbers...).
+ */
+int json_write_raw(struct json_writer* writer, const char* data, size_t len);
+
+/**
+ * @brief Appends str (at most max_len bytes of it) as a quoted, escaped JSON string.
+ */
+int json_write_string(struct json_writer* writer, const char* str, size_t max_len);
+
+int json_write_uint(struct json_writer* writer, uint64_t value);
+
+/**
+ * @brief Gives the buffered output to the sink.
+ *
+ * @return The first error encountered by the writer, 0 if none.
+ */
+int json_writer_flush(struct json_writer* writer);
+
+/**
+ * @brief JsonSink appending to a struct json_memory.
+ */
+int json_memory_sink(void* arg, const char* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file list_cache.c
+ * @brief Rendered /imgfs/list body, compressed once per version.
+ */
+
+#include "list_cache.h"
+#include "content_encoding.h"
+#include "error.h"
+
+#include <inttypes.h> // for PRIu32
+#include <stdio.h>    // for snprintf
+#include <stdlib.h>   // for malloc, free
+#include <string.h>   // for memcpy, strlen
+
+void list_cache_invalidate(struct list_cache* cache)
+{
+    if (cache == NULL) return;
+
+    for (int i = 0; i < NB_HTTP_ENCODINGS; ++i) {
+        free(cache->body[i]);
+        cache->body[i] = NULL;
+        cache->len[i] = 0;
+    }
+}
+
+int list_cache_prepare(struct list_cache* cache, const struct imgfs_file* imgfs_file,
+                       enum http_encoding* encoding)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(encoding);
+
+    if (cache->body[HTTP_ENCODING_IDENTITY] == NULL || cache->version != imgfs_file->header.version) {
+        list_cache_invalidate(cache);
+        char* fresh = NULL;
+        const int ret = do_list(imgfs_file, JSON, &fresh);
+        if (ret) {
+            return ret;
+        }
+        cache->body[HTTP_ENCODING_IDENTITY] = fresh;
+        cache->len[HTTP_ENCODING_IDENTITY] = strlen(fresh);
+        cache->version = imgfs_file->header.version;
+    }
+
+    if (cache->len[HTTP_ENCODING_IDENTITY] < MIN_COMPRESS_SIZE) {
+        *encoding = HTTP_ENCODING_IDENTITY;
+    }
+    if (cache->body[*encoding] == NULL) {
+        return content_encode(*encoding, cache->body[HTTP_ENCODING_IDENTITY],
+                              cache->len[HTTP_ENCODING_IDENTITY],
+                              &cache->body[*encoding], &cache->len[*encoding]);
+    }
+    return ERR_NONE;
+}
+
+int list_cache_copy(const struct list_cache* cache, enum http_encoding encoding,
+                    char** body, size_t* len)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(body);
+    M_REQUIRE_NON_NULL(len);
+    if (cache->body[encoding] == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    *body = malloc(cache->len[encoding]);
+    if (*body == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(*body, cache->body[encoding], cache->len[encoding]);
+    *len = cache->len[encoding];
+    return ERR_NONE;
+}
+
+void list_cache_etag(const struct imgfs_header* header, enum http_encoding encoding, char* etag)
+{
+    if (header == NULL || etag == NULL) return;
+
+    const char* name = content_encoding_name(encoding);
+    snprintf(etag, LIST_ETAG_SIZE, "\"list-%" PRIu32 "-%" PRIu32 "%s%s\"", header->version, header->nb_files,
+             name != NULL ? "-" : "", name != NULL ? name : "");
+}
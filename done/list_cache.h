@@ -0,0 +1,62 @@
+/**
+ * @file list_cache.h
+ * @brief Rendered /imgfs/list body and its compressed variants.
+ *
+ * Every change of the list (insert, delete) changes header.version, so a
+ * cached body is valid as long as the version is the same. Not thread-safe:
+ * the caller serializes the calls, as it does for the imgFS itself.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#include "imgfs.h"
+#include "http_prot.h" // for enum http_encoding
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// "list-<version>-<nb_files>[-<encoding>]", quotes included
+#define LIST_ETAG_SIZE 48
+
+struct list_cache {
+    char* body[NB_HTTP_ENCODINGS];
+    size_t len[NB_HTTP_ENCODINGS];
+    uint32_t version;
+};
+
+/**
+ * @brief Frees the bodies; the next list_cache_prepare() renders the list again.
+ */
+void list_cache_invalidate(struct list_cache* cache);
+
+/**
+ * @brief Renders the list of imgfs_file if its version changed, and compresses
+ *        it with *encoding once per version. *encoding is set to identity if
+ *        the list is too small to be worth compressing: it is then the coding
+ *        of the body actually sent, the one its ETag has to name.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int list_cache_prepare(struct list_cache* cache, const struct imgfs_file* imgfs_file,
+                       enum http_encoding* encoding);
+
+/**
+ * @brief Copies the prepared body in encoding into *body (to be freed).
+ *
+ * @return Some error code. 0 if no error.
+ */
+int list_cache_copy(const struct list_cache* cache, enum http_encoding encoding,
+                    char** body, size_t* len);
+
+/**
+ * @brief Writes the ETag of the list of header in encoding to etag (LIST_ETAG_SIZE bytes).
+ */
+void list_cache_etag(const struct imgfs_header* header, enum http_encoding encoding, char* etag);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,275 @@
+/**
+ * @file metrics.c
+ * @brief Server metrics: per-thread counters, added up on scrape.
+ */
+
+#include "metrics.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// bucket i counts durations up to 2^(i + FIRST_BUCKET_LOG2) us, the last one all the others
+#define FIRST_BUCKET_LOG2 4
+#define NB_BUCKETS 22
+
+enum histogram_index {
+    HISTOGRAM_LOCK_WAIT = NB_METRICS_ROUTES,
+    HISTOGRAM_LOCK_HOLD,
+    HISTOGRAM_RESIZE,
+    NB_HISTOGRAMS
+};
+
+struct histogram {
+    uint64_t buckets[NB_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+// the counters of one thread: written by it only, read by scrapes
+struct metrics_shard {
+    struct histogram histograms[NB_HISTOGRAMS];
+    uint64_t bytes_sent;
+    struct metrics_shard* prev;
+    struct metrics_shard* next;
+};
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard* live_shards;
+static struct metrics_shard retired;    // sum of the threads gone
+
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static const char* const route_labels[NB_METRICS_ROUTES] = {
+    "route=\"list\"",
+    "route=\"read\",res=\"thumb\"",
+    "route=\"read\",res=\"small\"",
+    "route=\"read\",res=\"orig\"",
+    "route=\"batch_read\"",
+    "route=\"insert\"",
+    "route=\"bulk_insert\"",
+    "route=\"delete\"",
+    "route=\"info\"",
+    "route=\"other\""
+};
+
+/********************************************************************
+ * Per-thread shards
+ */
+static void shard_add(struct metrics_shard* to, const struct metrics_shard* from)
+{
+    for (size_t h = 0; h < NB_HISTOGRAMS; ++h) {
+        for (size_t b = 0; b < NB_BUCKETS; ++b) {
+            to->histograms[h].buckets[b] += __atomic_load_n(&from->histograms[h].buckets[b], __ATOMIC_RELAXED);
+        }
+        to->histograms[h].count += __atomic_load_n(&from->histograms[h].count, __ATOMIC_RELAXED);
+        to->histograms[h].sum_ns += __atomic_load_n(&from->histograms[h].sum_ns, __ATOMIC_RELAXED);
+    }
+    to->bytes_sent += __atomic_load_n(&from->bytes_sent, __ATOMIC_RELAXED);
+}
+
+// when a thread exits, its counts are kept in retired
+static void shard_retire(void* arg)
+{
+    struct metrics_shard* shard = arg;
+    pthread_mutex_lock(&registry_lock);
+    shard_add(&retired, shard);
+    if (shard->prev != NULL) {
+        shard->prev->next = shard->next;
+    } else {
+        live_shards = shard->next;
+    }
+    if (shard->next != NULL) {
+        shard->next->prev = shard->prev;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    free(shard);
+}
+
+static void make_shard_key(void)
+{
+    pthread_key_create(&shard_key, shard_retire);
+}
+
+// the shard of the calling thread, created on first use; NULL if out of memory
+static struct metrics_shard* thread_shard(void)
+{
+    pthread_once(&shard_key_once, make_shard_key);
+    struct metrics_shard* shard = pthread_getspecific(shard_key);
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(struct metrics_shard));
+        if (shard == NULL) {
+            return NULL;
+        }
+        if (pthread_setspecific(shard_key, shard)) {
+            free(shard);
+            return NULL;
+        }
+        pthread_mutex_lock(&registry_lock);
+        shard->next = live_shards;
+        if (live_shards != NULL) {
+            live_shards->prev = shard;
+        }
+        live_shards = shard;
+        pthread_mutex_unlock(&registry_lock);
+    }
+    return shard;
+}
+
+// only the owning thread writes: no read-modify-write instruction needed
+static void counter_add(uint64_t* counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+static size_t bucket_of(uint64_t duration_ns)
+{
+    const uint64_t us = duration_ns / 1000;
+    if (us <= (1u << FIRST_BUCKET_LOG2)) {
+        return 0;
+    }
+    // smallest power of 2 not below us
+    const size_t log2 = (size_t) (64 - __builtin_clzll(us - 1));
+    const size_t bucket = log2 - FIRST_BUCKET_LOG2;
+    return bucket < NB_BUCKETS ? bucket : NB_BUCKETS - 1;
+}
+
+static void observe(size_t histogram, uint64_t duration_ns)
+{
+    struct metrics_shard* shard = thread_shard();
+    if (shard == NULL) return;
+    struct histogram* h = &shard->histograms[histogram];
+    counter_add(&h->buckets[bucket_of(duration_ns)], 1);
+    counter_add(&h->count, 1);
+    counter_add(&h->sum_ns, duration_ns);
+}
+
+/********************************************************************
+ * Updates
+ */
+uint64_t metrics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+void metrics_observe_request(enum metrics_route route, uint64_t duration_ns)
+{
+    if (route < NB_METRICS_ROUTES) {
+        observe(route, duration_ns);
+    }
+}
+
+void metrics_observe_lock_wait(uint64_t duration_ns)
+{
+    observe(HISTOGRAM_LOCK_WAIT, duration_ns);
+}
+
+void metrics_observe_lock_hold(uint64_t duration_ns)
+{
+    observe(HISTOGRAM_LOCK_HOLD, duration_ns);
+}
+
+void metrics_observe_resize(uint64_t duration_ns)
+{
+    observe(HISTOGRAM_RESIZE, duration_ns);
+}
+
+void metrics_add_bytes_sent(uint64_t bytes)
+{
+    struct metrics_shard* shard = thread_shard();
+    if (shard != NULL) {
+        counter_add(&shard->bytes_sent, bytes);
+    }
+}
+
+/********************************************************************
+ * Scrape
+ */
+void metrics_printf(struct metrics_text* text, const char* format, ...)
+{
+    if (text == NULL || text->error) return;
+
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        const size_t room = text->size - text->len;
+        const int n = vsnprintf(text->data != NULL ? text->data + text->len : NULL, room, format, args);
+        va_end(args);
+        if (n < 0) {
+            text->error = ERR_RUNTIME;
+            return;
+        }
+        if ((size_t) n < room) {
+            text->len += (size_t) n;
+            return;
+        }
+        const size_t size = 2 * text->size + (size_t) n + 1;
+        char* data = realloc(text->data, size);
+        if (data == NULL) {
+            text->error = ERR_OUT_OF_MEMORY;
+            return;
+        }
+        text->data = data;
+        text->size = size;
+    }
+}
+
+static void render_histogram(struct metrics_text* text, const char* name, const char* labels,
+                             const struct histogram* h)
+{
+    const char* sep = labels[0] != '\0' ? "," : "";
+    uint64_t cumulative = 0;
+    for (size_t b = 0; b + 1 < NB_BUCKETS; ++b) {
+        cumulative += h->buckets[b];
+        const double le = (double) (1u << (b + FIRST_BUCKET_LOG2)) * 1e-6;
+        metrics_printf(text, "%s_bucket{%s%sle=\"%.6f\"} %llu\n", name, labels, sep, le,
+                       (unsigned long long) cumulative);
+    }
+    metrics_printf(text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+                   (unsigned long long) h->count);
+    const char* open = labels[0] != '\0' ? "{" : "";
+    const char* close = labels[0] != '\0' ? "}" : "";
+    metrics_printf(text, "%s_sum%s%s%s %.9f\n", name, open, labels, close, (double) h->sum_ns * 1e-9);
+    metrics_printf(text, "%s_count%s%s%s %llu\n", name, open, labels, close, (unsigned long long) h->count);
+}
+
+int metrics_render(struct metrics_text* text)
+{
+    M_REQUIRE_NON_NULL(text);
+
+    // a snapshot: counters keep moving while it is taken, each one is exact
+    struct metrics_shard total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&registry_lock);
+    shard_add(&total, &retired);
+    for (const struct metrics_shard* shard = live_shards; shard != NULL; shard = shard->next) {
+        shard_add(&total, shard);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    metrics_printf(text, "# HELP imgfs_request_duration_seconds Time to handle a request, reply included.\n"
+                   "# TYPE imgfs_request_duration_seconds histogram\n");
+    for (size_t r = 0; r < NB_METRICS_ROUTES; ++r) {
+        render_histogram(text, "imgfs_request_duration_seconds", route_labels[r], &total.histograms[r]);
+    }
+    metrics_printf(text, "# HELP imgfs_lock_wait_seconds Time waiting for the imgFS lock.\n"
+                   "# TYPE imgfs_lock_wait_seconds histogram\n");
+    render_histogram(text, "imgfs_lock_wait_seconds", "", &total.histograms[HISTOGRAM_LOCK_WAIT]);
+    metrics_printf(text, "# HELP imgfs_lock_hold_seconds Time holding the imgFS lock.\n"
+                   "# TYPE imgfs_lock_hold_seconds histogram\n");
+    render_histogram(text, "imgfs_lock_hold_seconds", "", &total.histograms[HISTOGRAM_LOCK_HOLD]);
+    metrics_printf(text, "# HELP imgfs_resize_seconds Time creating a missing variant on first read.\n"
+                   "# TYPE imgfs_resize_seconds histogram\n");
+    render_histogram(text, "imgfs_resize_seconds", "", &total.histograms[HISTOGRAM_RESIZE]);
+    metrics_printf(text, "# HELP imgfs_http_sent_bytes_total Bytes sent to clients.\n"
+                   "# TYPE imgfs_http_sent_bytes_total counter\n"
+                   "imgfs_http_sent_bytes_total %llu\n", (unsigned long long) total.bytes_sent);
+    return text->error;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file metrics.h
+ * @brief Server metrics (counters and latency histograms), in the Prometheus text format.
+ *
+ * Every thread updates counters of its own, without locks nor shared cache
+ * lines; a scrape adds up those of all the threads (and of the threads gone).
+ * Histograms have log-scaled buckets, from 16 us to about 16 s.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METRICS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/**
+ * @brief What a request is timed as.
+ */
+enum metrics_route {
+    METRICS_ROUTE_LIST,
+    METRICS_ROUTE_READ_THUMB,
+    METRICS_ROUTE_READ_SMALL,
+    METRICS_ROUTE_READ_ORIG,
+    METRICS_ROUTE_BATCH_READ,
+    METRICS_ROUTE_INSERT,
+    METRICS_ROUTE_BULK_INSERT,
+    METRICS_ROUTE_DELETE,
+    METRICS_ROUTE_INFO,
+    METRICS_ROUTE_OTHER,
+    NB_METRICS_ROUTES
+};
+
+/**
+ * @brief Monotonic clock, in nanoseconds.
+ */
+uint64_t metrics_now_ns(void);
+
+void metrics_observe_request(enum metrics_route route, uint64_t duration_ns);
+
+/**
+ * @brief Time spent waiting for the imgFS lock, then holding it.
+ */
+void metrics_observe_lock_wait(uint64_t duration_ns);
+void metrics_observe_lock_hold(uint64_t duration_ns);
+
+/**
+ * @brief Time spent creating a missing variant (thumbnail, small) on first read.
+ */
+void metrics_observe_resize(uint64_t duration_ns);
+
+void metrics_add_bytes_sent(uint64_t bytes);
+
+/**
+ * @brief Growing text buffer for a scrape; data is to be freed by the caller.
+ */
+struct metrics_text {
+    char* data;
+    size_t len;
+    size_t size;
+    int error;      // first error, later appends are ignored
+};
+
+/**
+ * @brief Appends formatted text (e.g. gauges known by the caller) to text.
+ */
+void metrics_printf(struct metrics_text* text, const char* format, ...)
+__attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Appends all the counters and histograms to text.
+ *
+ * @return The first error encountered on text, 0 if none.
+ */
+int metrics_render(struct metrics_text* text);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,11 +2,15 @@
 #include <stdint.h> // uint16_t
 #include <sys/types.h> // ssize_t
 #include "imgfs.h"
+#include "socket_layer.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 #include <fcntl.h>
@@ -18,6 +22,11 @@
 // creates socket with "sock_id" and binds it with "port" and "INADDR_ANY"
 // returns sock_id
 int tcp_server_init(uint16_t port)
+{
+    return tcp_server_listen(port, BACK_LOG, 0);
+}
+
+int tcp_server_listen(uint16_t port, int backlog, int reuseport)
 {
     int sock_id = socket(AF_INET, SOCK_STREAM, 0);
     if (sock_id == -1) {
@@ -28,6 +37,13 @@ int tcp_server_init(uint16_t port)
     int opt = 1;
     if (setsockopt(sock_id, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         perror("Error setting socket options");
+        close(sock_id);
+        return ERR_IO;
+    }
+    // several sockets bound to the same port: the kernel spreads the connections among them
+    if (reuseport && setsockopt(sock_id, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("Error setting SO_REUSEPORT");
+        close(sock_id);
         return ERR_IO;
     }
     int flags = fcntl(sock_id, F_GETFL, 0);
@@ -52,9 +68,43 @@ int tcp_server_init(uint16_t port)
         return ERR_IO;
     }
 
-    if(listen(sock_id, BACK_LOG) < 0) {
+    if(listen(sock_id, backlog) < 0) {
+        perror("listen failed");
+        close(sock_id);
+        return ERR_IO;
+    }
+    return sock_id;
+}
+
+int unix_server_listen(const char* path, int backlog)
+{
+    struct sockaddr_un sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    if (path == NULL || path[0] == '\0' || strlen(path) >= sizeof(sockaddr.sun_path)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    strcpy(sockaddr.sun_path, path);
+
+    int sock_id = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_id == -1) {
+        perror("Error creating socket");
+        return ERR_IO;
+    }
+    // a stale socket of a previous run would make bind() fail; anything else at path is kept
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(sock_id, (struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
+        perror("bind failed");
+        close(sock_id);
+        return ERR_IO;
+    }
+    if (listen(sock_id, backlog) < 0) {
         perror("listen failed");
         close(sock_id);
+        unlink(path);
         return ERR_IO;
     }
     return sock_id;
@@ -79,4 +129,28 @@ ssize_t tcp_send(int active_socket, const char* response, size_t response_len)
         return ERR_INVALID_ARGUMENT;
     }
     return send(active_socket, response, response_len, 0);
-}
\ No newline at end of file
+}
+
+ssize_t tcp_sendv(int active_socket, const struct iovec* iov, size_t iovcnt, int more)
+{
+    if(active_socket == -1 || iov == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    msg.msg_iov = (struct iovec*) iov; // sendmsg() does not modify it
+#pragma GCC diagnostic pop
+    msg.msg_iovlen = iovcnt;
+    // a peer that went away must give EPIPE, not kill the server with SIGPIPE
+    return sendmsg(active_socket, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+}
+
+ssize_t tcp_sendfile(int active_socket, int file_fd, off_t* offset, size_t count)
+{
+    if(active_socket == -1 || file_fd == -1 || offset == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    return sendfile(active_socket, file_fd, offset, count);
+}
@@ -10,9 +10,24 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uint16_t
 #include <sys/types.h> // ssize_t
+#include <sys/uio.h> // struct iovec
 
 int tcp_server_init(uint16_t port);
 
+/**
+ * @brief Like tcp_server_init(), with backlog pending connections at most.
+ *        If reuseport is set, other sockets may listen on the same port
+ *        (SO_REUSEPORT) and the kernel balances the connections among them.
+ */
+int tcp_server_listen(uint16_t port, int backlog, int reuseport);
+
+/**
+ * @brief Listening socket on the Unix domain socket path (e.g. for a reverse
+ *        proxy on the same host), with backlog pending connections at most.
+ *        A socket file left at path by a previous run is replaced.
+ */
+int unix_server_listen(const char* path, int backlog);
+
 /**
  * @brief Blocking call that accepts a new TCP connection
  */
@@ -24,3 +39,16 @@ int tcp_accept(int passive_socket);
 ssize_t tcp_read(int active_socket, char* buf, size_t buflen);
 
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len);
+
+/**
+ * @brief Sends the iovcnt buffers of iov in one call (gather write), without any copy.
+ *        If more is set, tells the kernel that more data follows (MSG_MORE).
+ *        Like send(), it may send less than the total length.
+ */
+ssize_t tcp_sendv(int active_socket, const struct iovec* iov, size_t iovcnt, int more);
+
+/**
+ * @brief Sends up to count bytes of file_fd, starting at *offset, without copying
+ *        them to user space. *offset is advanced by the number of bytes sent.
+ */
+ssize_t tcp_sendfile(int active_socket, int file_fd, off_t* offset, size_t count);
@@ -0,0 +1,125 @@
+/**
+ * @file tar.c
+ * @brief Reader of tar archives held in memory.
+ */
+
+#include "tar.h"
+#include "error.h"
+
+#include <string.h> // for memcpy, memchr
+
+// fields of a header block
+#define TAR_NAME_OFF     0
+#define TAR_NAME_LEN     100
+#define TAR_SIZE_OFF     124
+#define TAR_SIZE_LEN     12
+#define TAR_CHKSUM_OFF   148
+#define TAR_CHKSUM_LEN   8
+#define TAR_TYPE_OFF     156
+#define TAR_MAGIC_OFF    257
+#define TAR_PREFIX_OFF   345
+#define TAR_PREFIX_LEN   155
+
+void tar_reader_init(struct tar_reader* reader, const char* data, size_t len)
+{
+    if (reader == NULL) return;
+    reader->pos = data;
+    reader->end = data != NULL ? data + len : NULL;
+}
+
+// octal number, space or NUL terminated; returns 0 if invalid
+static int parse_octal(const char* field, size_t len, size_t* out)
+{
+    size_t i = 0;
+    while (i < len && field[i] == ' ') ++i;
+    size_t value = 0;
+    const size_t start = i;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+        if (value > (((size_t) -1) >> 3)) {
+            return 0;
+        }
+        value = (value << 3) | (size_t) (field[i] - '0');
+    }
+    if (i == start || (i < len && field[i] != ' ' && field[i] != '\0')) {
+        return 0;
+    }
+    *out = value;
+    return 1;
+}
+
+static int is_zero_block(const char* block)
+{
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; ++i) {
+        if (block[i] != '\0') return 0;
+    }
+    return 1;
+}
+
+// the checksum is computed with its own field taken as spaces
+static int checksum_ok(const char* block)
+{
+    size_t expected = 0;
+    if (!parse_octal(block + TAR_CHKSUM_OFF, TAR_CHKSUM_LEN, &expected)) {
+        return 0;
+    }
+    size_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; ++i) {
+        const int in_field = i >= TAR_CHKSUM_OFF && i < TAR_CHKSUM_OFF + TAR_CHKSUM_LEN;
+        sum += in_field ? (size_t) ' ' : (size_t) (unsigned char) block[i];
+    }
+    return sum == expected;
+}
+
+// copies a field that is NUL terminated only when shorter than len
+static size_t copy_field(char* out, const char* field, size_t len)
+{
+    const char* nul = memchr(field, '\0', len);
+    const size_t n = nul != NULL ? (size_t) (nul - field) : len;
+    memcpy(out, field, n);
+    return n;
+}
+
+int tar_next(struct tar_reader* reader, struct tar_entry* entry)
+{
+    M_REQUIRE_NON_NULL(reader);
+    M_REQUIRE_NON_NULL(entry);
+    M_REQUIRE_NON_NULL(reader->pos);
+
+    for (;;) {
+        if (reader->end - reader->pos < TAR_BLOCK_SIZE) {
+            // archives end with zero blocks, but some writers leave them out
+            return reader->pos == reader->end ? 0 : ERR_INVALID_ARGUMENT;
+        }
+        const char* header = reader->pos;
+        if (is_zero_block(header)) {
+            reader->pos = reader->end;
+            return 0;
+        }
+
+        size_t size = 0;
+        if (!checksum_ok(header) || !parse_octal(header + TAR_SIZE_OFF, TAR_SIZE_LEN, &size)) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        const size_t padded = (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+        if (padded < size || (size_t) (reader->end - header) - TAR_BLOCK_SIZE < padded) {
+            return ERR_INVALID_ARGUMENT;
+        }
+        reader->pos = header + TAR_BLOCK_SIZE + padded;
+
+        const char type = header[TAR_TYPE_OFF];
+        if (type != '0' && type != '\0') {
+            continue;   // directory, link, extended header...
+        }
+
+        size_t len = 0;
+        if (!memcmp(header + TAR_MAGIC_OFF, "ustar", 5) && header[TAR_PREFIX_OFF] != '\0') {
+            len = copy_field(entry->name, header + TAR_PREFIX_OFF, TAR_PREFIX_LEN);
+            entry->name[len++] = '/';
+        }
+        len += copy_field(entry->name + len, header + TAR_NAME_OFF, TAR_NAME_LEN);
+        entry->name[len] = '\0';
+        entry->data = header + TAR_BLOCK_SIZE;
+        entry->size = size;
+        return 1;
+    }
+}
@@ -0,0 +1,46 @@
+/**
+ * @file tar.h
+ * @brief Reader of tar archives held in memory (ustar, as written by tar and Python's tarfile).
+ *
+ * Only regular files are returned; directories, links and extended headers
+ * are skipped. Nothing is copied: file contents point into the archive.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_MAX_NAME   (155 + 1 + 100)  // prefix "/" name
+
+struct tar_reader {
+    const char* pos;
+    const char* end;
+};
+
+struct tar_entry {
+    char name[TAR_MAX_NAME + 1];
+    const char* data;
+    size_t size;
+};
+
+/**
+ * @brief Prepares reader to go through the archive of len bytes at data.
+ */
+void tar_reader_init(struct tar_reader* reader, const char* data, size_t len);
+
+/**
+ * @brief Moves to the next regular file of the archive.
+ *
+ * @return 1 if entry was filled, 0 at the end of the archive,
+ *         some (negative) error code if the archive is malformed.
+ */
+int tar_next(struct tar_reader* reader, struct tar_entry* entry);
+
+#ifdef __cplusplus
+}
+#endif
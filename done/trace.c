@@ -0,0 +1,168 @@
+/**
+ * @file trace.c
+ * @brief Span tracing of requests, in the Chrome trace-event format.
+ */
+
+#include "trace.h"
+#include "error.h"
+#include "json_writer.h"
+
+#include <inttypes.h> // for PRIu64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct trace_event {
+    const char* name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t request;
+    unsigned thread;
+};
+
+static struct trace_event* ring;    // NULL before trace_open()
+static int recording;
+static uint64_t nb_events;          // recorded so far, the latest TRACE_RING_SIZE are kept
+static uint64_t nb_requests;
+static unsigned sample;
+static unsigned nb_threads;
+static uint64_t origin_ns;
+static char* trace_path;
+
+// the request being handled by this thread, if traced
+static _Thread_local int traced;
+static _Thread_local uint64_t request_id;
+static _Thread_local unsigned thread_id;   // 0 until the first span
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/********************************************************************
+ * Recording
+ */
+void trace_request_begin(void)
+{
+    if (!__atomic_load_n(&recording, __ATOMIC_ACQUIRE)) {
+        traced = 0;
+        return;
+    }
+    const uint64_t n = __atomic_fetch_add(&nb_requests, 1, __ATOMIC_RELAXED);
+    traced = n % sample == 0;
+    request_id = n;
+}
+
+void trace_request_end(void)
+{
+    traced = 0;
+}
+
+void trace_span_begin(struct trace_span* span, const char* name)
+{
+    span->name = name;
+    span->start_ns = traced ? now_ns() : 0;
+}
+
+void trace_span_end(struct trace_span* span)
+{
+    if (span->start_ns == 0 || !__atomic_load_n(&recording, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    if (thread_id == 0) {
+        thread_id = __atomic_add_fetch(&nb_threads, 1, __ATOMIC_RELAXED);
+    }
+    const uint64_t n = __atomic_fetch_add(&nb_events, 1, __ATOMIC_RELAXED);
+    struct trace_event* event = &ring[n % TRACE_RING_SIZE];
+    event->name = span->name;
+    event->start_ns = span->start_ns;
+    event->duration_ns = now_ns() - span->start_ns;
+    event->request = request_id;
+    event->thread = thread_id;
+}
+
+/********************************************************************
+ * Start and end
+ */
+int trace_open(const char* path, unsigned sample_every)
+{
+    M_REQUIRE_NON_NULL(path);
+#ifndef WITH_TRACE
+    (void) sample_every;
+    fprintf(stderr, "Tracing is not compiled in (make TRACE=1)\n");
+    return ERR_INVALID_COMMAND;
+#else
+    if (ring != NULL) {
+        return ERR_INVALID_COMMAND;
+    }
+    trace_path = malloc(strlen(path) + 1);
+    ring = calloc(TRACE_RING_SIZE, sizeof(struct trace_event));
+    if (trace_path == NULL || ring == NULL) {
+        free(trace_path);
+        trace_path = NULL;
+        free(ring);
+        ring = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+    strcpy(trace_path, path);
+    sample = sample_every > 0 ? sample_every : 1;
+    origin_ns = now_ns();
+    __atomic_store_n(&recording, 1, __ATOMIC_RELEASE);
+    return ERR_NONE;
+#endif
+}
+
+static int file_sink(void* arg, const char* data, size_t len)
+{
+    return fwrite(data, 1, len, arg) == len ? ERR_NONE : ERR_IO;
+}
+
+// timestamps in microseconds from the start of the trace
+static void write_event(struct json_writer* writer, const struct trace_event* event, int first)
+{
+    char numbers[128];
+    json_write_raw(writer, first ? "\n{\"name\":" : ",\n{\"name\":", first ? 9 : 10);
+    json_write_string(writer, event->name, strlen(event->name));
+    const int len = snprintf(numbers, sizeof(numbers),
+                             ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                             "\"args\":{\"request\":%" PRIu64 "}}",
+                             event->thread, (double) (event->start_ns - origin_ns) / 1e3,
+                             (double) event->duration_ns / 1e3, event->request);
+    json_write_raw(writer, numbers, (size_t) len);
+}
+
+void trace_close(void)
+{
+    if (!__atomic_exchange_n(&recording, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    // the ring is not freed: a thread may still be ending a span
+    const uint64_t end = __atomic_load_n(&nb_events, __ATOMIC_ACQUIRE);
+
+    FILE* file = fopen(trace_path, "w");
+    if (file == NULL) {
+        perror(trace_path);
+    } else {
+        struct json_writer writer;
+        json_writer_init(&writer, file_sink, file);
+        json_write_raw(&writer, "{\"traceEvents\":[", 16);
+        // oldest first
+        const uint64_t first = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+        for (uint64_t n = first; n < end; ++n) {
+            write_event(&writer, &ring[n % TRACE_RING_SIZE], n == first);
+        }
+        json_write_raw(&writer, "\n],\"displayTimeUnit\":\"ms\"}\n", 27);
+        const int ret = json_writer_flush(&writer);
+        if (fclose(file) || ret) {
+            fprintf(stderr, "Cannot write the trace to %s\n", trace_path);
+        } else {
+            fprintf(stderr, "Trace: %" PRIu64 " span(s) written to %s\n",
+                    end - first, trace_path);
+        }
+    }
+    free(trace_path);
+    trace_path = NULL;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file trace.h
+ * @brief Optional span tracing of requests, written as a Chrome trace-event file
+ *        (to be opened in chrome://tracing or https://ui.perfetto.dev).
+ *
+ * Spans are compiled in only with WITH_TRACE (make TRACE=1), otherwise the
+ * macros below expand to nothing. Only one request in sample_every is traced;
+ * the spans of a traced request are recorded by the thread handling it, in a
+ * ring buffer keeping the latest ones, and written out by trace_close().
+ */
+
+#pragma once
+
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_RING_SIZE  (1 << 16)  // spans kept
+#define TRACE_DEFAULT_SAMPLE 10     // one request in 10
+
+struct trace_span {
+    const char* name;   // a string literal
+    uint64_t start_ns;  // 0 if not traced
+};
+
+/**
+ * @brief Starts tracing; does nothing (but complain) without WITH_TRACE.
+ *
+ * @param path The trace file, written by trace_close()
+ * @param sample_every One request in sample_every is traced (at least 1)
+ * @return Some error code. 0 if no error.
+ */
+int trace_open(const char* path, unsigned sample_every);
+
+/**
+ * @brief Stops tracing and writes the spans recorded to the trace file.
+ *        Spans still being ended by other threads may be missing.
+ */
+void trace_close(void);
+
+/**
+ * @brief Marks the start and the end of a request handled by the calling
+ *        thread; whether its spans are recorded is decided at the start.
+ */
+void trace_request_begin(void);
+void trace_request_end(void);
+
+void trace_span_begin(struct trace_span* span, const char* name);
+void trace_span_end(struct trace_span* span);
+
+#ifdef WITH_TRACE
+#define TRACE_REQUEST_BEGIN()         trace_request_begin()
+#define TRACE_REQUEST_END()           trace_request_end()
+#define TRACE_SPAN_BEGIN(span, name)  trace_span_begin(span, name)
+#define TRACE_SPAN_END(span)          trace_span_end(span)
+#else
+#define TRACE_REQUEST_BEGIN()         do { } while (0)
+#define TRACE_REQUEST_END()           do { } while (0)
+#define TRACE_SPAN_BEGIN(span, name)  ((void) (span), (void) (name))
+#define TRACE_SPAN_END(span)          ((void) (span))
+#endif
+
+#ifdef __cplusplus
+}
+#endif
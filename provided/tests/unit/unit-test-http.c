@@ -158,6 +158,26 @@ START_TEST(http_get_var_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_get_var_decoded)
+{
+    start_test_print;
+
+    char buf[10];
+
+    const char *str = "/imgfs/read?res=thumb&xres=orig&img_id=a%20b%2Bc+d";
+    struct http_string http_str = {.val = str, .len = strlen(str)};
+
+    // whole names only, not suffixes of other ones
+    ck_assert_int_eq(http_get_var(&http_str, "res", buf, 10), 5);
+    ck_assert_mem_eq(buf, "thumb", 5);
+    ck_assert_int_eq(http_get_var(&http_str, "img_id", buf, 10), 7);
+    ck_assert_mem_eq(buf, "a b+c+d", 7);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(http_parse_message_null_params)
 {
@@ -279,6 +299,560 @@ START_TEST(http_parse_message_full_headers_full_content)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parse_message_case_insensitive_content_length)
+{
+    start_test_print;
+
+    const char *str = "POST /imgfs/insert?name=pic HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+                      "content-length: 5" HTTP_HDR_END_DELIM "Hello";
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 5);
+    ck_assert_http_str_eq(msg.body, "Hello");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_message_binary_body)
+{
+    start_test_print;
+
+    const char str[] = "POST /imgfs/insert?name=pic HTTP/1.1" HTTP_LINE_DELIM
+                       "Content-Length: 8" HTTP_HDR_END_DELIM "\xff\xd8\0\0\r\n\r\n";
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, sizeof(str) - 1, &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 8);
+    ck_assert_int_eq(msg.body.len, 8);
+    ck_assert_mem_eq(msg.body.val, "\xff\xd8\0\0\r\n\r\n", 8);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_execute_null_params)
+{
+    start_test_print;
+
+    const char *str = "";
+    struct http_parser parser;
+    struct http_message msg;
+    http_parser_init(&parser);
+
+    ck_assert_invalid_arg(http_parser_execute(NULL, str, 0, &msg));
+    ck_assert_invalid_arg(http_parser_execute(&parser, NULL, 0, &msg));
+    ck_assert_invalid_arg(http_parser_execute(&parser, str, 0, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_execute_resumes)
+{
+    start_test_print;
+
+    const char *str = "POST /imgfs/insert?name=pic HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+                      "Content-Length: 12" HTTP_HDR_END_DELIM "Hello world!";
+    const size_t len = strlen(str);
+    struct http_parser parser;
+    struct http_message msg;
+    http_parser_init(&parser);
+
+    // byte by byte, as from many small reads
+    for (size_t i = 1; i < len; ++i) {
+        ck_assert_int_eq(http_parser_execute(&parser, str, i, &msg), 0);
+    }
+    ck_assert_int_eq(http_parser_execute(&parser, str, len, &msg), 1);
+
+    ck_assert_int_eq(parser.content_length, 12);
+    ck_assert_int_eq(parser.header_len + parser.content_length, len);
+    ck_assert_http_str_eq(msg.method, "POST");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/insert?name=pic");
+    ck_assert_int_eq(msg.num_headers, 2);
+    ck_assert_has_header(&msg, "Host", "localhost:8000");
+    ck_assert_http_str_eq(msg.body, "Hello world!");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_execute_moved_stream)
+{
+    start_test_print;
+
+    const char *str = "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM "Accept: */*" HTTP_HDR_END_DELIM;
+    const size_t len = strlen(str);
+    char first[64], second[64];
+    struct http_parser parser;
+    struct http_message msg;
+    http_parser_init(&parser);
+
+    // the stream is copied elsewhere between two calls, like after a realloc()
+    memcpy(first, str, 20);
+    ck_assert_int_eq(http_parser_execute(&parser, first, 20, &msg), 0);
+    memset(first, 0, sizeof(first));
+    memcpy(second, str, len);
+    ck_assert_int_eq(http_parser_execute(&parser, second, len, &msg), 1);
+
+    ck_assert_ptr_eq(msg.method.val, second);
+    ck_assert_http_str_eq(msg.uri, "/imgfs/list");
+    ck_assert_has_header(&msg, "Accept", "*/*");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_execute_chunked)
+{
+    start_test_print;
+
+    const char *str = "POST /imgfs/insert?name=pic HTTP/1.1" HTTP_LINE_DELIM "Transfer-Encoding: chunked" HTTP_HDR_END_DELIM
+                      "5;ext=1" HTTP_LINE_DELIM "Hello" HTTP_LINE_DELIM "7" HTTP_LINE_DELIM " world!" HTTP_LINE_DELIM
+                      "0" HTTP_LINE_DELIM "Trailer: x" HTTP_HDR_END_DELIM "GET /next HTTP/1.1";
+    const size_t len = strlen(str);
+    const size_t message_len = len - strlen("GET /next HTTP/1.1");
+    char buffer[256];
+    memcpy(buffer, str, len);
+    struct http_parser parser;
+    struct http_message msg;
+    http_parser_init(&parser);
+
+    // byte by byte, as from many small reads; the body is only there once decoded
+    for (size_t i = 1; i < message_len; ++i) {
+        ck_assert_int_eq(http_parser_execute(&parser, buffer, i, &msg), 0);
+        if (parser.state == HTTP_STATE_BODY) {
+            ck_assert_int_eq(msg.body.len, 0);
+        }
+    }
+    ck_assert_int_eq(http_parser_execute(&parser, buffer, len, &msg), 1);
+    ck_assert_int_eq(parser.chunked, 1);
+    ck_assert_int_eq(parser.content_length, 12);
+    ck_assert_int_eq(parser.message_len, message_len);
+
+    http_decode_chunked_body(&parser, buffer, &msg);
+    ck_assert_http_str_eq(msg.body, "Hello world!");
+    // the next request is left as is
+    ck_assert_int_eq(memcmp(buffer + message_len, "GET /next", 9), 0);
+
+    // the length of a request with Content-Length is known as well
+    const char *plain = "POST / HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 2" HTTP_HDR_END_DELIM "ok";
+    http_parser_init(&parser);
+    ck_assert_int_eq(http_parser_execute(&parser, plain, strlen(plain), &msg), 1);
+    ck_assert_int_eq(parser.message_len, strlen(plain));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_execute_chunked_invalid)
+{
+    start_test_print;
+
+    const char *requests[] = {
+        // smuggling: both lengths
+        "POST / HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 3" HTTP_LINE_DELIM
+        "Transfer-Encoding: chunked" HTTP_HDR_END_DELIM "0" HTTP_HDR_END_DELIM,
+        // not a size
+        "POST / HTTP/1.1" HTTP_LINE_DELIM "Transfer-Encoding: chunked" HTTP_HDR_END_DELIM "x1" HTTP_LINE_DELIM,
+        // data longer than announced
+        "POST / HTTP/1.1" HTTP_LINE_DELIM "Transfer-Encoding: chunked" HTTP_HDR_END_DELIM
+        "2" HTTP_LINE_DELIM "abc" HTTP_LINE_DELIM,
+        // size overflow
+        "POST / HTTP/1.1" HTTP_LINE_DELIM "Transfer-Encoding: chunked" HTTP_HDR_END_DELIM
+        "fffffffffffffffff" HTTP_LINE_DELIM
+    };
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+        struct http_parser parser;
+        struct http_message msg;
+        http_parser_init(&parser);
+        ck_assert_fails(http_parser_execute(&parser, requests[i], strlen(requests[i]), &msg));
+    }
+
+    // unsupported coding: told apart, for a 501
+    const char *codings[] = {
+        "POST / HTTP/1.1" HTTP_LINE_DELIM "Transfer-Encoding: gzip, chunked" HTTP_HDR_END_DELIM,
+        "POST / HTTP/1.1" HTTP_LINE_DELIM "Transfer-Encoding: gzip" HTTP_HDR_END_DELIM
+    };
+    for (size_t i = 0; i < sizeof(codings) / sizeof(codings[0]); ++i) {
+        struct http_parser parser;
+        struct http_message msg;
+        http_parser_init(&parser);
+        ck_assert_err(http_parser_execute(&parser, codings[i], strlen(codings[i]), &msg), NOT_IMPLEMENTED);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_message_invalid)
+{
+    start_test_print;
+
+    struct http_message msg;
+    int content_len;
+
+    const char *no_version = "GET /imgfs/list" HTTP_HDR_END_DELIM;
+    ck_assert_fails(http_parse_message(no_version, strlen(no_version), &msg, &content_len));
+
+    const char *bad_length = "POST /imgfs/insert HTTP/1.1" HTTP_LINE_DELIM "Content-Length: -3" HTTP_HDR_END_DELIM;
+    ck_assert_fails(http_parse_message(bad_length, strlen(bad_length), &msg, &content_len));
+
+    const char *no_colon = "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM "Accept */*" HTTP_HDR_END_DELIM;
+    ck_assert_fails(http_parse_message(no_colon, strlen(no_colon), &msg, &content_len));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_message_duplicate_content_length)
+{
+    start_test_print;
+
+    struct http_message msg;
+    int content_len;
+
+    // two lengths: where the request ends is ambiguous (request smuggling)
+    const char *different = "POST /imgfs/insert HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 3" HTTP_LINE_DELIM
+                            "content-length: 13" HTTP_HDR_END_DELIM "abcdefghijklm";
+    ck_assert_invalid_arg(http_parse_message(different, strlen(different), &msg, &content_len));
+    const char *zero_first = "POST /imgfs/insert HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 0" HTTP_LINE_DELIM
+                             "Content-Length: 3" HTTP_HDR_END_DELIM "abc";
+    ck_assert_invalid_arg(http_parse_message(zero_first, strlen(zero_first), &msg, &content_len));
+
+    // the same one repeated is harmless
+    const char *same = "POST /imgfs/insert HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 3" HTTP_LINE_DELIM
+                       "Content-Length: 3" HTTP_HDR_END_DELIM "abc";
+    ck_assert_int_eq(http_parse_message(same, strlen(same), &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 3);
+    ck_assert_http_str_eq(msg.body, "abc");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_get_header_case_insensitive)
+{
+    start_test_print;
+
+    const char *str = "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+                      "accept-encoding: gzip" HTTP_HDR_END_DELIM;
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+    ck_assert_ptr_nonnull(http_get_header(&msg, "Accept-Encoding"));
+    ck_assert_http_str_eq((*http_get_header(&msg, "Accept-Encoding")), "gzip");
+    ck_assert_http_str_eq((*http_get_header(&msg, "HOST")), "localhost:8000");
+    ck_assert_ptr_null(http_get_header(&msg, "Content-Length"));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+#define RANGE(str) ((struct http_string) { .val = str, .len = strlen(str) })
+
+START_TEST(http_parse_range_valid)
+{
+    start_test_print;
+
+    struct http_range ranges[MAX_RANGES];
+    struct http_string value = RANGE("bytes=0-99");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 1);
+    ck_assert_uint_eq(ranges[0].start, 0);
+    ck_assert_uint_eq(ranges[0].len, 100);
+
+    // open-ended, suffix, clipped to the size, unsatisfiable one dropped
+    value = RANGE("bytes=900-, -10,990-2000 , 5000-6000");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 3);
+    ck_assert_uint_eq(ranges[0].start, 900);
+    ck_assert_uint_eq(ranges[0].len, 100);
+    ck_assert_uint_eq(ranges[1].start, 990);
+    ck_assert_uint_eq(ranges[1].len, 10);
+    ck_assert_uint_eq(ranges[2].start, 990);
+    ck_assert_uint_eq(ranges[2].len, 10);
+
+    value = RANGE("bytes=-5000");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, MAX_RANGES), 1);
+    ck_assert_uint_eq(ranges[0].start, 0);
+    ck_assert_uint_eq(ranges[0].len, 1000);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_range_invalid)
+{
+    start_test_print;
+
+    struct http_range ranges[2];
+    struct http_string value = RANGE("bytes=1000-");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, 2), 0);
+    value = RANGE("bytes=-0");
+    ck_assert_int_eq(http_parse_range(&value, 1000, ranges, 2), 0);
+
+    const char *invalid[] = { "chars=0-1", "bytes=", "bytes=5", "bytes=-", "bytes=9-3",
+                              "bytes=a-b", "bytes=0-1;2-3", "bytes=0-1,2-3,4-5"
+                            };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        value = RANGE(invalid[i]);
+        ck_assert_msg(http_parse_range(&value, 1000, ranges, 2) < 0, "\"%s\" should be rejected", invalid[i]);
+    }
+    ck_assert_invalid_arg(http_parse_range(NULL, 1000, ranges, 2));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_etag_match_valid)
+{
+    start_test_print;
+
+    struct http_string value = RANGE("\"abc-thumb\"");
+    ck_assert_int_eq(http_etag_match(&value, "\"abc-thumb\""), 1);
+    ck_assert_int_eq(http_etag_match(&value, "\"abc-orig\""), 0);
+    ck_assert_int_eq(http_etag_match(&value, "\"abc\""), 0);
+
+    value = RANGE("\"x\" , W/\"abc-orig\",\"y\"");
+    ck_assert_int_eq(http_etag_match(&value, "\"abc-orig\""), 1);
+    ck_assert_int_eq(http_etag_match(&value, "\"y\""), 1);
+    ck_assert_int_eq(http_etag_match(&value, "\"z\""), 0);
+
+    value = RANGE("*");
+    ck_assert_int_eq(http_etag_match(&value, "\"anything\""), 1);
+
+    ck_assert_int_eq(http_etag_match(NULL, "\"abc\""), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_etag_match_strong_valid)
+{
+    start_test_print;
+
+    struct http_string value = RANGE(" \"abc-thumb\" ");
+    ck_assert_int_eq(http_etag_match_strong(&value, "\"abc-thumb\""), 1);
+    ck_assert_int_eq(http_etag_match_strong(&value, "\"abc\""), 0);
+
+    // If-Range: a weak validator never allows a partial reply
+    value = RANGE("W/\"abc-thumb\"");
+    ck_assert_int_eq(http_etag_match(&value, "\"abc-thumb\""), 1);
+    ck_assert_int_eq(http_etag_match_strong(&value, "\"abc-thumb\""), 0);
+
+    // a single entity tag, not a list nor "*" (nor a date)
+    value = RANGE("\"x\", \"abc-thumb\"");
+    ck_assert_int_eq(http_etag_match_strong(&value, "\"abc-thumb\""), 0);
+    value = RANGE("*");
+    ck_assert_int_eq(http_etag_match_strong(&value, "\"abc-thumb\""), 0);
+    value = RANGE("Wed, 21 Oct 2015 07:28:00 GMT");
+    ck_assert_int_eq(http_etag_match_strong(&value, "\"abc-thumb\""), 0);
+
+    ck_assert_int_eq(http_etag_match_strong(NULL, "\"abc\""), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_accept_encoding_valid)
+{
+    start_test_print;
+
+    struct http_string value = RANGE("gzip, deflate, br");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_GZIP);
+    value = RANGE("deflate");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_DEFLATE);
+    value = RANGE("gzip;q=0.5, deflate;q=0.8");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_DEFLATE);
+    value = RANGE("GZIP ; q=1.000");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_GZIP);
+    value = RANGE("*");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_GZIP);
+    value = RANGE("*;q=0.5, gzip;q=0");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_DEFLATE);
+
+    // nothing acceptable
+    value = RANGE("br, identity");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_IDENTITY);
+    value = RANGE("gzip;q=0, deflate;q=0");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_IDENTITY);
+    value = RANGE("gzip;q=2");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_IDENTITY);
+    value = RANGE("");
+    ck_assert_int_eq(http_accept_encoding(&value), HTTP_ENCODING_IDENTITY);
+    ck_assert_int_eq(http_accept_encoding(NULL), HTTP_ENCODING_IDENTITY);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_multipart_valid)
+{
+    start_test_print;
+
+    struct http_string type = RANGE("multipart/form-data; boundary=\"XyZ\"");
+    struct http_string body = RANGE("preamble\r\n--XyZ\r\n"
+                                    "Content-Disposition: form-data; name=\"a\"\r\n\r\n"
+                                    "field\r\n--XyZ  \r\n"
+                                    "Content-Disposition: form-data; name=\"f\"; filename=\"dir/p.jpg\"\r\n"
+                                    "Content-Type: image/jpeg\r\n\r\n"
+                                    "\r\n--Xy\r\n--XyZ--\r\n");
+    struct http_multipart it;
+    struct http_part part;
+
+    ck_assert_err_none(http_multipart_init(&it, &type, &body));
+    ck_assert_int_eq(http_multipart_next(&it, &part), 1);
+    ck_assert_int_eq(part.name.len, 1);
+    ck_assert_int_eq(part.filename.len, 0);
+    ck_assert_int_eq(part.body.len, 5);
+    ck_assert_mem_eq(part.body.val, "field", 5);
+
+    ck_assert_int_eq(http_multipart_next(&it, &part), 1);
+    ck_assert_int_eq(part.filename.len, 9);
+    ck_assert_mem_eq(part.filename.val, "dir/p.jpg", 9);
+    ck_assert_int_eq(part.content_type.len, 10);
+    ck_assert_int_eq(part.body.len, 6);
+    ck_assert_mem_eq(part.body.val, "\r\n--Xy", 6);
+
+    ck_assert_int_eq(http_multipart_next(&it, &part), 0);
+
+    // the first delimiter may start the body
+    type = RANGE("multipart/mixed;boundary=b");
+    body = RANGE("--b\r\n\r\nx\r\n--b--");
+    ck_assert_err_none(http_multipart_init(&it, &type, &body));
+    ck_assert_int_eq(http_multipart_next(&it, &part), 1);
+    ck_assert_int_eq(part.body.len, 1);
+    ck_assert_int_eq(http_multipart_next(&it, &part), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_multipart_invalid)
+{
+    start_test_print;
+
+    struct http_string type = RANGE("application/x-tar");
+    struct http_string body = RANGE("--b\r\n\r\nx\r\n--b--");
+    struct http_multipart it;
+    struct http_part part;
+
+    ck_assert_invalid_arg(http_multipart_init(&it, &type, &body));
+    type = RANGE("multipart/form-data");
+    ck_assert_invalid_arg(http_multipart_init(&it, &type, &body));
+    type = RANGE("multipart/form-data; boundary=c");
+    ck_assert_invalid_arg(http_multipart_init(&it, &type, &body));
+
+    // truncated: no closing delimiter
+    type = RANGE("multipart/form-data; boundary=b");
+    body = RANGE("--b\r\n\r\nx");
+    ck_assert_err_none(http_multipart_init(&it, &type, &body));
+    ck_assert_int_lt(http_multipart_next(&it, &part), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_query_valid)
+{
+    start_test_print;
+
+    struct http_query query;
+    char buf[8];
+
+    struct http_string uri = RANGE("/imgfs/batch_read?&res=small&ids=p1%2Cp%C3%A9&&flag&res=orig");
+    ck_assert_err_none(http_parse_query(&uri, &query));
+    ck_assert_int_eq(query.nb_params, 4);
+
+    // the first occurrence wins
+    const struct http_string *value = http_query_get(&query, "res");
+    ck_assert_ptr_nonnull(value);
+    ck_assert_int_eq(value->len, 5);
+    ck_assert_mem_eq(value->val, "small", 5);
+    value = http_query_get(&query, "ids");
+    ck_assert_ptr_nonnull(value);
+    ck_assert_int_eq(value->len, 6);
+    ck_assert_mem_eq(value->val, "p1,p\xc3\xa9", 6);
+    value = http_query_get(&query, "flag");
+    ck_assert_ptr_nonnull(value);
+    ck_assert_int_eq(value->len, 0);
+    ck_assert_ptr_null(http_query_get(&query, "img_id"));
+
+    ck_assert_int_eq(http_query_copy(&query, "res", buf, sizeof(buf)), 5);
+    ck_assert_str_eq(buf, "small");
+    ck_assert_int_eq(http_query_copy(&query, "flag", buf, sizeof(buf)), 0);
+    ck_assert_int_eq(http_query_copy(&query, "img_id", buf, sizeof(buf)), 0);
+    // room is left for the NUL byte
+    ck_assert_err(http_query_copy(&query, "ids", buf, 6), ERR_RUNTIME);
+
+    // no escape: no copy, the value is that of the URI
+    ck_assert_ptr_eq(http_query_get(&query, "res")->val, uri.val + 23);
+
+    uri = RANGE("/imgfs/list");
+    ck_assert_err_none(http_parse_query(&uri, &query));
+    ck_assert_int_eq(query.nb_params, 0);
+
+    // only escaped keys and values take room in the table
+    char long_uri[3 * MAX_QUERY_DECODED + 16] = "/?ids=";
+    memset(long_uri + 6, 'a', 2 * MAX_QUERY_DECODED);
+    uri.val = long_uri;
+    uri.len = 6 + 2 * MAX_QUERY_DECODED;
+    ck_assert_err_none(http_parse_query(&uri, &query));
+    ck_assert_int_eq(http_query_get(&query, "ids")->len, 2 * MAX_QUERY_DECODED);
+    for (size_t i = 0; i < MAX_QUERY_DECODED + 1; ++i) {
+        memcpy(long_uri + 6 + 3 * i, "%41", 3);
+    }
+    uri.len = 6 + 3 * (MAX_QUERY_DECODED + 1);
+    ck_assert_err(http_parse_query(&uri, &query), ERR_RUNTIME);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parse_query_invalid)
+{
+    start_test_print;
+
+    struct http_query query;
+
+    struct http_string uri = RANGE("/imgfs/read?img_id=a%2");
+    ck_assert_invalid_arg(http_parse_query(&uri, &query));
+    uri = RANGE("/imgfs/read?img_id=a%zzb");
+    ck_assert_invalid_arg(http_parse_query(&uri, &query));
+    uri = RANGE("/imgfs/read?img_id=a%00b");
+    ck_assert_invalid_arg(http_parse_query(&uri, &query));
+    uri = RANGE("/?a&b&c&d&e&f&g&h&i&j&k&l&m&n&o&p&q");
+    ck_assert_invalid_arg(http_parse_query(&uri, &query));
+
+    ck_assert_invalid_arg(http_parse_query(NULL, &query));
+    ck_assert_invalid_arg(http_parse_query(&uri, NULL));
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -294,12 +868,39 @@ Suite *http_test_suite()
     Add_Test(s, http_get_var_not_found);
     Add_Test(s, http_get_var_too_big);
     Add_Test(s, http_get_var_valid);
+    Add_Test(s, http_get_var_decoded);
 
     Add_Test(s, http_parse_message_null_params);
     Add_Test(s, http_parse_message_partial_headers);
     Add_Test(s, http_parse_message_full_headers_no_content);
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
+    Add_Test(s, http_parse_message_case_insensitive_content_length);
+    Add_Test(s, http_parse_message_binary_body);
+    Add_Test(s, http_parse_message_invalid);
+    Add_Test(s, http_parse_message_duplicate_content_length);
+
+    Add_Test(s, http_parser_execute_null_params);
+    Add_Test(s, http_parser_execute_resumes);
+    Add_Test(s, http_parser_execute_moved_stream);
+    Add_Test(s, http_parser_execute_chunked);
+    Add_Test(s, http_parser_execute_chunked_invalid);
+
+    Add_Test(s, http_get_header_case_insensitive);
+
+    Add_Test(s, http_parse_range_valid);
+    Add_Test(s, http_parse_range_invalid);
+
+    Add_Test(s, http_etag_match_valid);
+    Add_Test(s, http_etag_match_strong_valid);
+
+    Add_Test(s, http_accept_encoding_valid);
+
+    Add_Test(s, http_multipart_valid);
+    Add_Test(s, http_multipart_invalid);
+
+    Add_Test(s, http_parse_query_valid);
+    Add_Test(s, http_parse_query_invalid);
 
     return s;
 }
@@ -0,0 +1,267 @@
+#include "image_cache.h"
+#include "error.h"
+#include "test.h"
+#include <check.h>
+
+// 400 bytes per shard, at most 100 per image
+#define SHARD_BUDGET 400
+#define ENTRY_SIZE   100
+
+// all the keys made by key() but those with another first byte are in the same shard
+static const unsigned char* key(unsigned char shard, unsigned char n)
+{
+    static unsigned char sha[SHA256_DIGEST_LENGTH];
+    memset(sha, 0, sizeof(sha));
+    sha[0] = shard;
+    sha[1] = n;
+    sha[SHA256_DIGEST_LENGTH - 1] = n;
+    return sha;
+}
+
+static void init_cache(struct image_cache *cache)
+{
+    ck_assert_err_none(image_cache_init(cache, IMAGE_CACHE_SHARDS * SHARD_BUDGET));
+    ck_assert_uint_eq(cache->max_entry_size, ENTRY_SIZE);
+}
+
+static int is_cached(struct image_cache *cache, unsigned char n, int resolution)
+{
+    const struct image_cache_entry *entry = image_cache_get(cache, key(0, n), resolution);
+    image_cache_release(cache, entry);
+    return entry != NULL;
+}
+
+// ======================================================================
+START_TEST(image_cache_null_params)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    const char data[] = "data";
+
+    ck_assert_invalid_arg(image_cache_init(NULL, SHARD_BUDGET));
+    init_cache(&cache);
+    ck_assert_invalid_arg(image_cache_put(NULL, key(0, 1), 0, data, sizeof(data)));
+    ck_assert_invalid_arg(image_cache_put(&cache, NULL, 0, data, sizeof(data)));
+    ck_assert_invalid_arg(image_cache_put(&cache, key(0, 1), 0, NULL, sizeof(data)));
+    ck_assert_ptr_null(image_cache_get(NULL, key(0, 1), 0));
+    ck_assert_ptr_null(image_cache_get(&cache, NULL, 0));
+    image_cache_release(&cache, NULL);
+    image_cache_remove(&cache, NULL);
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_put_get)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    const char data[] = "some image";
+    init_cache(&cache);
+
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 2, data, sizeof(data)));
+    const struct image_cache_entry *entry = image_cache_get(&cache, key(0, 1), 2);
+    ck_assert_ptr_nonnull(entry);
+    ck_assert_uint_eq(entry->size, sizeof(data));
+    ck_assert_mem_eq(entry->data, data, sizeof(data));
+    image_cache_release(&cache, entry);
+
+    // another resolution or content of the same bucket is another key
+    ck_assert_ptr_null(image_cache_get(&cache, key(0, 1), 1));
+    ck_assert_ptr_null(image_cache_get(&cache, key(0, 2), 2));
+
+    // a second put of the same key keeps the first copy
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 2, "other", 5));
+    entry = image_cache_get(&cache, key(0, 1), 2);
+    ck_assert_ptr_nonnull(entry);
+    ck_assert_mem_eq(entry->data, data, sizeof(data));
+    image_cache_release(&cache, entry);
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_evicts_least_recently_used)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    char data[ENTRY_SIZE];
+    memset(data, 'x', sizeof(data));
+    init_cache(&cache);
+
+    // the shard is full with 1 to 4
+    for (unsigned char n = 1; n <= SHARD_BUDGET / ENTRY_SIZE; ++n) {
+        ck_assert_err_none(image_cache_put(&cache, key(0, n), 0, data, sizeof(data)));
+    }
+    // 1 becomes the most recently used: 2 is the next to go
+    ck_assert(is_cached(&cache, 1, 0));
+    ck_assert_err_none(image_cache_put(&cache, key(0, 5), 0, data, sizeof(data)));
+    ck_assert(!is_cached(&cache, 2, 0));
+    ck_assert(is_cached(&cache, 1, 0));
+    ck_assert(is_cached(&cache, 3, 0));
+
+    // then 4 (3 was just read), whatever the size of the new image, then 5
+    ck_assert_err_none(image_cache_put(&cache, key(0, 6), 0, data, sizeof(data) / 2));
+    ck_assert(!is_cached(&cache, 4, 0));
+    ck_assert_err_none(image_cache_put(&cache, key(0, 7), 0, data, sizeof(data)));
+    ck_assert(!is_cached(&cache, 5, 0));
+    ck_assert(is_cached(&cache, 1, 0));
+    ck_assert(is_cached(&cache, 3, 0));
+    ck_assert(is_cached(&cache, 6, 0));
+    ck_assert(is_cached(&cache, 7, 0));
+
+    // other shards have their own budget
+    ck_assert_err_none(image_cache_put(&cache, key(1, 1), 0, data, sizeof(data)));
+    ck_assert(is_cached(&cache, 3, 0));
+
+    struct image_cache_stats stats;
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.evictions, 3);
+    ck_assert_uint_eq(stats.entries, 5);
+    ck_assert_uint_eq(stats.bytes, 4 * ENTRY_SIZE + ENTRY_SIZE / 2);
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_rejects_large_entries)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    char data[ENTRY_SIZE + 1];
+    memset(data, 'x', sizeof(data));
+    init_cache(&cache);
+
+    // ignored, not an error: the image is just served without the cache
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 0, data, ENTRY_SIZE + 1));
+    ck_assert(!is_cached(&cache, 1, 0));
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 0, data, 0));
+    ck_assert(!is_cached(&cache, 1, 0));
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 0, data, ENTRY_SIZE));
+    ck_assert(is_cached(&cache, 1, 0));
+
+    struct image_cache_stats stats;
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.entries, 1);
+    ck_assert_uint_eq(stats.bytes, ENTRY_SIZE);
+    ck_assert_uint_eq(stats.evictions, 0);
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_remove_while_held)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    const char data[] = "held image";
+    init_cache(&cache);
+
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 0, data, sizeof(data)));
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 1, data, sizeof(data)));
+    ck_assert_err_none(image_cache_put(&cache, key(0, 2), 0, data, sizeof(data)));
+    const struct image_cache_entry *held = image_cache_get(&cache, key(0, 1), 0);
+    ck_assert_ptr_nonnull(held);
+
+    // all the variants of the content go, the held one stays readable
+    image_cache_remove(&cache, key(0, 1));
+    ck_assert(!is_cached(&cache, 1, 0));
+    ck_assert(!is_cached(&cache, 1, 1));
+    ck_assert(is_cached(&cache, 2, 0));
+    ck_assert_mem_eq(held->data, data, sizeof(data));
+
+    struct image_cache_stats stats;
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.entries, 1);
+    ck_assert_uint_eq(stats.bytes, sizeof(data));
+
+    // freed by its last holder; the key may be cached again
+    image_cache_release(&cache, held);
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 0, "new", 3));
+    held = image_cache_get(&cache, key(0, 1), 0);
+    ck_assert_ptr_nonnull(held);
+    ck_assert_mem_eq(held->data, "new", 3);
+    image_cache_release(&cache, held);
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_stats_counters)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    const char data[] = "image";
+    init_cache(&cache);
+
+    struct image_cache_stats stats;
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.hits + stats.misses + stats.evictions + stats.bytes + stats.entries, 0);
+
+    // summed over the shards
+    ck_assert(!is_cached(&cache, 1, 0));
+    ck_assert_err_none(image_cache_put(&cache, key(0, 1), 0, data, sizeof(data)));
+    ck_assert_err_none(image_cache_put(&cache, key(3, 1), 0, data, sizeof(data)));
+    ck_assert(is_cached(&cache, 1, 0));
+    ck_assert(is_cached(&cache, 1, 0));
+    const struct image_cache_entry *entry = image_cache_get(&cache, key(3, 1), 0);
+    ck_assert_ptr_nonnull(entry);
+    image_cache_release(&cache, entry);
+    ck_assert_ptr_null(image_cache_get(&cache, key(3, 1), 1));
+
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.hits, 3);
+    ck_assert_uint_eq(stats.misses, 2);
+    ck_assert_uint_eq(stats.evictions, 0);
+    ck_assert_uint_eq(stats.entries, 2);
+    ck_assert_uint_eq(stats.bytes, 2 * sizeof(data));
+
+    // a removal is not an eviction
+    image_cache_remove(&cache, key(3, 1));
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.evictions, 0);
+    ck_assert_uint_eq(stats.entries, 1);
+    ck_assert_uint_eq(stats.bytes, sizeof(data));
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *image_cache_test_suite()
+{
+    Suite *s = suite_create("Tests for the image cache");
+
+    Add_Test(s, image_cache_null_params);
+    Add_Test(s, image_cache_put_get);
+    Add_Test(s, image_cache_evicts_least_recently_used);
+    Add_Test(s, image_cache_rejects_large_entries);
+    Add_Test(s, image_cache_remove_while_held);
+    Add_Test(s, image_cache_stats_counters);
+
+    return s;
+}
+
+TEST_SUITE(image_cache_test_suite)
@@ -3,6 +3,7 @@
 #include <check.h>
 #include <string.h>
 #include <vips/vips.h>
+#include <sys/stat.h>
 
 // ======================================================================
 START_TEST(do_insert_null_params)
@@ -338,6 +339,170 @@ START_TEST(do_insert_write_initializes_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_stream_valid)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    struct imgfs_file file;
+    struct imgfs_insert_stream stream;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_err_none(do_insert_stream_begin("pic3", 82234, &stream, &file));
+    for (size_t done = 0; done < 82234; done += 1000) {
+        const size_t len = 82234 - done < 1000 ? 82234 - done : 1000;
+        ck_assert_err_none(do_insert_stream_write(&stream, image + done, len, &file));
+    }
+    ck_assert_err_none(do_insert_stream_commit(&stream, &file));
+    do_close(&file);
+
+    // same result as do_insert()
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const struct img_metadata *md = NULL;
+    for (uint32_t i = 0; i < file.header.max_files; ++i) {
+        if (file.metadata[i].is_valid && strcmp(file.metadata[i].img_id, "pic3") == 0) {
+            md = &file.metadata[i];
+            break;
+        }
+    }
+    ck_assert_msg(md != NULL, "the inserted metadata could not be found by image id");
+
+    unsigned char pic_sha[SHA256_DIGEST_LENGTH] = {0xf8, 0x88, 0xf0, 0xdd, 0xd4, 0xf8, 0x24, 0x75, 0x99, 0xf6, 0xde,
+                                                   0x79, 0x7e, 0x0a, 0x6f, 0x55, 0x76, 0xd3, 0xd1, 0xe7, 0x41, 0x97,
+                                                   0xd3, 0x3d, 0xac, 0x09, 0x08, 0x94, 0xdb, 0x07, 0xbf, 0x1e
+                                                  };
+    ck_assert_mem_eq(md->SHA, pic_sha, SHA256_DIGEST_LENGTH);
+    ck_assert_int_eq(md->orig_res[0], 600);
+    ck_assert_int_eq(md->orig_res[1], 400);
+    ck_assert_int_eq(md->size[ORIG_RES], 82234);
+    ck_assert_int_eq(md->offset[ORIG_RES], 192659);
+    ck_assert_int_eq(file.header.version, 3);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    char read_back[82234];
+    ck_assert_int_eq(fseek(file.file, 192659, SEEK_SET), 0);
+    ck_assert_int_eq(fread(read_back, 82234, 1, file.file), 1);
+    ck_assert_mem_eq(read_back, image, 82234);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_stream_errors)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876] = {0};
+    struct imgfs_file file;
+    struct imgfs_insert_stream stream;
+    struct stat st;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_invalid_arg(do_insert_stream_begin("pic3", 0, &stream, &file));
+    ck_assert_err(do_insert_stream_begin("pic1", 72876, &stream, &file), ERR_DUPLICATE_ID);
+    // oversized: refused before any room is reserved (the size is checked at the end)
+    ck_assert_invalid_arg(do_insert_stream_begin("pic3", MAX_STREAM_IMAGE_SIZE + 1, &stream, &file));
+    ck_assert_invalid_arg(do_insert_stream_begin("pic3", UINT32_MAX, &stream, &file));
+
+    // not an image: nothing committed, reserved room given back
+    ck_assert_err_none(do_insert_stream_begin("pic3", 72876, &stream, &file));
+    ck_assert_invalid_arg(do_insert_stream_write(&stream, image, 72877, &file));
+    ck_assert_err(do_insert_stream_write(&stream, image, 72876, &file), ERR_IMGLIB);
+    do_insert_stream_abort(&stream, &file);
+    ck_assert_int_eq(file.header.nb_files, 2);
+
+    // content shorter than announced
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_insert_stream_begin("pic3", 72876, &stream, &file));
+    ck_assert_err_none(do_insert_stream_write(&stream, image, 1000, &file));
+    ck_assert_err(do_insert_stream_commit(&stream, &file), ERR_IO);
+    ck_assert_int_eq(file.header.nb_files, 2);
+
+    do_close(&file);
+    ck_assert_int_eq(stat(dump, &st), 0);
+    ck_assert_int_eq(st.st_size, 192659);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_valid)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    static char image1[82234];
+    static char image2[40861];
+    char invalid[1000] = {0};
+    struct imgfs_file file;
+    struct imgfs_insert_item items[5];
+    size_t nb_inserted = 0;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image1, DATA_DIR "/brouillard.jpg", 82234);
+    read_file(image2, DATA_DIR "/mure.jpg", 40861);
+
+    memset(items, 0, sizeof(items));
+    const char* ids[5] = { "pic3", "pic1", "pic4", "pic5", "pic6" };
+    const char* data[5] = { image1, image1, image2, invalid, image1 };
+    const size_t sizes[5] = { 82234, 82234, 40861, 1000, 82234 };
+    for (size_t i = 0; i < 5; ++i) {
+        strcpy(items[i].img_id, ids[i]);
+        items[i].data = data[i];
+        items[i].size = sizes[i];
+    }
+
+    ck_assert_err_none(do_insert_batch_prepare(items, 5, 4));
+    ck_assert_err(items[3].result, ERR_IMGLIB);
+    ck_assert_int_eq(items[0].width, 600);
+    ck_assert_int_eq(items[0].height, 400);
+
+    ck_assert_err_none(do_insert_batch(items, 5, &nb_inserted, &file));
+    ck_assert_int_eq(nb_inserted, 3);
+    ck_assert_err_none(items[0].result);
+    ck_assert_err(items[1].result, ERR_DUPLICATE_ID);
+    ck_assert_err_none(items[2].result);
+    ck_assert_err_none(items[4].result);
+    do_close(&file);
+
+    // contents appended in order, the copy of an earlier item shared
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(file.header.version, 5);
+    ck_assert_int_eq(file.header.nb_files, 5);
+    size_t index = 0;
+    ck_assert_err_none(find_image("pic3", &file, &index));
+    ck_assert_int_eq(file.metadata[index].offset[ORIG_RES], 192659);
+    ck_assert_int_eq(file.metadata[index].orig_res[0], 600);
+    ck_assert_err_none(find_image("pic4", &file, &index));
+    ck_assert_int_eq(file.metadata[index].offset[ORIG_RES], 192659 + 82234);
+    ck_assert_int_eq(file.metadata[index].size[ORIG_RES], 40861);
+    ck_assert_err_none(find_image("pic6", &file, &index));
+    ck_assert_int_eq(file.metadata[index].offset[ORIG_RES], 192659);
+
+    char read_back[40861];
+    ck_assert_int_eq(fseek(file.file, 192659 + 82234, SEEK_SET), 0);
+    ck_assert_int_eq(fread(read_back, 40861, 1, file.file), 1);
+    ck_assert_mem_eq(read_back, image2, 40861);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -352,6 +517,9 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_valid);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
+    Add_Test(s, do_insert_stream_valid);
+    Add_Test(s, do_insert_stream_errors);
+    Add_Test(s, do_insert_batch_valid);
 
     return s;
 }
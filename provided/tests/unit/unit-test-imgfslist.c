@@ -92,6 +92,53 @@ START_TEST(do_list_json_non_emtpy)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_list_ids_pages)
+{
+    start_test_print;
+
+    char ids[2][MAX_IMG_ID + 1];
+    size_t nb_ids = 42;
+    struct imgfs_file file;
+    struct imgfs_list_cursor cursor = { 0, 0 };
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // one at a time
+    ck_assert_err_none(do_list_ids(&file, "", &cursor, ids, 1, &nb_ids));
+    ck_assert_uint_eq(nb_ids, 1);
+    ck_assert_str_eq(ids[0], "pic1");
+    ck_assert_err_none(do_list_ids(&file, "", &cursor, ids, 1, &nb_ids));
+    ck_assert_uint_eq(nb_ids, 1);
+    ck_assert_str_eq(ids[0], "pic2");
+    ck_assert_err_none(do_list_ids(&file, "", &cursor, ids, 1, &nb_ids));
+    ck_assert_uint_eq(nb_ids, 0);
+    ck_assert_uint_eq(cursor.slot, file.header.max_files);
+
+    // offset
+    cursor = (struct imgfs_list_cursor) { 0, 1 };
+    ck_assert_err_none(do_list_ids(&file, "", &cursor, ids, 2, &nb_ids));
+    ck_assert_uint_eq(nb_ids, 1);
+    ck_assert_str_eq(ids[0], "pic2");
+
+    // prefix
+    cursor = (struct imgfs_list_cursor) { 0, 0 };
+    ck_assert_err_none(do_list_ids(&file, "pic2", &cursor, ids, 2, &nb_ids));
+    ck_assert_uint_eq(nb_ids, 1);
+    ck_assert_str_eq(ids[0], "pic2");
+    cursor = (struct imgfs_list_cursor) { 0, 0 };
+    ck_assert_err_none(do_list_ids(&file, "img", &cursor, ids, 2, &nb_ids));
+    ck_assert_uint_eq(nb_ids, 0);
+
+    ck_assert_invalid_arg(do_list_ids(&file, NULL, &cursor, ids, 2, &nb_ids));
+    ck_assert_invalid_arg(do_list_ids(&file, "", NULL, ids, 2, &nb_ids));
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_structures_test_suite()
 {
@@ -105,6 +152,7 @@ Suite *imgfs_structures_test_suite()
 
     Add_Test(s, do_list_json_emtpy);
     Add_Test(s, do_list_json_non_emtpy);
+    Add_Test(s, do_list_ids_pages);
     return s;
 }
 
@@ -52,6 +52,64 @@ START_TEST(get_resolution_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(get_resolution_same_as_stream_probe)
+{
+    start_test_print;
+
+    char image_buffer[82234];
+    read_file(image_buffer, DATA_DIR "/brouillard.jpg", 82234);
+
+    // streamed inserts feed the probe a few bytes at a time: same dimensions
+    struct jpeg_probe probe;
+    jpeg_probe_init(&probe);
+    for (size_t done = 0; done < sizeof(image_buffer) && !jpeg_probe_done(&probe); done += 7) {
+        ck_assert_err_none(jpeg_probe_feed(&probe, image_buffer + done, 7));
+    }
+    ck_assert(jpeg_probe_done(&probe));
+    ck_assert_uint_eq(probe.height, 400);
+    ck_assert_uint_eq(probe.width, 600);
+
+    // only the headers are needed (the frame header ends at byte 13598), and the same images are refused either way
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, image_buffer, 13598));
+    ck_assert_uint_eq(height, 400);
+    ck_assert_uint_eq(width, 600);
+    ck_assert_err(get_resolution(&height, &width, image_buffer, 13597), ERR_IMGLIB);
+    const char png[] = "\x89PNG\r\n\x1a\n";
+    ck_assert_err(get_resolution(&height, &width, png, sizeof(png) - 1), ERR_IMGLIB);
+    jpeg_probe_init(&probe);
+    ck_assert_err(jpeg_probe_feed(&probe, png, sizeof(png) - 1), ERR_IMGLIB);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(get_resolution_skips_stray_bytes)
+{
+    start_test_print;
+
+    char image_buffer[13598];
+    read_file(image_buffer, DATA_DIR "/brouillard.jpg", sizeof(image_buffer));
+
+    // stray bytes (and a stuffed FF 00) after the first segment, accepted by libjpeg
+    static const char stray[] = "\x00\x12\xff\x00\x34";
+    const size_t first_end = 4 + ((size_t) (unsigned char) image_buffer[4] << 8 | (unsigned char) image_buffer[5]);
+    char damaged[sizeof(image_buffer) + sizeof(stray) - 1];
+    memcpy(damaged, image_buffer, first_end);
+    memcpy(damaged + first_end, stray, sizeof(stray) - 1);
+    memcpy(damaged + first_end + sizeof(stray) - 1, image_buffer + first_end, sizeof(image_buffer) - first_end);
+
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, damaged, sizeof(damaged)));
+    ck_assert_uint_eq(height, 400);
+    ck_assert_uint_eq(width, 600);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_get_resolution_test_suite()
 {
@@ -60,6 +118,8 @@ Suite *imgfs_get_resolution_test_suite()
     Add_Test(s, get_resolution_null);
     Add_Test(s, get_resolution_invalid_buffer);
     Add_Test(s, get_resolution_valid);
+    Add_Test(s, get_resolution_same_as_stream_probe);
+    Add_Test(s, get_resolution_skips_stray_bytes);
 
     return s;
 }
@@ -0,0 +1,143 @@
+#include "content_encoding.h"
+#include "imgfs.h"
+#include "list_cache.h"
+#include "test.h"
+#include <check.h>
+
+#define NB_LONG_IDS 32
+
+// test02 with other metadata in memory: enough images for the list to be worth compressing
+static void long_list_file(struct imgfs_file *file)
+{
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", file));
+    free(file->metadata);
+    file->header.version = 7;
+    file->header.nb_files = NB_LONG_IDS;
+    file->header.max_files = NB_LONG_IDS;
+    file->metadata = calloc(NB_LONG_IDS, sizeof(struct img_metadata));
+    ck_assert_ptr_nonnull(file->metadata);
+    for (int i = 0; i < NB_LONG_IDS; ++i) {
+        snprintf(file->metadata[i].img_id, MAX_IMG_ID, "image-with-a-long-name-%02d", i);
+        file->metadata[i].is_valid = NON_EMPTY;
+    }
+}
+
+// ======================================================================
+START_TEST(list_cache_null_params)
+{
+    start_test_print;
+
+    struct list_cache cache;
+    struct imgfs_file file;
+    enum http_encoding encoding = HTTP_ENCODING_IDENTITY;
+    char *body = NULL;
+    size_t len = 0;
+
+    memset(&cache, 0, sizeof(cache));
+    ck_assert_invalid_arg(list_cache_prepare(NULL, &file, &encoding));
+    ck_assert_invalid_arg(list_cache_prepare(&cache, NULL, &encoding));
+    ck_assert_invalid_arg(list_cache_prepare(&cache, &file, NULL));
+    ck_assert_invalid_arg(list_cache_copy(NULL, encoding, &body, &len));
+    ck_assert_invalid_arg(list_cache_copy(&cache, encoding, NULL, &len));
+    // nothing prepared yet
+    ck_assert_invalid_arg(list_cache_copy(&cache, encoding, &body, &len));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(list_cache_small_list_not_compressed)
+{
+    start_test_print;
+
+    struct list_cache cache;
+    struct imgfs_file file;
+    char etag[LIST_ETAG_SIZE];
+    char *body = NULL;
+    size_t len = 0;
+
+    memset(&cache, 0, sizeof(cache));
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // under MIN_COMPRESS_SIZE: sent as is, and tagged as such
+    enum http_encoding encoding = HTTP_ENCODING_GZIP;
+    ck_assert_err_none(list_cache_prepare(&cache, &file, &encoding));
+    ck_assert_int_eq(encoding, HTTP_ENCODING_IDENTITY);
+    list_cache_etag(&file.header, encoding, etag);
+    ck_assert_ptr_null(strstr(etag, "gzip"));
+
+    ck_assert_err_none(list_cache_copy(&cache, encoding, &body, &len));
+    ck_assert_int_eq(len, strlen("{ \"Images\": [ \"pic1\", \"pic2\" ] }"));
+    ck_assert_mem_eq(body, "{ \"Images\": [ \"pic1\", \"pic2\" ] }", len);
+    ck_assert_ptr_null(cache.body[HTTP_ENCODING_GZIP]);
+
+    free(body);
+    list_cache_invalidate(&cache);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(list_cache_compressed_once_per_version)
+{
+    start_test_print;
+
+    struct list_cache cache;
+    struct imgfs_file file;
+    char etag[LIST_ETAG_SIZE];
+    char *body = NULL;
+    size_t len = 0;
+
+    memset(&cache, 0, sizeof(cache));
+    long_list_file(&file);
+
+    enum http_encoding encoding = HTTP_ENCODING_GZIP;
+    ck_assert_err_none(list_cache_prepare(&cache, &file, &encoding));
+    ck_assert_int_eq(encoding, HTTP_ENCODING_GZIP);
+    ck_assert_uint_ge(cache.len[HTTP_ENCODING_IDENTITY], MIN_COMPRESS_SIZE);
+    list_cache_etag(&file.header, encoding, etag);
+    ck_assert_str_eq(etag, "\"list-7-32-gzip\"");
+
+    ck_assert_err_none(list_cache_copy(&cache, encoding, &body, &len));
+    ck_assert_int_eq(len, cache.len[HTTP_ENCODING_GZIP]);
+    ck_assert_mem_eq(body, "\x1f\x8b", 2);
+    free(body);
+
+    // same version: the compressed body is kept
+    const char *compressed = cache.body[HTTP_ENCODING_GZIP];
+    ck_assert_err_none(list_cache_prepare(&cache, &file, &encoding));
+    ck_assert_ptr_eq(cache.body[HTTP_ENCODING_GZIP], compressed);
+
+    // new version: rendered again
+    file.metadata[0].is_valid = EMPTY;
+    file.header.nb_files--;
+    file.header.version++;
+    ck_assert_err_none(list_cache_prepare(&cache, &file, &encoding));
+    ck_assert_ptr_null(strstr(cache.body[HTTP_ENCODING_IDENTITY], "image-with-a-long-name-00"));
+    list_cache_etag(&file.header, HTTP_ENCODING_IDENTITY, etag);
+    ck_assert_str_eq(etag, "\"list-8-31\"");
+
+    list_cache_invalidate(&cache);
+    ck_assert_ptr_null(cache.body[HTTP_ENCODING_IDENTITY]);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *list_cache_test_suite()
+{
+    Suite *s = suite_create("Tests for the /imgfs/list cache");
+
+    Add_Test(s, list_cache_null_params);
+    Add_Test(s, list_cache_small_list_not_compressed);
+    Add_Test(s, list_cache_compressed_once_per_version);
+
+    return s;
+}
+
+TEST_SUITE(list_cache_test_suite)